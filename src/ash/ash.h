@@ -12,18 +12,66 @@
 #define __ASH_H__
 
 #include <linux/types.h>
+#include <linux/stddef.h>
 #include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/bio.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/ioctl.h>
  
 #define ASH_MAGIC		0x451
-#define ASH_VERSION		10
+#define ASH_VERSION		15
 
 #define ASH_SECTORSIZE 		512
 #define ASH_SECTORBITS		9
 
-// these values need to be used for reading/writing,
-// unless we want to block the kernel :P
-#define KERNEL_BLOCKSIZE	4096
-#define KERNEL_BLOCKBITS	12
+// block sizes ashformat can make, always a power of 2
+#define ASH_MIN_BLOCKSIZE	512
+#define ASH_MAX_BLOCKSIZE	8192
+
+// most kernel blocks an Ash block can span (8192 bytes over 4096 byte pages)
+#define ASH_MAX_KBLOCKS		2
+
+// how many more buffer_heads a write batch makes room for when it fills up
+#define ASH_WBATCH_GROW		64
+
+// how the BAT dirty-entry log grows, and when it is applied even if nobody commits
+#define ASH_BAT_LOG_GROW	256
+#define ASH_BAT_LOG_MAX		8192
+
+// logical blocks between two entries of an inode's skip index, and how the index grows
+#define ASH_SKIP_STEP		64
+#define ASH_SKIP_GROW		16
+
+// blocks one operation may change; a handle commits the journal first if it has less room left
+#define ASH_JOURNAL_OP		32
+
+// most dirty pages over unwritten extents that writepages marks written in one operation
+#define ASH_CONVERT_MAX		256
+
+// directories with fewer entry blocks than this are searched without a hashed index
+#define ASH_DX_MIN_BLOCKS	2
+
+// entry refs added after the hashed index was built that are searched linearly before it is rebuilt
+#define ASH_DX_SLACK		64
+
+// lseek origins for the holes of sparse files, which this kernel doesn't have yet (see ash_file_llseek)
+#ifndef SEEK_DATA
+#define SEEK_DATA		3
+#define SEEK_HOLE		4
+#endif
+
+// argument of ASH_IOC_SEEK: SEEK_DATA and SEEK_HOLE through an ioctl, as sys_lseek refuses them
+struct ash_seek {
+	__s64	offset;			// where to look from, then where the data or the hole is
+	__u32	origin;			// SEEK_DATA or SEEK_HOLE
+	__u32	pad;
+};
+
+#define ASH_IOC_SEEK		_IOWR('a', 1, struct ash_seek)
 
 
 // states for the filesystem
@@ -60,10 +108,121 @@ struct ash_raw_superblock {
 	__u16	BATstart;		// block where BAT starts
 	__u16	datastart;		// block where data starts
 	__u64	fnogen;			// number of generated files. used to get a unique number for new files
+	__u32	features;		// ASH_FEATURE_* chosen at format (since version 11)
+	__u32	itable;			// first block of the inode table, with ASH_FEATURE_DIRENT2 (since version 12)
+	__u32	free_blocks;		// free blocks as of the last sync, right if state is ASH_UMOUNT (since version 13)
+	__u32	journal;		// first block of the journal, with ASH_FEATURE_JOURNAL (since version 14)
+	__u32	journalblocks;		// size of the journal in blocks, its head included
+};
+
+// values for ash_raw_superblock.features
+#define ASH_FEATURE_EXTENTS	0x0001		// new regular files are extent mapped
+#define ASH_FEATURE_DIRENT2	0x0002		// directories hold ash_raw_dirent entries, records are in the inode table
+#define ASH_FEATURE_JOURNAL	0x0004		// metadata changes go through the journal (see journal.c)
+#define ASH_FEATURE_INLINE	0x0008		// new regular files keep their data in their entry while it fits,
+						// without ASH_FEATURE_DIRENT2 only
+
+// features this code knows how to handle
+#define ASH_FEATURES_KNOWN	(ASH_FEATURE_EXTENTS | ASH_FEATURE_DIRENT2 | ASH_FEATURE_JOURNAL | \
+				 ASH_FEATURE_INLINE)
+
+
+/*
+ * Head of the journal, in its first block. It describes the one transaction
+ * the journal holds: where each of its blocks goes, their new contents being
+ * in the blocks right after the head, in the same order.
+ */
+struct ash_raw_jhead {
+	__u32	magic;			// ASH_JMAGIC while the transaction is to be replayed
+	__u32	seq;			// number of the transaction
+	__u32	nr;			// blocks in it
+	__u32	csum;			// crc32 of their contents, one after the other
+	__u32	blocks[];		// where each of them goes
 };
+
+#define ASH_JMAGIC		0x4a687341
  
 
 
+/*
+ * Ash information kept in memory for a mounted filesystem, in s_fs_info
+ *
+ */
+struct ash_sb_info {
+	struct ash_raw_superblock	raw;		// copy of the superblock from the disk
+	uint32_t			blocksize;	// Ash block size, can differ from sb->s_blocksize
+	int				blockbits;
+	
+	// how Ash blocks map to the kernel blocks (sb->s_blocksize) of the device,
+	// only one of them is not 0
+	int				kper_bits;	// log2 of kernel blocks per Ash block
+	int				aper_bits;	// log2 of Ash blocks per kernel block
+	
+	// Used Blocks Bitmap, in memory while mounted (see ubb.c)
+	unsigned long			*ubb;		// bit n set = block n used
+	spinlock_t			ubb_lock;
+	uint32_t			ubb_cursor;	// where the next free block search starts
+	unsigned long			*ubb_dirty;	// bit n set = UBB block n changed since the last sync
+	struct rb_root			fext_start;	// free extents by start block (see ubb.c)
+	struct rb_root			fext_len;	// free extents by length
+	int				fext_stale;	// the index lost runs, rebuild it before the next allocation
+	struct ash_frun			*fext_pend;	// runs freed in the running transaction, kept from the index until it commits
+	uint32_t			fext_pend_nr;
+	uint32_t			fext_pend_max;
+	uint32_t			pend_blocks;	// blocks in these runs
+	uint32_t			free_blocks;	// blocks not used
+	uint32_t			resv_blocks;	// free blocks promised to delayed writes
+	
+	spinlock_t			raw_lock;	// for the fields of raw that change while mounted (fnogen)
+	
+	// in memory copies of the BAT blocks, read on first use (see bat.c)
+	uint32_t			**bat;
+	spinlock_t			bat_lock;
+	
+	// BAT entries changed since the last commit, by block number
+	struct mutex			bat_log_lock;
+	uint32_t			*bat_log;
+	uint32_t			bat_log_nr;
+	uint32_t			bat_log_max;
+	
+	struct {
+		unsigned long		commits;	// times the log was applied
+		unsigned long		blocks;		// BAT blocks dirtied by all of them
+		unsigned long		last_blocks;	// BAT blocks dirtied by the last one
+	} bat_stats;
+	
+	struct inode			*itable;	// the inode table as a file, with ASH_FEATURE_DIRENT2
+	
+	// free records of the inode table, whose file numbers are given out again (see itable.c)
+	struct mutex			fno_lock;
+	uint64_t			*fno_free;	// numbers of records freed, a stack
+	uint32_t			fno_nfree;
+	uint64_t			fno_scan;	// records from here to fno_scan_end were not looked at yet
+	uint64_t			fno_scan_end;	// the last one there was at mount
+	struct ash_journal		*journal;	// with ASH_FEATURE_JOURNAL, see journal.c
+};
+
+#define ASH_SB(sb)	((struct ash_sb_info*) (sb)->s_fs_info)
+
+// the directories of the filesystem hold ash_raw_dirent entries
+#define ASH_DIRENT2(sb)	(ASH_SB(sb)->raw.features & ASH_FEATURE_DIRENT2)
+
+// first 512 byte sector of an Ash block
+static inline sector_t ash_block_sector (struct super_block *sb, uint32_t block)
+{
+	return (sector_t) block << (ASH_SB(sb)->blockbits - ASH_SECTORBITS);
+}
+
+// free blocks not promised to delayed writes nor waiting for a commit, called with ubb_lock held
+static inline uint32_t ash_avail_blocks (struct ash_sb_info *sbi)
+{
+	uint32_t held = sbi->resv_blocks + sbi->pend_blocks;
+	
+	return sbi->free_blocks > held ? sbi->free_blocks - held : 0;
+}
+
+
+
 // values defined for ash_raw_file.ashtype field
 #define ASHTYPE_NORMAL		1
 #define ASHTYPE_CRYPT		2
@@ -80,6 +239,7 @@ struct ash_raw_superblock {
 struct ash_raw_file {
 	__u16	mode;			// Linux file type and access rights
 	__u8	ashtype;		// special Ash type
+	__u8	flags;			// ASH_FL_* (was padding before version 11)
 	__u32	uid;			// owner ID
 	__u32	gid;			// group ID
 	__u64	size;			// file length in bytes
@@ -91,6 +251,370 @@ struct ash_raw_file {
 	char	name[256];		// filename
 };
 
+// values for ash_raw_file.flags
+#define ASH_FL_EXTENTS		0x01		// startblock is the root of an extent tree, not a BAT chain
+#define ASH_FL_INLINE		0x02		// the data is in the entry, after the end of the name
+#define ASH_FL_UNWRITTEN	0x04		// blocks from ASH_VALID_OFF on were preallocated and never written,
+						// they read as zeroes (since version 15)
+
+// where the data of an ASH_FL_INLINE file starts in its entry, after a name of len bytes and its 0
+#define ASH_INLINE_OFF(len)	(offsetof(struct ash_raw_file, name) + (len) + 1)
+
+// where an ASH_FL_UNWRITTEN file keeps the number of its blocks that hold data (__u32):
+// the end of the name field, which a name must leave free for it
+#define ASH_VALID_OFF		(sizeof(struct ash_raw_file) - sizeof(__u32))
+
+// longest name such a file can have, with room left for its 0
+#define ASH_VALID_NAME_MAX	(ASH_VALID_OFF - offsetof(struct ash_raw_file, name) - 1)
+
+
+/*
+ * Compact directory entry, with ASH_FEATURE_DIRENT2. Only the name is in the
+ * directory; the rest of what an ash_raw_file holds is the file's record
+ * (ash_raw_inode) in the inode table, at index fno. Entries are 4 byte
+ * aligned and never cross a block; the last one of a full block stretches
+ * to its end.
+ *
+ */
+struct ash_raw_dirent {
+	__u64	fno;			// file number, 0 for a deleted entry
+	__u16	rec_len;		// bytes from this entry to the next one
+	__u8	name_len;		// the name is not 0 terminated
+	__u8	type;			// DT_* of the file, so listing needs no record
+	char	name[];
+};
+
+// bytes an entry with a name of len chars needs
+#define ASH_DIRENT_HDR		offsetof(struct ash_raw_dirent, name)
+#define ASH_DIRENT_LEN(len)	((ASH_DIRENT_HDR + (len) + 3) & ~3)
+
+
+/*
+ * Record of a file in the inode table, with ASH_FEATURE_DIRENT2: an ash_raw_file
+ * without the name. Record n is the file with fno n.
+ *
+ */
+struct ash_raw_inode {
+	__u16	mode;
+	__u8	ashtype;
+	__u8	flags;
+	__u32	uid;
+	__u32	gid;
+	__u64	size;
+	__u32	atime;
+	__u32	wtime;
+	__u32	ctime;
+	__u32	startblock;
+	__u64	fno;			// same as the index, 0 for a free record
+	__u32	valid;			// blocks holding data, with ASH_FL_UNWRITTEN (since version 15)
+	__u8	pad[12];		// 0, keeps records at 64 bytes
+};
+
+
+#define ASH_EXT_MAGIC		0xA5E7
+
+/*
+ * Header at the start of an extent tree block (see extent.c)
+ *
+ */
+struct ash_raw_extent_header {
+	__u16	magic;			// ASH_EXT_MAGIC
+	__u16	nr;			// entries in use
+	__u16	max;			// entries that fit in the block
+	__u16	depth;			// 0: entries are extents, 1: entries point to leaf blocks
+};
+
+/*
+ * An entry of an extent tree block: len blocks of the file starting with lblock
+ * are on the disk starting with start. In a depth 1 block, start is the leaf
+ * holding the extents from lblock on, and len is not used.
+ *
+ */
+struct ash_raw_extent {
+	__u32	lblock;			// first logical block
+	__u32	start;			// first physical block
+	__u32	len;			// number of blocks, with ASH_EXT_UNWRITTEN
+};
+
+// in the len of a leaf extent: its blocks were preallocated and never written,
+// they read as zeroes (since version 15)
+#define ASH_EXT_UNWRITTEN	0x80000000
+#define ASH_EXT_LEN(e)		((e)->len & ~ASH_EXT_UNWRITTEN)
+
+
+#define ASH_DX_MAGIC		0xA5D1
+
+/*
+ * First block of the hashed name index of a directory (see dentry.c). The index
+ * is linked in the directory's BAT chain right after its last entry block, so
+ * readers that stop at the directory's size never see it. The hash table
+ * starts in the next block of the index.
+ *
+ */
+struct ash_raw_dx_header {
+	__u16	magic;			// ASH_DX_MAGIC
+	__u16	pad;
+	__u32	refs;			// entry refs of the directory that were indexed
+	__u32	buckets;		// entries of the hash table, a power of 2
+	__u32	blocks;			// blocks of the index, this one included
+	__u32	used;			// buckets in use, some maybe for entries deleted since
+};
+
+/*
+ * A bucket of the hashed name index: the hash of the name and where its entry is.
+ * An entry ref is the slot of the entry, or in ash_raw_dirent directories its
+ * position in 4 byte units.
+ *
+ */
+struct ash_raw_dx_entry {
+	__u32	hash;
+	__u32	ref;			// entry ref + 1, 0 for an empty bucket
+};
+
+
+/*
+ * A view of an Ash block as it is in the buffer cache: the buffer_heads holding it
+ * stay pinned between ash_bget and ash_bput, so it can be read and changed in place
+ *
+ */
+struct ash_bview {
+	struct super_block	*sb;
+	uint32_t		block;			// Ash block number
+	uint32_t		off;			// where the block starts in bh[0]
+	int			nr;			// number of pinned buffer_heads
+	struct buffer_head	*bh[ASH_MAX_KBLOCKS];
+	char			*data;			// the whole block, when it lies in a single buffer_head
+};
+
+// directions for ash_bview_copy
+#define ASH_BVIEW_READ		0
+#define ASH_BVIEW_WRITE		1
+#define ASH_BVIEW_ZERO		2
+
+
+// Pins the block in the buffer cache, reading it if needed. returns 0 on success
+extern int ash_bget (struct super_block *sb, uint32_t block, struct ash_bview *view);
+
+// Pins a block that will be overwritten: reads only what it shares with other blocks
+// and zeroes it. returns 0 on success
+extern int ash_bget_new (struct super_block *sb, uint32_t block, struct ash_bview *view);
+
+// Releases a view taken with ash_bget/ash_bget_new
+extern void ash_bput (struct ash_bview *view);
+
+// Marks a view dirty after changing it in place
+extern void ash_bdirty (struct ash_bview *view);
+
+// Copies len bytes between buf and offset off of the viewed block, see ASH_BVIEW_*
+extern void ash_bview_copy (struct ash_bview *view, uint32_t off, void *buf, uint32_t len, int dir);
+
+// Pointer to len bytes at offset off in the view; in place if possible, or copied into tmp
+extern void* ash_bptr (struct ash_bview *view, uint32_t off, uint32_t len, void *tmp);
+
+
+/*
+ * Dirty buffer_heads gathered for an inode, to be sent to the disk together,
+ * sorted by their position on the device
+ *
+ */
+struct ash_wbatch {
+	struct mutex		lock;
+	int			nr;			// buffer_heads in bhs
+	int			max;			// room in bhs
+	struct buffer_head	**bhs;			// pinned until the batch is flushed
+};
+
+
+/*
+ * Ash specific information kept for each inode in memory, around the VFS inode.
+ * They come from ash_inode_cachep and stay in the inode cache, hashed by fno,
+ * after the last reference to the file is gone.
+ */
+struct ash_inode_info {
+	uint32_t		startblock;		// first block of the file's data, as in the dir entry
+	uint64_t		size;			// size from the dir entry
+	uint64_t		fno;			// file number
+	uint8_t			ashtype;		// special Ash type
+	uint8_t			flags;			// ASH_FL_* from the dir entry
+	struct ash_wbatch	wb;			// blocks written but not sent yet
+	struct mutex		alloc_lock;		// for the block counts below and the chain end
+	uint32_t		nr_blocks;		// blocks in the BAT chain, or the end of the last extent (holes included)
+	uint32_t		resv_blocks;		// blocks reserved by writes, not allocated yet
+	uint32_t		valid;			// blocks holding data, the others are unwritten (ASH_FL_UNWRITTEN)
+	uint32_t		lastblock;		// last block of the chain, 0 if not known
+	uint32_t		*skip;			// skip[i] = block holding logical block i * ASH_SKIP_STEP
+	uint32_t		nr_skip;
+	uint32_t		max_skip;
+	
+	// hashed name index of a directory, read on the first lookup (see dentry.c)
+	int			dx_state;		// ASH_DX_*
+	uint32_t		dx_refs;		// entry refs the index covers
+	uint32_t		dx_buckets;
+	uint32_t		dx_used;
+	
+	// deleted entries of a directory (see ash_dir_compact)
+	int			dir_holes;		// it has some, compact it when the last opener closes it
+	int			dir_open;		// open files of the directory, under i_mutex
+	uint64_t		free_hint;		// no hole for a new entry before this position
+	
+	// where the record of a file with an ash_raw_file entry is, 0 if it is in the inode table
+	uint32_t		rec_block;
+	uint32_t		rec_off;
+	uint32_t		inline_off;		// where the name ends in an ash_raw_file (ASH_INLINE_OFF)
+	
+	struct inode		vfs_inode;
+};
+
+// values for ash_inode_info.dx_state
+#define ASH_DX_UNKNOWN		0		// not looked for yet
+#define ASH_DX_NONE		1		// the directory has no index
+#define ASH_DX_OK		2
+#define ASH_DX_FAILED		3		// building it failed, not tried again before ASH_DX_SLACK more entries
+
+#define ASH_I(inode)	container_of(inode, struct ash_inode_info, vfs_inode)
+
+
+// readahead window limits, in pages
+#define ASH_RA_MIN		4
+#define ASH_RA_MAX		64
+
+/*
+ * Readahead state of an open file, in file->private_data
+ *
+ */
+struct ash_ra_state {
+	pgoff_t			next;			// page a sequential read would start with
+	pgoff_t			ahead;			// first page not read ahead yet
+	unsigned long		window;			// how many pages to keep ahead of the reader
+	
+	// where the readahead is in the BAT chain
+	uint32_t		lblock;			// logical block of the file
+	uint32_t		pblock;			// block on the disk holding it
+	
+	struct mutex		lock;			// readers sharing the open file
+};
+
+
+/*
+ * Where an entry is in its directory
+ *
+ */
+struct ash_dir_loc {
+	uint64_t		pos;			// position in the directory
+	uint32_t		block;			// the block holding it on the disk
+	uint32_t		off;			// and where it is in the block
+};
+
+
+// Makes an inode from a directory entry read from the disk. returns NULL if out of memory
+extern struct inode* ash_iget_raw (struct super_block *sb, struct ash_raw_file *rfile);
+
+// Fills in an entry with what the inode knows about the file, all but the name
+extern void ash_fill_raw (struct inode *inode, struct ash_raw_file *rfile);
+
+// Writes the record of the file on the disk from the inode. returns 0 on success
+extern int ash_write_record (struct inode *inode);
+
+// write_inode of the super_operations. returns 0 on success
+extern int ash_write_inode (struct inode *inode, int wait);
+
+// Finds the entry called name in a directory. returns 0 (entry in rfile, where it is in loc
+// if loc is not NULL), -ENOENT or -EIO
+extern int ash_dir_find (struct inode *dir, const char *name, int len, struct ash_raw_file *rfile,
+		struct ash_dir_loc *loc);
+
+// Adds the entry of inode, called name, to a directory. returns 0 on success
+extern int ash_dir_add (struct inode *dir, const char *name, int len, struct inode *inode);
+
+// Marks the entry called name of a directory deleted. returns 0, -ENOENT or -EIO
+extern int ash_dir_remove (struct inode *dir, const char *name, int len);
+
+// Tells if a directory has no entries. returns 1, 0 or -EIO
+extern int ash_dir_empty (struct inode *dir);
+
+// Packs the live entries of a directory and frees the blocks left over. returns 0 on success
+extern int ash_dir_compact (struct inode *dir);
+
+// Removes the hashed name index of a directory
+extern void ash_dx_drop (struct inode *dir);
+
+// Sets up the inode table of a filesystem with ASH_FEATURE_DIRENT2. returns 0 on success
+extern int ash_itable_init (struct super_block *sb);
+
+// Drops the inode table at umount
+extern void ash_itable_free (struct super_block *sb);
+
+// Reads the record of file fno from the inode table into rfile, all but the name. returns 0 on success
+extern int ash_itable_read (struct super_block *sb, uint64_t fno, struct ash_raw_file *rfile);
+
+// Writes the record of file fno in the inode table from rfile (fno 0 frees it). The block
+// goes in wb if given. returns 0 on success
+extern int ash_itable_write (struct super_block *sb, uint64_t fno, struct ash_raw_file *rfile,
+		struct ash_wbatch *wb);
+
+// Takes a free record of the inode table for a new file. returns its fno, or 0 if there is none
+extern uint64_t ash_itable_reuse (struct super_block *sb);
+
+
+/*
+ * Where readdir stopped in an open directory, in file->private_data, so the
+ * next call goes on from there without looking the block up again
+ *
+ */
+struct ash_dir_cursor {
+	loff_t			f_pos;			// the f_pos it is for
+	uint64_t		version;		// i_version of the directory then
+	uint32_t		lblock;			// logical block of the directory at f_pos, or the one before
+	uint32_t		pblock;			// where it is on the disk
+};
+
+
+// Sets up an empty write batch
+extern void ash_wbatch_init (struct ash_wbatch *wb);
+
+// Adds the buffer_heads of a dirty block view to the batch
+// returns 0 on success
+extern int ash_wbatch_add (struct ash_wbatch *wb, struct ash_bview *view);
+
+// Sends the batch to the disk in device order, merging neighbouring blocks in the same bio
+// and waits for it if wait != 0. returns 0 on success
+extern int ash_wbatch_flush (struct super_block *sb, struct ash_wbatch *wb, int wait);
+
+// Drops the batch without writing it. The blocks remain dirty for the normal writeback
+extern void ash_wbatch_release (struct ash_wbatch *wb);
+
+// Writes the UBB, the BAT changes and the superblock to the buffer cache. returns 0 on success
+extern int ash_sync_super (struct super_block *sb);
+
+// Replays what the journal holds and sets it up for the mount. returns 0 on success
+extern int ash_journal_load (struct super_block *sb);
+
+// Drops the journal at umount, after the last commit
+extern void ash_journal_free (struct super_block *sb);
+
+// Starts an operation that changes metadata. returns what ash_journal_stop needs
+extern int ash_journal_start (struct super_block *sb);
+
+// Ends the operation started by ash_journal_start
+extern void ash_journal_stop (struct super_block *sb, int started);
+
+// Tells if the caller is inside an operation
+extern int ash_journal_inside (void);
+
+// Takes a changed block into the running transaction
+extern void ash_journal_dirty (struct ash_bview *view);
+
+// Drops blocks that now hold file data from the running transaction
+extern void ash_journal_forget (struct super_block *sb, uint32_t start, uint32_t len);
+
+// Writes the running transaction to the journal, then its blocks to their places.
+// returns 0 on success
+extern int ash_journal_commit (struct super_block *sb);
+
+// Writes a block of an inode; it is sent with the inode's other blocks by ash_wbatch_flush
+// returns 0 on success
+extern int block_write_inode (struct inode *inode, void *data, uint32_t block);
+
 
 // Reads a block from the drive and returns a buffer of blocksize bytes
 // or NULL in case of an error
@@ -101,10 +625,94 @@ extern void* block_read (struct super_block *sb, uint32_t block);
 extern int block_write (struct super_block *sb, void *data, uint32_t block);
 
 
+/*
+ * State shared by the bios of an extent read, so the caller can wait for all of them
+ *
+ */
+struct ash_extent_io {
+	atomic_t		pending;	// bios still in flight + 1 for the submitter
+	int			error;		// set if any of the bios failed
+	struct completion	done;
+};
+
+
+// Reads count consecutive blocks starting with start, straight into the caller's pages,
+// which must hold count * blocksize bytes. returns 0 on success
+extern int block_read_extent (struct super_block *sb, uint32_t start, uint32_t count, struct page **pages);
+
+// Sends bios reading (rw READ) or writing (rw WRITE) bytes from sector on with pages.
+// end_io gets called for each bio. returns the number of pages sent
+extern int ash_rw_pages (struct super_block *sb, int rw, sector_t sector, struct page **pages,
+		unsigned long bytes, bio_end_io_t *end_io, struct ash_extent_io *io);
+
+// Sets up an ash_extent_io before the bios it accounts for are sent
+extern void ash_extent_io_init (struct ash_extent_io *io);
+
+// Completion of the bios accounted in an ash_extent_io, an end_io for ash_rw_pages
+extern void ash_extent_end_io (struct bio *bio, int err);
+
+// Waits for the bios accounted in io. returns 0 on success, -EIO if one failed
+extern int ash_extent_io_wait (struct super_block *sb, struct ash_extent_io *io);
+
+// Sends a bio for Ash block block, between the device and page from offset off on,
+// accounted in io. returns 0 on success
+extern int ash_block_bio (struct super_block *sb, int rw, uint32_t block, struct page *page,
+		unsigned int off, struct ash_extent_io *io);
+
+// Drops buffer cache copies of blocks that are becoming file data
+extern void ash_forget_blocks (struct super_block *sb, uint32_t start, uint32_t len);
+
+
+// Reads the UBB into memory at mount. returns 0 on success
+extern int ash_ubb_load (struct super_block *sb);
+
+// Writes the changed part of the in memory UBB back to the disk. returns 0 on success
+extern int ash_ubb_sync (struct super_block *sb);
+
+// Counts the UBB blocks the next ash_ubb_sync writes
+extern uint32_t ash_ubb_dirty_blocks (struct super_block *sb);
+
+// Gives the allocator the blocks freed in the transaction just committed
+extern void ash_ubb_committed (struct super_block *sb);
+
+// Frees the in memory UBB
+extern void ash_ubb_free (struct super_block *sb);
+
 // Returns the number of the first available block
-// -1 on error
+// 0 if there is none
 extern int block_first_free(struct super_block *sb);
 
+// Allocates up to want contiguous blocks, from goal if it is free, else from the best fitting run,
+// leaving the reserved ones alone. returns the number of blocks allocated from *start, or -ENOSPC
+extern int ash_alloc_run (struct super_block *sb, uint32_t goal, uint32_t want, uint32_t *start);
+
+// Same as ash_alloc_run, for blocks reserved before; what it allocates is no longer reserved
+extern int ash_alloc_reserved (struct super_block *sb, uint32_t goal, uint32_t want, uint32_t *start);
+
+// Marks len blocks starting with start as free
+extern void ash_free_run (struct super_block *sb, uint32_t start, uint32_t len);
+
+// Frees blocks from ash_alloc_reserved that were not used, and reserves them again
+extern void ash_free_reserved (struct super_block *sb, uint32_t start, uint32_t len);
+
+// Promises count free blocks to a delayed write. returns 0 or -ENOSPC
+extern int ash_reserve_blocks (struct super_block *sb, uint32_t count);
+
+// Gives back count reserved blocks, used or not
+extern void ash_release_blocks (struct super_block *sb, uint32_t count);
+
+// Allocates and links into the BAT the blocks reserved by the writes to an inode
+extern int ash_alloc_delayed (struct inode *inode);
+
+// Gives back all the blocks of a file that is being deleted
+extern void ash_free_blocks (struct inode *inode);
+
+// Keeps the data of an inline file in the page cache once its last entry goes
+extern void ash_inline_unlink (struct inode *inode);
+
+// Gives an inline file blocks for its data, before its entry moves. returns 0 on success
+extern int ash_inline_detach (struct inode *inode);
+
 // Reads what value a block has in the Used Blocks Bitmap
 // returns 0, 1 or -1 in case of error
 extern int UBB_read (struct super_block *sb, uint32_t block);
@@ -116,6 +724,66 @@ extern int UBB_write (struct super_block *sb, uint32_t block, uint8_t val);
 // Get the number of the next block of data following block from the Block Allocation Table
 extern int BAT_read (struct super_block *sb, uint32_t block);
 
+// Sets up the in memory BAT at mount. returns 0 on success
+extern int ash_bat_init (struct super_block *sb);
+
+// Frees the in memory BAT
+extern void ash_bat_free (struct super_block *sb);
+
+// Puts the BAT entries changed since the last commit into the buffer cache. returns 0 on success
+extern int ash_bat_commit (struct super_block *sb);
+
+// Counts the BAT blocks the next ash_bat_commit may dirty, at most
+extern uint32_t ash_bat_log_blocks (struct super_block *sb);
+
+// Finds the physical block of logical block lblock of a file. returns 0, -ENOENT or -EIO
+extern int ash_bmap (struct inode *inode, uint32_t lblock, uint32_t *pblock);
+
+// Drops the skip index of an inode
+extern void ash_bmap_forget (struct ash_inode_info *ei);
+
+// Drops the part of the skip index of an inode from logical block lblock on
+extern void ash_bmap_truncate (struct ash_inode_info *ei, uint32_t lblock);
+
+// Frees at most max blocks of the BAT chain starting with block.
+// returns the block the chain goes on with, 0 at its end
+extern int ash_free_chain (struct super_block *sb, uint32_t block, uint32_t max);
+
+// Finds the physical block of logical block lblock of an extent mapped file.
+// returns 0, 1 if the block is unwritten, -ENOENT or -EIO
+extern int ash_ext_map (struct inode *inode, uint32_t lblock, uint32_t *pblock);
+
+// Last physical block of an extent mapped file, 0 if it has none, -1 on error. Its logical end in *end
+extern int ash_ext_tail (struct inode *inode, uint32_t *end);
+
+// Blocks the extents of an extent mapped file map, in *count. returns 0 on success
+extern int ash_ext_count (struct inode *inode, uint32_t *count);
+
+// First extent of an extent mapped file ending after lblock. returns 0, -ENOENT or -EIO
+extern int ash_ext_next (struct inode *inode, uint32_t lblock, struct ash_raw_extent *e);
+
+// Maps len blocks from start at lblock, at or past the end of an extent mapped file. returns 0 on success
+// len may carry ASH_EXT_UNWRITTEN
+extern int ash_ext_append (struct inode *inode, uint32_t lblock, uint32_t start, uint32_t len);
+
+// Maps len blocks from start at lblock, in a hole of an extent mapped file or past its end. returns 0 on success
+// len may carry ASH_EXT_UNWRITTEN
+extern int ash_ext_insert (struct inode *inode, uint32_t lblock, uint32_t start, uint32_t len);
+
+// Whether some of the blocks of an extent mapped file from lblock to end are unwritten. returns 1, 0 or -EIO
+extern int ash_ext_unwritten (struct inode *inode, uint32_t lblock, uint32_t end);
+
+// Marks the blocks of an extent mapped file from lblock to end written. returns 0 on success
+extern int ash_ext_convert (struct inode *inode, uint32_t lblock, uint32_t end);
+
+// Frees at most max blocks mapped from logical block *lblock on, and the extent tree
+// blocks done with. returns 1 if there is more to free
+extern int ash_ext_free (struct inode *inode, uint32_t *lblock, uint32_t max);
+
+// Number of blocks following block one after the other on the disk in its BAT chain, at most max
+// -1 on error
+extern int BAT_extent (struct super_block *sb, uint32_t block, uint32_t max);
+
 // Write the number of the entry for the block in the BAT
 // returns 0 on success
 extern int BAT_write (struct super_block *sb, uint32_t block, uint32_t entry);
@@ -0,0 +1,510 @@
+/*
+ * Ash File System
+ *
+ * Block Allocation Table. Entry n holds the block that follows block n in its
+ * file, 0 at the end of the chain. A BAT block is copied into memory the first
+ * time one of its entries is needed and stays there while mounted, so walking a
+ * chain costs no disk reads after the first pass.
+ *
+ * Writes change the copy and log which entry changed. ash_bat_commit applies
+ * the log to the buffer cache in one pass per BAT block, so an append that
+ * changes hundreds of entries of one BAT block dirties it once.
+ *
+ * Each inode also has a skip index: the physical block of every ASH_SKIP_STEP-th
+ * logical block it has walked to, so ash_bmap starts from the nearest one below
+ * instead of from the start of the chain.
+ *
+ * For licensing information, see the file 'LICENSE'
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/sort.h>
+#include "ash.h"
+
+
+/*
+ * Finds the BAT block and the offset in it of the entry for block
+ */
+static void BAT_locate (struct super_block *sb, uint32_t block, uint32_t *lB, uint32_t *lO)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	
+	// 4 bytes per entry, lB is counted from the start of the BAT
+	*lB = block >> (sbi->blockbits - 2);
+	*lO = (block << 2) & (sbi->blocksize - 1);
+}
+
+
+
+/*
+ * Gets the in memory copy of BAT block i, reading it on first use
+ * @return the copy, or NULL on error
+ */
+static uint32_t* ash_bat_block (struct super_block *sb, uint32_t i)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_bview view;
+	uint32_t *copy;
+	
+	spin_lock(&sbi->bat_lock);
+	copy = sbi->bat[i];
+	spin_unlock(&sbi->bat_lock);
+	
+	if (copy)
+		return copy;
+	
+	copy = kmalloc(sbi->blocksize, GFP_NOFS);
+	if (!copy)
+		return NULL;
+	
+	if (ash_bget(sb, sbi->raw.BATstart + i, &view)) {
+		kfree(copy);
+		return NULL;
+	}
+	
+	ash_bview_copy(&view, 0, copy, sbi->blocksize, ASH_BVIEW_READ);
+	ash_bput(&view);
+	
+	// somebody else may have read it meanwhile, and maybe changed it since
+	spin_lock(&sbi->bat_lock);
+	
+	if (sbi->bat[i]) {
+		kfree(copy);
+		copy = sbi->bat[i];
+	} else
+		sbi->bat[i] = copy;
+	
+	spin_unlock(&sbi->bat_lock);
+	
+	return copy;
+}
+
+
+
+/*
+ * Sets up the (empty) in memory BAT at mount
+ * @return 0 on success
+ */
+int ash_bat_init (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	
+	spin_lock_init(&sbi->bat_lock);
+	mutex_init(&sbi->bat_log_lock);
+	
+	sbi->bat = kcalloc(sbi->raw.BATblocks, sizeof(uint32_t*), GFP_KERNEL);
+	if (!sbi->bat)
+		return -ENOMEM;
+	
+	return 0;
+}
+
+
+
+/*
+ * Frees the in memory BAT
+ */
+void ash_bat_free (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	uint32_t i;
+	
+	if (!sbi->bat)
+		return;
+	
+	kfree(sbi->bat_log);
+	sbi->bat_log = NULL;
+	sbi->bat_log_nr = sbi->bat_log_max = 0;
+	
+	for (i = 0; i < sbi->raw.BATblocks; i++)
+		kfree(sbi->bat[i]);
+	
+	kfree(sbi->bat);
+	sbi->bat = NULL;
+}
+
+
+
+/*
+ * Get the number of the next block of data following block from the Block Allocation Table
+ * @return uint32_t number of block or -1 on error
+ */
+int BAT_read (struct super_block *sb, uint32_t block)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	uint32_t lB, lO, entry;
+	uint32_t *copy;
+	
+	if (block >= sbi->raw.maxblocks)
+		return -1;
+	
+	BAT_locate(sb, block, &lB, &lO);
+	
+	copy = ash_bat_block(sb, lB);
+	if (!copy)
+		return -1;
+	
+	spin_lock(&sbi->bat_lock);
+	entry = copy[lO >> 2];
+	spin_unlock(&sbi->bat_lock);
+	
+	return entry;
+}
+
+
+
+/*
+ * Follows the BAT chain from block and counts how many blocks are
+ * stored one right after the other on the disk, without going over max
+ * @return number of blocks in the extent (at least 1), or -1 on error
+ */
+int BAT_extent (struct super_block *sb, uint32_t block, uint32_t max)
+{
+	int next, len;
+	
+	for (len = 1; len < max; len++) {
+		next = BAT_read(sb, block);
+		
+		if (next < 0)
+			return -1;
+		
+		if (next != block + 1)
+			break;
+			
+		block = next;
+	}
+	
+	return len;
+}
+
+
+
+/*
+ * Compares two logged BAT entries by where they are on the disk
+ */
+static int ash_bat_cmp (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+	
+	return x < y ? -1 : x > y;
+}
+
+
+
+/*
+ * Puts the logged entries into the buffer cache, one pass per BAT block:
+ * the log is sorted, so each BAT block is pinned and dirtied only once
+ * however many of its entries changed. The values come from the in memory
+ * copy, which always has the last one written.
+ * Called with bat_log_lock held.
+ * @return 0 on success
+ */
+static int __ash_bat_commit (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_bview view;
+	uint32_t i, lB, lO, cur, touched;
+	uint32_t *copy;
+	int err = 0;
+	
+	if (sbi->bat_log_nr == 0)
+		return 0;
+	
+	sort(sbi->bat_log, sbi->bat_log_nr, sizeof(uint32_t), ash_bat_cmp, NULL);
+	
+	touched = 0;
+	
+	for (i = 0; i < sbi->bat_log_nr; ) {
+		BAT_locate(sb, sbi->bat_log[i], &cur, &lO);
+		
+		// the copy was read when the entry was logged, it is still there
+		copy = sbi->bat[cur];
+		
+		if (ash_bget(sb, sbi->raw.BATstart + cur, &view)) {
+			err = -EIO;
+			
+			// skip this BAT block, the rest can still go
+			while (i < sbi->bat_log_nr) {
+				BAT_locate(sb, sbi->bat_log[i], &lB, &lO);
+				if (lB != cur)
+					break;
+				i++;
+			}
+			continue;
+		}
+		
+		spin_lock(&sbi->bat_lock);
+		
+		for (; i < sbi->bat_log_nr; i++) {
+			BAT_locate(sb, sbi->bat_log[i], &lB, &lO);
+			if (lB != cur)
+				break;
+			
+			*(uint32_t*) ash_bptr(&view, lO, 4, NULL) = copy[lO >> 2];
+		}
+		
+		spin_unlock(&sbi->bat_lock);
+		
+		ash_bdirty(&view);
+		ash_bput(&view);
+		touched++;
+	}
+	
+	sbi->bat_log_nr = 0;
+	
+	sbi->bat_stats.commits++;
+	sbi->bat_stats.last_blocks = touched;
+	sbi->bat_stats.blocks += touched;
+	
+	return err;
+}
+
+
+
+/*
+ * Applies all the BAT changes logged since the last commit
+ * @return 0 on success
+ */
+int ash_bat_commit (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	int err;
+	
+	mutex_lock(&sbi->bat_log_lock);
+	err = __ash_bat_commit(sb);
+	mutex_unlock(&sbi->bat_log_lock);
+	
+	return err;
+}
+
+
+
+/*
+ * Counts the BAT blocks the next ash_bat_commit may dirty, at most one
+ * for each entry logged
+ */
+uint32_t ash_bat_log_blocks (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	uint32_t n;
+	
+	mutex_lock(&sbi->bat_log_lock);
+	n = min(sbi->bat_log_nr, sbi->raw.BATblocks);
+	mutex_unlock(&sbi->bat_log_lock);
+	
+	return n;
+}
+
+
+
+/*
+ * Write the number of the entry for the block in the BAT.
+ * Only the in memory copy changes here; the entry is logged and goes to the
+ * buffer cache with the others at the next ash_bat_commit.
+ * @return 0 on success
+ */
+int BAT_write (struct super_block *sb, uint32_t block, uint32_t entry)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	uint32_t lB, lO, *log;
+	uint32_t *copy;
+	int err = 0;
+	
+	if (block >= sbi->raw.maxblocks)
+		return -1;
+	
+	BAT_locate(sb, block, &lB, &lO);
+	
+	copy = ash_bat_block(sb, lB);
+	if (!copy)
+		return -1;
+	
+	mutex_lock(&sbi->bat_log_lock);
+	
+	// a full log is applied first, so it never needs more than ASH_BAT_LOG_MAX
+	if (sbi->bat_log_nr == ASH_BAT_LOG_MAX)
+		err = __ash_bat_commit(sb);
+	
+	if (sbi->bat_log_nr == sbi->bat_log_max) {
+		log = krealloc(sbi->bat_log, (sbi->bat_log_max + ASH_BAT_LOG_GROW) * sizeof(uint32_t), GFP_NOFS);
+		
+		if (!log) {
+			mutex_unlock(&sbi->bat_log_lock);
+			return -1;
+		}
+		
+		sbi->bat_log = log;
+		sbi->bat_log_max += ASH_BAT_LOG_GROW;
+	}
+	
+	spin_lock(&sbi->bat_lock);
+	copy[lO >> 2] = entry;
+	spin_unlock(&sbi->bat_lock);
+	
+	sbi->bat_log[sbi->bat_log_nr++] = block;
+	
+	mutex_unlock(&sbi->bat_log_lock);
+	
+	return err ? -1 : 0;
+}
+
+
+
+/*
+ * Remembers that logical block n * ASH_SKIP_STEP of the inode is block.
+ * Only the next entry is ever added, so the index has no gaps.
+ * Called with alloc_lock held.
+ */
+static void ash_skip_add (struct ash_inode_info *ei, uint32_t block)
+{
+	uint32_t *skip;
+	
+	if (ei->nr_skip == ei->max_skip) {
+		skip = krealloc(ei->skip, (ei->max_skip + ASH_SKIP_GROW) * sizeof(uint32_t), GFP_NOFS);
+		
+		// the index only speeds things up, it can stay short
+		if (!skip)
+			return;
+		
+		ei->skip = skip;
+		ei->max_skip += ASH_SKIP_GROW;
+	}
+	
+	ei->skip[ei->nr_skip++] = block;
+}
+
+
+
+/*
+ * Finds the physical block holding logical block lblock of a file. Starts at
+ * the closest block the skip index knows, so at most ASH_SKIP_STEP entries
+ * are followed for a block that was seen before.
+ * @return 0 on success, -ENOENT if the chain is shorter, -EIO on error
+ */
+int ash_bmap (struct inode *inode, uint32_t lblock, uint32_t *pblock)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_inode_info *ei = ASH_I(inode);
+	uint32_t i, n, block;
+	int next, err = 0;
+	
+	mutex_lock(&ei->alloc_lock);
+	
+	if (!ei->startblock) {
+		err = -ENOENT;
+		goto out;
+	}
+	
+	// no chain to walk, the extent tree is searched
+	if (ei->flags & ASH_FL_EXTENTS) {
+		err = ash_ext_map(inode, lblock, pblock);
+		goto out;
+	}
+	
+	if (ei->nr_skip == 0)
+		ash_skip_add(ei, ei->startblock);
+	
+	if (ei->nr_skip == 0) {
+		err = -ENOMEM;
+		goto out;
+	}
+	
+	i = min(lblock / ASH_SKIP_STEP, ei->nr_skip - 1);
+	block = ei->skip[i];
+	
+	for (n = i * ASH_SKIP_STEP; n < lblock; ) {
+		next = BAT_read(sb, block);
+		
+		if (next < 0) {
+			err = -EIO;
+			goto out;
+		}
+		
+		if (next == 0) {
+			err = -ENOENT;
+			goto out;
+		}
+		
+		block = next;
+		n++;
+		
+		if (n % ASH_SKIP_STEP == 0 && n / ASH_SKIP_STEP == ei->nr_skip)
+			ash_skip_add(ei, block);
+	}
+	
+	*pblock = block;
+	
+out:
+	mutex_unlock(&ei->alloc_lock);
+	
+	return err;
+}
+
+
+
+/*
+ * Forgets the skip index of an inode, when its chain changes or it leaves the memory
+ */
+void ash_bmap_forget (struct ash_inode_info *ei)
+{
+	kfree(ei->skip);
+	ei->skip = NULL;
+	ei->nr_skip = ei->max_skip = 0;
+}
+
+
+
+/*
+ * Forgets the part of an inode's skip index from logical block lblock on,
+ * when the chain changes after it. Called with alloc_lock held.
+ */
+void ash_bmap_truncate (struct ash_inode_info *ei, uint32_t lblock)
+{
+	uint32_t keep = (lblock + ASH_SKIP_STEP - 1) / ASH_SKIP_STEP;
+	
+	if (ei->nr_skip > keep)
+		ei->nr_skip = keep;
+}
+
+
+
+/*
+ * Gives back to the UBB the blocks of the BAT chain starting with block, at
+ * most max of them, a run of consecutive blocks at a time. The BAT entries
+ * are left as they are, whoever allocates the blocks again writes them; the
+ * freed ones are only used again after the commit, so the rest of the chain
+ * can be freed in the next operation.
+ * @return the block the chain goes on with, 0 at its end or on error
+ */
+int ash_free_chain (struct super_block *sb, uint32_t block, uint32_t max)
+{
+	uint32_t start, len, n;
+	int next;
+	
+	start = len = 0;
+	next = block;
+	
+	// a chain never has more links than the disk has blocks
+	max = min(max, ASH_SB(sb)->raw.maxblocks);
+	
+	for (n = 0; next > 0 && n < max; n++) {
+		block = next;
+		next = BAT_read(sb, block);
+	
+		if (len && block == start + len)
+			len++;
+		else {
+			ash_free_run(sb, start, len);
+			start = block;
+			len = 1;
+		}
+	}
+	
+	ash_free_run(sb, start, len);
+	
+	return max_t(int, next, 0);
+}
@@ -10,157 +10,1486 @@
 
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+#include <linux/err.h>
 #include "ash.h"
 
 
+// entries that fit in a directory block of ash_raw_file entries
+#define ASH_DIR_PER_BLOCK(sbi)	((sbi)->blocksize / sizeof(struct ash_raw_file))
+
+
+/*
+ * A walk over the entries of a directory, in either format. A position in the
+ * directory is (logical block << blockbits) + offset in the block; the size of
+ * the directory is the position after its last entry.
+ */
+struct ash_dir_iter {
+	struct inode		*dir;
+	struct ash_bview	view;		// the block of the entry, pinned while view.nr != 0
+	int			known;		// lblock and pblock are set
+	uint32_t		lblock;		// logical block of the last entry read
+	uint32_t		pblock;		// where it is on the disk
+	uint64_t		pos;		// position of the entry
+	
+	// the entry at pos
+	uint32_t		rec_len;	// bytes to the next entry
+	int			live;		// not deleted
+	uint64_t		fno;
+	unsigned		type;		// DT_*
+	const char		*name;
+	int			name_len;
+	struct ash_raw_file	*rfile;		// the whole entry, for ash_raw_file directories
+	struct ash_raw_file	tmp;		// where an entry crossing buffer_heads is copied
+};
+
+
+/*
+ * Hash of a file name for the directory index (32 bit FNV-1a).
+ * It is kept on the disk, so it must never change.
+ */
+static uint32_t ash_name_hash (const char *name, int len)
+{
+	uint32_t h = 2166136261U;
+	
+	while (len-- > 0) {
+		h ^= (uint8_t) *name++;
+		h *= 16777619;
+	}
+	
+	return h;
+}
+
+
+
+/*
+ * Number of blocks holding the entries of a directory. The first one
+ * is there even when the directory is empty.
+ */
+static uint32_t ash_dir_blocks (struct inode *dir)
+{
+	struct ash_sb_info *sbi = ASH_SB(dir->i_sb);
+	uint64_t size = ASH_I(dir)->size;
+	
+	if (!size)
+		return 1;
+	
+	return (size + sbi->blocksize - 1) >> sbi->blockbits;
+}
+
+
+
+/*
+ * Entry ref of a position in a directory: the slot for ash_raw_file
+ * entries, the position in 4 byte units for ash_raw_dirent ones
+ */
+static uint32_t ash_dir_ref (struct inode *dir, uint64_t pos)
+{
+	struct ash_sb_info *sbi = ASH_SB(dir->i_sb);
+	
+	if (ASH_DIRENT2(dir->i_sb))
+		return pos >> 2;
+	
+	return (pos >> sbi->blockbits) * ASH_DIR_PER_BLOCK(sbi) +
+		(pos & (sbi->blocksize - 1)) / sizeof(struct ash_raw_file);
+}
+
+
+
+/*
+ * Position in a directory of an entry ref
+ */
+static uint64_t ash_dir_ref_pos (struct inode *dir, uint32_t ref)
+{
+	struct ash_sb_info *sbi = ASH_SB(dir->i_sb);
+	uint32_t per = ASH_DIR_PER_BLOCK(sbi);
+	
+	if (ASH_DIRENT2(dir->i_sb))
+		return (uint64_t) ref << 2;
+	
+	return ((uint64_t) (ref / per) << sbi->blockbits) + (ref % per) * sizeof(struct ash_raw_file);
+}
+
+
+
+/*
+ * DT_* type of a file mode
+ */
+static inline unsigned ash_dir_type (umode_t mode)
+{
+	if (S_ISDIR(mode))
+		return DT_DIR;
+	
+	if (S_ISREG(mode))
+		return DT_REG;
+	
+	return DT_UNKNOWN;
+}
+
+
+
+/*
+ * Gets logical block lblock of the directory into the view of the walk.
+ * The block after the known one is one BAT step away, others are found
+ * with ash_bmap.
+ * @return 0 on success
+ */
+static int ash_dir_iter_map (struct ash_dir_iter *it, uint32_t lblock)
+{
+	struct super_block *sb = it->dir->i_sb;
+	uint32_t pblock;
+	int next;
+	
+	if (it->view.nr && lblock == it->lblock)
+		return 0;
+	
+	if (it->known && lblock == it->lblock)
+		pblock = it->pblock;
+	else if (it->known && lblock == it->lblock + 1) {
+		next = BAT_read(sb, it->pblock);
+		if (next <= 0)
+			return -EIO;
+	
+		pblock = next;
+	} else if (ash_bmap(it->dir, lblock, &pblock))
+		return -EIO;
+	
+	ash_bput(&it->view);
+	
+	if (ash_bget(sb, pblock, &it->view))
+		return -EIO;
+	
+	it->known = 1;
+	it->lblock = lblock;
+	it->pblock = pblock;
+	
+	return 0;
+}
+
+
+
+/*
+ * Reads the entry at it->pos, or at the start of the next block if no entry
+ * fits in what is left of the block
+ * @return 0 on success, -ENOENT after the last entry, -EIO on error
+ */
+static int ash_dir_iter_load (struct ash_dir_iter *it)
+{
+	struct super_block *sb = it->dir->i_sb;
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_raw_dirent d;
+	uint32_t off, min;
+	int err;
+	
+	min = ASH_DIRENT2(sb) ? ASH_DIRENT_LEN(0) : sizeof(struct ash_raw_file);
+	
+	while (1) {
+		if (it->pos >= ASH_I(it->dir)->size)
+			return -ENOENT;
+	
+		off = it->pos & (sbi->blocksize - 1);
+	
+		if (off + min <= sbi->blocksize)
+			break;
+	
+		it->pos = (it->pos | (sbi->blocksize - 1)) + 1;
+	}
+	
+	err = ash_dir_iter_map(it, it->pos >> sbi->blockbits);
+	if (err)
+		return err;
+	
+	if (!ASH_DIRENT2(sb)) {
+		// only copied if the entry crosses a buffer_head boundary
+		it->rfile = ash_bptr(&it->view, off, sizeof(struct ash_raw_file), &it->tmp);
+	
+		// a dentry can be marked deleted but still be present and accounted for space
+		it->live = it->rfile->ashtype != ASHTYPE_REMDENTRY;
+		it->fno = it->rfile->fno;
+		it->type = ash_dir_type(it->rfile->mode);
+		it->name = it->rfile->name;
+		it->name_len = strnlen(it->rfile->name, sizeof(it->rfile->name));
+		it->rec_len = sizeof(struct ash_raw_file);
+	
+		return 0;
+	}
+	
+	ash_bview_copy(&it->view, off, &d, ASH_DIRENT_HDR, ASH_BVIEW_READ);
+	
+	if (d.rec_len < ASH_DIRENT_LEN(d.name_len) || (d.rec_len & 3) || off + d.rec_len > sbi->blocksize) {
+		printk(KERN_ERR "bad entry at %llu in directory %lu\n",
+			(unsigned long long) it->pos, it->dir->i_ino);
+		return -EIO;
+	}
+	
+	it->rfile = NULL;
+	it->live = d.fno != 0;
+	it->fno = d.fno;
+	it->type = d.type;
+	it->name = ash_bptr(&it->view, off + ASH_DIRENT_HDR, d.name_len, it->tmp.name);
+	it->name_len = d.name_len;
+	it->rec_len = d.rec_len;
+	
+	return 0;
+}
+
+
+
+/*
+ * Starts a walk over the entries of a directory with the entry at pos
+ * (or the first one after it). ash_dir_iter_end must be called after it
+ * whatever it returns.
+ * @return 0 on success, -ENOENT if there are no entries from pos on, -EIO on error
+ */
+static int ash_dir_iter_start (struct inode *dir, uint64_t pos, struct ash_dir_iter *it)
+{
+	it->dir = dir;
+	it->view.nr = 0;
+	it->known = 0;
+	it->pos = pos;
+	
+	return ash_dir_iter_load(it);
+}
+
+
+
+/*
+ * Starts a walk at pos like ash_dir_iter_start, when the caller already knows
+ * that logical block lblock of the directory, the block of pos or the one
+ * before it, is pblock on the disk. Nothing is looked up to get there.
+ */
+static int ash_dir_iter_resume (struct inode *dir, uint64_t pos, uint32_t lblock, uint32_t pblock,
+		struct ash_dir_iter *it)
+{
+	it->dir = dir;
+	it->view.nr = 0;
+	it->known = 1;
+	it->lblock = lblock;
+	it->pblock = pblock;
+	it->pos = pos;
+	
+	return ash_dir_iter_load(it);
+}
+
+
+
+/*
+ * Moves the walk to the next entry
+ * @return 0 on success, -ENOENT after the last entry, -EIO on error
+ */
+static int ash_dir_iter_next (struct ash_dir_iter *it)
+{
+	it->pos += it->rec_len;
+	
+	return ash_dir_iter_load(it);
+}
+
+
+
+/*
+ * Ends a walk, unpinning its block
+ */
+static void ash_dir_iter_end (struct ash_dir_iter *it)
+{
+	ash_bput(&it->view);
+}
+
+
+
+/*
+ * Tells if the entry of the walk is the live entry called name
+ */
+static inline int ash_dir_match (struct ash_dir_iter *it, const char *name, int len)
+{
+	return it->live && it->name_len == len && !memcmp(it->name, name, len);
+}
+
+
+
+/*
+ * Fills in rfile with all there is about the entry of the walk. For an
+ * ash_raw_dirent that means reading the file's record from the inode table.
+ * @return 0 on success
+ */
+static int ash_dir_entry (struct ash_dir_iter *it, struct ash_raw_file *rfile)
+{
+	int err;
+	
+	if (it->rfile) {
+		memcpy(rfile, it->rfile, sizeof(*rfile));
+		return 0;
+	}
+	
+	err = ash_itable_read(it->dir->i_sb, it->fno, rfile);
+	if (err)
+		return err;
+	
+	memcpy(rfile->name, it->name, it->name_len);
+	rfile->name[it->name_len] = 0;
+	
+	return 0;
+}
+
+
+
+/*
+ * Fills in where the entry of the walk is
+ */
+static inline void ash_dir_iter_loc (struct ash_dir_iter *it, struct ash_dir_loc *loc)
+{
+	if (!loc)
+		return;
+	
+	loc->pos = it->pos;
+	loc->block = it->pblock;
+	loc->off = it->pos & (ASH_SB(it->dir->i_sb)->blocksize - 1);
+}
+
+
+
+/*
+ * Looks for name in the entries of a directory from position from on
+ * @return 0 if found (the entry is in rfile, where it is in loc), -ENOENT or -EIO
+ */
+static int ash_dir_scan (struct inode *dir, uint64_t from, const char *name, int len,
+		struct ash_raw_file *rfile, struct ash_dir_loc *loc)
+{
+	struct ash_dir_iter it;
+	int err;
+	
+	for (err = ash_dir_iter_start(dir, from, &it); !err; err = ash_dir_iter_next(&it)) {
+		if (ash_dir_match(&it, name, len)) {
+			err = ash_dir_entry(&it, rfile);
+			ash_dir_iter_loc(&it, loc);
+			break;
+		}
+	}
+	
+	ash_dir_iter_end(&it);
+	
+	return err;
+}
+
+
+
+/*
+ * Reads the header of the hashed index of a directory, if it has one
+ * @return 0 on success
+ */
+static int ash_dx_load (struct inode *dir)
+{
+	struct ash_inode_info *ei = ASH_I(dir);
+	struct ash_raw_dx_header *hdr;
+	struct ash_bview view;
+	uint32_t block;
+	int err;
+	
+	ei->dx_state = ASH_DX_NONE;
+	
+	err = ash_bmap(dir, ash_dir_blocks(dir), &block);
+	if (err == -ENOENT)
+		return 0;
+	if (err)
+		return err;
+	
+	if (ash_bget(dir->i_sb, block, &view))
+		return -EIO;
+	
+	// the header is at the start of the block, it never crosses a buffer_head
+	hdr = ash_bptr(&view, 0, sizeof(*hdr), NULL);
+	
+	// an index of more entries than there are is not for this directory
+	if (hdr->magic == ASH_DX_MAGIC && hdr->refs <= ash_dir_ref(dir, ei->size)) {
+		ei->dx_refs = hdr->refs;
+		ei->dx_buckets = hdr->buckets;
+		ei->dx_used = hdr->used;
+		ei->dx_state = ASH_DX_OK;
+	}
+	
+	ash_bput(&view);
+	
+	return 0;
+}
+
+
+
+/*
+ * Removes the hashed index of a directory: its blocks, which follow the last
+ * entry block in the BAT chain, go back to the UBB
+ */
+void ash_dx_drop (struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ash_inode_info *ei = ASH_I(dir);
+	uint32_t last;
+	int next;
+	
+	ei->dx_state = ASH_DX_NONE;
+	ei->dx_refs = ei->dx_buckets = ei->dx_used = 0;
+	
+	if (ash_bmap(dir, ash_dir_blocks(dir) - 1, &last))
+		return;
+	
+	next = BAT_read(sb, last);
+	if (next <= 0)
+		return;
+	
+	BAT_write(sb, last, 0);
+	ash_free_chain(sb, next, ~0U);
+	ash_bat_commit(sb);
+	
+	// the skip index may point into the blocks that went away
+	mutex_lock(&ei->alloc_lock);
+	ash_bmap_forget(ei);
+	mutex_unlock(&ei->alloc_lock);
+}
+
+
+
+/*
+ * Builds the hashed index of a directory from all its entries and links it in
+ * the BAT chain after the last entry block. The table is open addressed with
+ * linear probing and at most half full, so a lookup reads one index block and
+ * the block of the entry, however big the directory is. An old index is
+ * dropped first.
+ *
+ * The index can be bigger than the journal, so it is written in journal
+ * operations of its own, a few blocks each; its header gets the magic in the
+ * last one. A crash before that leaves blocks linked after the entries that
+ * no lookup uses and the next build drops. Not called inside an operation.
+ * @return 0 on success
+ */
+static int ash_dx_build (struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_inode_info *ei = ASH_I(dir);
+	struct ash_raw_dx_header *hdr;
+	struct ash_raw_dx_entry *table;
+	struct ash_dir_iter it;
+	uint32_t refs, live, buckets, blocks, b, h, i, block, prev, start, done, first;
+	int len, err, started;
+	char *buf;
+	
+	refs = ash_dir_ref(dir, ei->size);
+	
+	// count the entries to size the table
+	live = 0;
+	
+	for (err = ash_dir_iter_start(dir, 0, &it); !err; err = ash_dir_iter_next(&it))
+		live += it.live;
+	
+	ash_dir_iter_end(&it);
+	
+	if (err != -ENOENT)
+		return err;
+	
+	// at least a block of buckets, so the table is made of whole blocks
+	buckets = roundup_pow_of_two(max_t(uint32_t, live * 2, sbi->blocksize / sizeof(*table)));
+	blocks = 1 + ((buckets * sizeof(*table)) >> sbi->blockbits);
+	
+	table = vmalloc(buckets * sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+	
+	memset(table, 0, buckets * sizeof(*table));
+	
+	buf = kzalloc(sbi->blocksize, GFP_NOFS);
+	if (!buf) {
+		vfree(table);
+		return -ENOMEM;
+	}
+	
+	// hash every live entry
+	for (err = ash_dir_iter_start(dir, 0, &it); !err; err = ash_dir_iter_next(&it)) {
+		if (!it.live)
+			continue;
+	
+		h = ash_name_hash(it.name, it.name_len);
+	
+		for (b = h & (buckets - 1); table[b].ref; b = (b + 1) & (buckets - 1))
+			;
+	
+		table[b].hash = h;
+		table[b].ref = ash_dir_ref(dir, it.pos) + 1;
+	}
+	
+	ash_dir_iter_end(&it);
+	
+	if (err != -ENOENT)
+		goto out;
+	
+	started = ash_journal_start(sb);
+	ash_dx_drop(dir);
+	err = ash_bmap(dir, ash_dir_blocks(dir) - 1, &prev) ? -EIO : 0;
+	ash_journal_stop(sb, started);
+	
+	if (err)
+		goto out;
+	
+	// no magic yet, the blocks it lands on may have held an index before
+	hdr = (struct ash_raw_dx_header*) buf;
+	hdr->refs = refs;
+	hdr->buckets = buckets;
+	hdr->blocks = blocks;
+	hdr->used = live;
+	
+	// prev is the last entry block, the index goes as close after it as it can
+	first = 0;
+	
+	for (i = 0; i < blocks && !err; ) {
+		started = ash_journal_start(sb);
+		len = ash_alloc_run(sb, prev + 1, min_t(uint32_t, blocks - i, ASH_JOURNAL_OP / 2), &start);
+	
+		if (len < 0) {
+			err = len;
+			ash_journal_stop(sb, started);
+			break;
+		}
+	
+		// link the whole run first, so ash_dx_drop finds all of it if a write fails
+		for (block = start; block < start + len; block++) {
+			BAT_write(sb, prev, block);
+			prev = block;
+		}
+	
+		BAT_write(sb, prev, 0);
+		ash_bat_commit(sb);
+	
+		for (done = 0; done < len && !err; done++, i++) {
+			if (i == 0) {
+				first = start;
+				err = block_write_inode(dir, buf, start);
+			} else
+				err = block_write_inode(dir, (char*) table + ((i - 1) << sbi->blockbits), start + done);
+		}
+	
+		ash_journal_stop(sb, started);
+	}
+	
+	started = ash_journal_start(sb);
+	
+	if (!err) {
+		hdr->magic = ASH_DX_MAGIC;
+		err = block_write_inode(dir, buf, first);
+	}
+	
+	if (err)
+		ash_dx_drop(dir);
+	
+	ash_journal_stop(sb, started);
+	
+	if (err)
+		goto out;
+	
+	ei->dx_refs = refs;
+	ei->dx_buckets = buckets;
+	ei->dx_used = live;
+	ei->dx_state = ASH_DX_OK;
+	
+out:
+	kfree(buf);
+	vfree(table);
+	
+	return err;
+}
+
+
+
+/*
+ * Looks for name in the hashed index of a directory. The buckets after the one
+ * of the hash are tried until an empty one; an entry whose hash matches is
+ * read to compare the name.
+ * @return 0 if found (the entry is in rfile, where it is in loc), -ENOENT or -EIO
+ */
+static int ash_dx_find (struct inode *dir, const char *name, int len, struct ash_raw_file *rfile,
+		struct ash_dir_loc *loc)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ash_inode_info *ei = ASH_I(dir);
+	struct ash_raw_dx_entry *e, tmp;
+	struct ash_dir_iter it;
+	struct ash_bview view;
+	uint32_t per, h, b, n, lblock, cur, block;
+	int err;
+	
+	per = ASH_SB(sb)->blocksize / sizeof(*e);
+	h = ash_name_hash(name, len);
+	cur = 0;		// index block pinned in view, 0 for none (block 0 is the header)
+	err = -ENOENT;
+	
+	for (n = 0, b = h & (ei->dx_buckets - 1); n < ei->dx_buckets; n++, b = (b + 1) & (ei->dx_buckets - 1)) {
+		lblock = 1 + b / per;
+	
+		if (lblock != cur) {
+			if (cur)
+				ash_bput(&view);
+			cur = 0;
+	
+			if (ash_bmap(dir, ash_dir_blocks(dir) + lblock, &block) || ash_bget(sb, block, &view)) {
+				err = -EIO;
+				break;
+			}
+	
+			cur = lblock;
+		}
+	
+		e = ash_bptr(&view, (b % per) * sizeof(*e), sizeof(*e), &tmp);
+	
+		if (!e->ref)
+			break;
+	
+		if (e->hash != h)
+			continue;
+	
+		err = ash_dir_iter_start(dir, ash_dir_ref_pos(dir, e->ref - 1), &it);
+	
+		if (!err && ash_dir_match(&it, name, len)) {
+			err = ash_dir_entry(&it, rfile);
+			ash_dir_iter_loc(&it, loc);
+		} else if (err != -EIO)
+			err = -ENOENT;
+	
+		ash_dir_iter_end(&it);
+	
+		if (err != -ENOENT)
+			break;
+	}
+	
+	if (cur)
+		ash_bput(&view);
+	
+	return err;
+}
+
+
+
+/*
+ * Finds the entry called name in a directory. Small directories are read whole;
+ * big ones go through their hashed index, built on the first lookup that needs
+ * it and rebuilt when more than ASH_DX_SLACK entry refs were added after it or
+ * it got more than half full. Lookups inside a journal operation (unlink,
+ * rename) never build it, they use what there is; every create looks the
+ * name up before, outside of one.
+ * Called with the directory's i_mutex held.
+ * @return 0 if found (the entry is in rfile, where it is in loc if not NULL), -ENOENT or -EIO
+ */
+int ash_dir_find (struct inode *dir, const char *name, int len, struct ash_raw_file *rfile,
+		struct ash_dir_loc *loc)
+{
+	struct ash_inode_info *ei = ASH_I(dir);
+	uint32_t refs;
+	int err;
+	
+	// a couple of blocks are read as fast as an index
+	if (ash_dir_blocks(dir) < ASH_DX_MIN_BLOCKS)
+		return ash_dir_scan(dir, 0, name, len, rfile, loc);
+	
+	if (ei->dx_state == ASH_DX_UNKNOWN) {
+		err = ash_dx_load(dir);
+		if (err)
+			return err;
+	}
+	
+	refs = ash_dir_ref(dir, ei->size);
+	
+	if (ei->dx_state != ASH_DX_OK || refs - ei->dx_refs > ASH_DX_SLACK || ei->dx_used * 2 > ei->dx_buckets) {
+	
+		// building failed before, don't go over the whole directory on every lookup
+		if (ei->dx_state == ASH_DX_FAILED && refs - ei->dx_refs <= ASH_DX_SLACK)
+			return ash_dir_scan(dir, 0, name, len, rfile, loc);
+	
+		if (ash_journal_inside()) {
+			if (ei->dx_state != ASH_DX_OK)
+				return ash_dir_scan(dir, 0, name, len, rfile, loc);
+		} else {
+			err = -EROFS;
+			if (!(dir->i_sb->s_flags & MS_RDONLY))
+				err = ash_dx_build(dir);
+	
+			if (err) {
+				ei->dx_state = ASH_DX_FAILED;
+				ei->dx_refs = refs;
+				return ash_dir_scan(dir, 0, name, len, rfile, loc);
+			}
+		}
+	}
+	
+	err = ash_dx_find(dir, name, len, rfile, loc);
+	if (err != -ENOENT)
+		return err;
+	
+	// entries added since the index was built
+	return ash_dir_scan(dir, ash_dir_ref_pos(dir, ei->dx_refs), name, len, rfile, loc);
+}
+
+
+
 /*
- * Lists a part of the entries in a directory, starting from filp->f_pos entry
- * and by using the filldir function
- *
- * filldir(dirent, name, name_len, pos, ino, flags)
+ * Writes len bytes of buf at position pos of a directory, in place in the
+ * buffer cache; the block goes with the directory's other writes on fsync.
+ * If block is not NULL, it gets the block of pos on the disk.
+ * @return 0 on success
  */
-int ash_readdir (struct file *filp, void *dirent, filldir_t filldir) {
-	int cpos, done, i;
-	struct dentry *de;
-	struct ash_raw_file *rf, *entry;
-	struct inode *dir;
-	struct super_block *sb;
-	uint32_t lB, lO, blocks, maxoff;
-	char *point;
+static int ash_dir_write (struct inode *dir, uint64_t pos, void *buf, uint32_t len, uint32_t *block)
+{
+	struct ash_sb_info *sbi = ASH_SB(dir->i_sb);
+	struct ash_bview view;
+	uint32_t pblock;
+	int err;
 	
-	// current position
-	cpos = filp->f_pos;
+	if (ash_bmap(dir, pos >> sbi->blockbits, &pblock) || ash_bget(dir->i_sb, pblock, &view))
+		return -EIO;
+	
+	ash_bview_copy(&view, pos & (sbi->blocksize - 1), buf, len, ASH_BVIEW_WRITE);
+	ash_bdirty(&view);
+	
+	err = ash_wbatch_add(&ASH_I(dir)->wb, &view);
+	ash_bput(&view);
+	
+	if (block)
+		*block = pblock;
+	
+	return err;
+}
+
 
-	// get dentry for the current dir
-	de = filp->f_path.dentry;
+
+/*
+ * Gives a directory a new, empty entry block after its last one. A hashed
+ * index stays linked after the entry blocks, so it does not have to be
+ * dropped: it is one logical block further, which ash_dir_blocks accounts
+ * for once the size covers the new block.
+ * @return 0 on success
+ */
+static int ash_dir_grow (struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ash_inode_info *ei = ASH_I(dir);
+	struct ash_bview view;
+	uint32_t lblock, last, block;
+	int next, len, err;
 	
-	// test if we passed the . and .. virtual dirs
-	if (cpos == 0) {
-		
-		if (filldir(dirent, ".", 1, cpos, de->d_inode->i_ino, DT_DIR) < 0)
-			return 0;
-		cpos++;
-		filp->f_pos++;
+	lblock = ash_dir_blocks(dir);
+	
+	if (ash_bmap(dir, lblock - 1, &last))
+		return -EIO;
+	
+	next = BAT_read(sb, last);
+	if (next < 0)
+		return -EIO;
+	
+	len = ash_alloc_run(sb, last + 1, 1, &block);
+	if (len < 0)
+		return len;
+	
+	if (ash_bget_new(sb, block, &view)) {
+		ash_free_run(sb, block, 1);
+		return -EIO;
 	}
+	
+	ash_bdirty(&view);
+	err = ash_wbatch_add(&ei->wb, &view);
+	ash_bput(&view);
+	
+	BAT_write(sb, block, next);
+	BAT_write(sb, last, block);
+	ash_bat_commit(sb);
+	
+	// what the skip index knows past the old last block moved by one
+	mutex_lock(&ei->alloc_lock);
+	ash_bmap_truncate(ei, lblock);
+	mutex_unlock(&ei->alloc_lock);
+	
+	return err;
+}
 
-	if (cpos == 1) {
-		// getting dentry for the ..
-		de = de->d_parent;
 
-		if (filldir(dirent, "..", 2, cpos, de->d_inode->i_ino, DT_DIR) < 0)
-			return 0;
 
-		cpos++;
-		filp->f_pos++;
+/*
+ * Adds the entry at ref, called name, to the hashed index of a directory if it
+ * has one. An index more than half full is built again, for twice as many
+ * entries, by the next lookup outside a journal operation (see ash_dir_find):
+ * until then it takes new entries for as long as it has room.
+ */
+static void ash_dx_add (struct inode *dir, const char *name, int len, uint32_t ref)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ash_inode_info *ei = ASH_I(dir);
+	struct ash_raw_dx_header *hdr;
+	struct ash_raw_dx_entry e;
+	struct ash_bview view;
+	uint32_t per, h, b, n, lblock, cur, block;
+	
+	if (ei->dx_state == ASH_DX_UNKNOWN && ash_dx_load(dir))
+		return;
+	
+	if (ei->dx_state != ASH_DX_OK)
+		return;
+	
+	per = ASH_SB(sb)->blocksize / sizeof(e);
+	h = ash_name_hash(name, len);
+	cur = 0;
+	
+	for (n = 0, b = h & (ei->dx_buckets - 1); n < ei->dx_buckets; n++, b = (b + 1) & (ei->dx_buckets - 1)) {
+		lblock = 1 + b / per;
+	
+		if (lblock != cur) {
+			if (cur)
+				ash_bput(&view);
+			cur = 0;
+	
+			if (ash_bmap(dir, ash_dir_blocks(dir) + lblock, &block) || ash_bget(sb, block, &view))
+				break;
+	
+			cur = lblock;
+		}
+	
+		ash_bview_copy(&view, (b % per) * sizeof(e), &e, sizeof(e), ASH_BVIEW_READ);
+	
+		if (e.ref)
+			continue;
+	
+		e.hash = h;
+		e.ref = ref + 1;
+	
+		ash_bview_copy(&view, (b % per) * sizeof(e), &e, sizeof(e), ASH_BVIEW_WRITE);
+		ash_bdirty(&view);
+		ash_wbatch_add(&ei->wb, &view);
+		ei->dx_used++;
+		break;
+	}
+	
+	if (cur)
+		ash_bput(&view);
+	
+	// an entry that was not indexed can't be found through the index any more
+	if (n == ei->dx_buckets || !cur) {
+		ash_dx_drop(dir);
+		return;
 	}
+	
+	// everything up to the end is indexed, the lookups have no tail to scan
+	if (ref >= ei->dx_refs)
+		ei->dx_refs = ash_dir_ref(dir, ei->size);
+	
+	if (ash_bmap(dir, ash_dir_blocks(dir), &block) || ash_bget(sb, block, &view))
+		return;
+	
+	hdr = ash_bptr(&view, 0, sizeof(*hdr), NULL);
+	hdr->refs = ei->dx_refs;
+	hdr->used = ei->dx_used;
+	
+	ash_bdirty(&view);
+	ash_wbatch_add(&ei->wb, &view);
+	ash_bput(&view);
+}
+
+
 
-	// parses next entries from the directory entry on the disk
-	// need the information from the inode
-	dir = de->d_inode;
-	sb = dir->i_sb;
-	rf = (struct ash_raw_file*) dir->i_private;
+/*
+ * Adds the entry of inode, called name, to a directory. It goes in the first
+ * hole big enough from the free hint on: a deleted entry, or the unused end of
+ * a live ash_raw_dirent. Without one it goes at the end, in a new block if the
+ * last one is full. An ash_raw_file entry is the file's record, where it went
+ * is kept in the inode.
+ * Called with the directory's i_mutex held.
+ * @return 0 on success
+ */
+int ash_dir_add (struct inode *dir, const char *name, int len, struct inode *inode)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_inode_info *ei = ASH_I(dir);
+	struct ash_raw_dirent *d;
+	struct ash_raw_file rfile;
+	struct ash_dir_iter it;
+	uint32_t need, own, span, off, block;
+	uint64_t pos, split, size;
+	uint16_t rec_len;
+	int carved, grown, err;
 	
-	// find the entry on disk that corresponds to cpos
-	blocks = cpos >> (sb->s_blocksize_bits);
+	// the count of written blocks of an ASH_FL_UNWRITTEN file is at the end of the name field
+	if (!ASH_DIRENT2(sb) && (ASH_I(inode)->flags & ASH_FL_UNWRITTEN) && len > ASH_VALID_NAME_MAX)
+		return -ENAMETOOLONG;
 	
-	// start block of dentry
-	lB = BAT_read(sb, rf->startblock);
+	need = ASH_DIRENT2(sb) ? ASH_DIRENT_LEN(len) : sizeof(struct ash_raw_file);
+	size = ei->size;
+	span = own = 0;
+	split = pos = 0;
+	carved = 0;
 	
-	// must traverse all BAT for the dentry to current position
-	for (i = 0; i < blocks; i++)
-		lB = BAT_read(sb, lB);
-		if (lB < 0)
-			return -EIO;
+	for (err = ash_dir_iter_start(dir, ei->free_hint, &it); !err; err = ash_dir_iter_next(&it)) {
+		if (!it.live && it.rec_len >= need) {
+			pos = it.pos;
+			span = it.rec_len;
+			break;
+		}
+	
+		if (it.live && ASH_DIRENT2(sb)) {
+			own = ASH_DIRENT_LEN(it.name_len);
+	
+			if (it.rec_len - own >= need) {
+				carved = 1;
+				split = it.pos;
+				pos = it.pos + own;
+				span = it.rec_len - own;
+				break;
+			}
+		}
+	}
+	
+	ash_dir_iter_end(&it);
+	
+	if (err && err != -ENOENT)
+		return err;
+	
+	grown = 0;
+	
+	if (span)
+		ei->free_hint = pos;
+	else {
+		// no hole up to the end, and none to look for until an entry is deleted
+		ei->free_hint = size;
+		pos = size;
+		off = pos & (sbi->blocksize - 1);
+	
+		if (off && off + need > sbi->blocksize) {
+			// walks go over the rest of the block as a deleted entry
+			if (ASH_DIRENT2(sb) && sbi->blocksize - off >= ASH_DIRENT_LEN(0)) {
+				d = (struct ash_raw_dirent*) &rfile;
+				memset(d, 0, ASH_DIRENT_HDR);
+				d->rec_len = sbi->blocksize - off;
+	
+				err = ash_dir_write(dir, pos, d, ASH_DIRENT_HDR, NULL);
+				if (err)
+					return err;
+			}
+	
+			pos += sbi->blocksize - off;
+		}
+	
+		if ((pos >> sbi->blockbits) >= ash_dir_blocks(dir)) {
+			err = ash_dir_grow(dir);
+			if (err)
+				return err;
+	
+			grown = 1;
+		}
+	
+		span = need;
+	}
+	
+	// how much of the name field of an ash_raw_file the name takes (see ASH_VALID_OFF)
+	ASH_I(inode)->inline_off = ASH_INLINE_OFF(len);
+	
+	if (ASH_DIRENT2(sb)) {
+		d = (struct ash_raw_dirent*) &rfile;
+		d->fno = ASH_I(inode)->fno;
+		d->rec_len = span;
+		d->name_len = len;
+		d->type = ash_dir_type(inode->i_mode);
+		memcpy(d->name, name, len);
+	
+		err = ash_dir_write(dir, pos, d, ASH_DIRENT_HDR + len, NULL);
+	
+		// the live entry the new one was carved from ends where it starts
+		if (!err && carved) {
+			rec_len = own;
+			err = ash_dir_write(dir, split + offsetof(struct ash_raw_dirent, rec_len),
+				&rec_len, sizeof(rec_len), NULL);
+		}
+	} else {
+		// the name first: ash_fill_raw puts the count of written blocks over its end
+		memset(rfile.name, 0, sizeof(rfile.name));
+		memcpy(rfile.name, name, len);
+		ash_fill_raw(inode, &rfile);
+	
+		err = ash_dir_write(dir, pos, &rfile, sizeof(rfile), &block);
+		if (!err) {
+			ASH_I(inode)->rec_block = block;
+			ASH_I(inode)->rec_off = pos & (sbi->blocksize - 1);
+		}
+	}
+	
+	if (err) {
+		// the new block is not covered by the size, take it out of the chain with the index
+		if (grown)
+			ash_dx_drop(dir);
+		return err;
+	}
+	
+	if (pos + span > size) {
+		ei->size = pos + span;
+		i_size_write(dir, ei->size);
+	}
+	
+	dir->i_version++;
+	ash_dx_add(dir, name, len, ash_dir_ref(dir, pos));
+	
+	if (ei->size != size)
+		return ash_write_record(dir);
+	
+	return 0;
+}
+
+
+
+/*
+ * Deletes the entry called name from a directory. The entry stays where it
+ * is, marked deleted, until a new entry reuses it or the directory is
+ * compacted; its bucket in the hashed index stays too, lookups skip it.
+ * Called with the directory's i_mutex held.
+ * @return 0 on success, -ENOENT or -EIO
+ */
+int ash_dir_remove (struct inode *dir, const char *name, int len)
+{
+	struct ash_inode_info *ei = ASH_I(dir);
+	struct ash_raw_file rfile;
+	struct ash_dir_loc loc;
+	uint8_t type = ASHTYPE_REMDENTRY;
+	uint64_t fno = 0;
+	int err;
+	
+	err = ash_dir_find(dir, name, len, &rfile, &loc);
+	if (err)
+		return err;
 	
-	if (cpos > 2)
-		lO = cpos & (sb->s_blocksize - 1);
+	if (ASH_DIRENT2(dir->i_sb))
+		err = ash_dir_write(dir, loc.pos + offsetof(struct ash_raw_dirent, fno), &fno, sizeof(fno), NULL);
 	else
-		lO = 0;		// cpos is actually 0, but I needed those 2 virtual files and the state
-				// of running filldir on them
+		err = ash_dir_write(dir, loc.pos + offsetof(struct ash_raw_file, ashtype), &type, sizeof(type), NULL);
 	
-	done = 0;
-	maxoff = sb->s_blocksize - sizeof(struct ash_raw_file);
+	if (err)
+		return err;
 	
-	while (!done) {
+	ei->dir_holes = 1;
+	if (loc.pos < ei->free_hint)
+		ei->free_hint = loc.pos;
 	
-		// read the dir entry from disk
-		point = (char*) block_read (sb, lB);
-		
-		if (!point) {
-			kfree(point);
-			return -EIO;
+	dir->i_version++;
+	
+	return 0;
+}
+
+
+
+/*
+ * Tells if a directory has no live entries
+ * @return 1 if it is empty, 0 if not, -EIO on error
+ */
+int ash_dir_empty (struct inode *dir)
+{
+	struct ash_dir_iter it;
+	int err;
+	
+	for (err = ash_dir_iter_start(dir, 0, &it); !err; err = ash_dir_iter_next(&it))
+		if (it.live)
+			break;
+	
+	ash_dir_iter_end(&it);
+	
+	if (err == -ENOENT)
+		return 1;
+	
+	return err ? err : 0;
+}
+
+
+
+/*
+ * Ends a directory at position end: the blocks of its chain past the one
+ * holding end go back to the UBB, and the new size goes in its record.
+ * The hashed index must have been dropped.
+ * @return 0 on success
+ */
+static int ash_dir_cut (struct inode *dir, uint64_t end)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_inode_info *ei = ASH_I(dir);
+	uint32_t lblock, pblock;
+	int next, err;
+	
+	// the first block stays, even for an empty directory
+	lblock = end ? (end - 1) >> sbi->blockbits : 0;
+	
+	err = ash_bmap(dir, lblock, &pblock);
+	if (err)
+		return err;
+	
+	next = BAT_read(sb, pblock);
+	if (next > 0) {
+		BAT_write(sb, pblock, 0);
+		ash_free_chain(sb, next, ~0U);
+		ash_bat_commit(sb);
+	}
+	
+	mutex_lock(&ei->alloc_lock);
+	ash_bmap_truncate(ei, lblock + 1);
+	mutex_unlock(&ei->alloc_lock);
+	
+	ei->size = end;
+	ei->free_hint = min(ei->free_hint, end);
+	i_size_write(dir, ei->size);
+	dir->i_version++;
+	
+	return ash_write_record(dir);
+}
+
+
+
+/*
+ * Writes the block being packed by ash_dir_compact at pblock, and marks deleted
+ * the n entries at moved, the ones that went in it from blocks after it. Both
+ * are in the same journal operation: whichever one a crash comes after, every
+ * entry is in the directory once.
+ * @return 0 on success
+ */
+static int ash_dir_pack (struct inode *dir, char *buf, uint32_t pblock, uint64_t *moved, uint32_t n)
+{
+	uint64_t fno = 0;
+	uint32_t i;
+	int err;
+	
+	err = block_write_inode(dir, buf, pblock);
+	
+	for (i = 0; i < n && !err; i++)
+		err = ash_dir_write(dir, moved[i] + offsetof(struct ash_raw_dirent, fno), &fno, sizeof(fno), NULL);
+	
+	return err;
+}
+
+
+
+/*
+ * Rewrites a directory without its deleted entries. The live ones are packed
+ * from the start of the chain in the order they were in, and the blocks left
+ * over at its end go back to the UBB, with the hashed index (rebuilt on the
+ * next lookup that needs it). A packed entry is never after where it was, so
+ * a block is only rewritten once the walk is past it and it is done in place.
+ *
+ * A big directory doesn't fit in the journal, so each packed block is written
+ * in an operation of its own (see ash_dir_pack). One that would take entries
+ * from more than ASH_JOURNAL_OP / 2 blocks is written before it is full and
+ * again with the rest. Not called inside an operation.
+ *
+ * Positions change, so this is only done when nothing can hold one: when the
+ * last file open on the directory is closed (see ash_dir_release). It is
+ * skipped unless the deleted entries add up to at least a block.
+ * Called with the directory's i_mutex held.
+ *
+ * In an ash_raw_file directory the entries are the records of the files, and
+ * inodes kept in the inode cache write back to them (rec_block): those never
+ * move, only the deleted entries after the last live one are cut off.
+ * @return 0 on success
+ */
+int ash_dir_compact (struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_inode_info *ei = ASH_I(dir);
+	struct ash_raw_dirent *d;
+	struct ash_dir_iter it;
+	uint32_t off, last, need, wblock, wpblock, n, srcs;
+	uint64_t dead, tail, *moved;
+	char *buf;
+	int next, full, err, started;
+	
+	dead = tail = 0;
+	
+	for (err = ash_dir_iter_start(dir, 0, &it); !err; err = ash_dir_iter_next(&it)) {
+		if (!it.live)
+			dead += it.rec_len;
+		else
+			tail = it.pos + it.rec_len;
+	}
+	
+	ash_dir_iter_end(&it);
+	
+	if (err != -ENOENT)
+		return err;
+	
+	ei->dir_holes = 0;
+	
+	if (!ASH_DIRENT2(sb)) {
+		if (ei->size - tail < sbi->blocksize)
+			return 0;
+	
+		started = ash_journal_start(sb);
+		ash_dx_drop(dir);
+		err = ash_dir_cut(dir, tail);
+		ash_journal_stop(sb, started);
+	
+		return err;
+	}
+	
+	if (dead < sbi->blocksize)
+		return 0;
+	
+	buf = kzalloc(sbi->blocksize, GFP_NOFS);
+	moved = kmalloc((sbi->blocksize / ASH_DIRENT_LEN(0)) * sizeof(*moved), GFP_NOFS);
+	if (!buf || !moved) {
+		kfree(buf);
+		kfree(moved);
+		return -ENOMEM;
+	}
+	
+	started = ash_journal_start(sb);
+	
+	// the index refers to positions that are going to change
+	ash_dx_drop(dir);
+	
+	wblock = 0;
+	wpblock = ei->startblock;
+	off = last = n = srcs = 0;
+	
+	for (err = ash_dir_iter_start(dir, 0, &it); !err; err = ash_dir_iter_next(&it)) {
+		if (!it.live)
+			continue;
+	
+		need = ASH_DIRENT_LEN(it.name_len);
+		full = off + need > sbi->blocksize;
+	
+		// the block being packed is full, the walk is past it already; or it took
+		// entries from as many blocks as an operation should change
+		if (full || srcs == ASH_JOURNAL_OP / 2) {
+			((struct ash_raw_dirent*) (buf + last))->rec_len = sbi->blocksize - last;
+			err = ash_dir_pack(dir, buf, wpblock, moved, n);
+			((struct ash_raw_dirent*) (buf + last))->rec_len = off - last;
+	
+			ash_journal_stop(sb, started);
+			started = ash_journal_start(sb);
+			n = srcs = 0;
+	
+			if (err)
+				break;
 		}
-			
-		entry = (struct ash_raw_file*) (point + lO);
-		
-		// parse the entries in the block
-		while(lO < maxoff && cpos < rf->size) {
-			unsigned type;		// type of dentry, DT_DIR, DT_REG for now
-			
-			type = DT_UNKNOWN;	// can be anything
-			
-			// for directory dentry
-			if (S_ISDIR(entry->mode))
-				type = DT_DIR;
-			
-			// for normal file dentry
-			if (S_ISREG(entry->mode))
-				type = DT_REG;
-			
-			// a dentry can be marked deleted but still be present and accounted for space
-			if (entry->ashtype != ASHTYPE_REMDENTRY &&
-				filldir(dirent, entry->name, strlen(entry->name), cpos, entry->fno, type) < 0) {
-			
-				kfree(point);
-				return 0;
+	
+		if (full) {
+			next = BAT_read(sb, wpblock);
+			if (next <= 0) {
+				err = -EIO;
+				break;
 			}
-			
-			// next entry on disk
-			entry++;
-			
-			// adjust offsets
-			lO += sizeof(struct ash_raw_file);
-			cpos += sizeof(struct ash_raw_file);
-			filp->f_pos += sizeof(struct ash_raw_file);
+	
+			wpblock = next;
+			wblock++;
+			memset(buf, 0, sbi->blocksize);
+			off = 0;
 		}
-		
-		// there are a few bytes betwen lO and end of block, which need
-		// to be accounted for in cpos, or next time the function runs
-		// we won't be able to find the correct logical block in which the
-		// filldir stopped
-		
-		// test if we are finished
-		if (cpos == rf->size) {
-			kfree(point);
-			return 0;
+	
+		d = (struct ash_raw_dirent*) (buf + off);
+		d->fno = it.fno;
+		d->rec_len = need;
+		d->name_len = it.name_len;
+		d->type = it.type;
+		memcpy(d->name, it.name, it.name_len);
+	
+		// the entry stays where it was until the block it went in is written
+		if ((it.pos >> sbi->blockbits) > wblock) {
+			if (!n || (moved[n - 1] >> sbi->blockbits) != (it.pos >> sbi->blockbits))
+				srcs++;
+			moved[n++] = it.pos;
 		}
+	
+		last = off;
+		off += need;
+	}
+	
+	ash_dir_iter_end(&it);
+	
+	if (err != -ENOENT)
+		goto out;
+	
+	err = ash_dir_pack(dir, buf, wpblock, moved, n);
+	if (err)
+		goto out;
+	
+	// the chain ends with the last packed block
+	ei->free_hint = ((uint64_t) wblock << sbi->blockbits) + off;
+	err = ash_dir_cut(dir, ei->free_hint);
+	
+out:
+	ash_journal_stop(sb, started);
+	kfree(moved);
+	kfree(buf);
+	
+	return err;
+}
+
+
+
+/*
+ * Looks a name up in a directory on the disk and gets the inode for it (from
+ * the inode hash if the file is in memory already), or makes a negative dentry
+ * if there is no such entry.
+ *
+ * Every change to a directory (create, unlink, rename) is made on the disk
+ * and in the dcache of this mount together, so a dentry, positive or
+ * negative, stays right for as long as it is cached and there is no
+ * d_revalidate: a stat() of a name looked up before never gets here.
+ */
+struct dentry* ash_lookup (struct inode *dir, struct dentry *dentry, struct nameidata *nd)
+{
+	struct ash_raw_file rfile;
+	struct ash_dir_loc loc;
+	struct inode *inode;
+	int err;
+	
+	if (dentry->d_name.len >= sizeof(rfile.name))
+		return ERR_PTR(-ENAMETOOLONG);
+	
+	err = ash_dir_find(dir, dentry->d_name.name, dentry->d_name.len, &rfile, &loc);
+	
+	if (err == -ENOENT) {
+		d_add(dentry, NULL);
+		return NULL;
+	}
+	
+	if (err)
+		return ERR_PTR(err);
+	
+	inode = ash_iget_raw(dir->i_sb, &rfile);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	
+	ASH_I(inode)->inline_off = ASH_INLINE_OFF(dentry->d_name.len);
+	
+	// the entry is the record, it gets written back there
+	if (!ASH_DIRENT2(dir->i_sb)) {
+		ASH_I(inode)->rec_block = loc.block;
+		ASH_I(inode)->rec_off = loc.off;
+	}
+	
+	d_add(dentry, inode);
+	
+	return NULL;
+}
+
+
+
+/*
+ * Lists a part of the entries in a directory, starting from filp->f_pos entry
+ * and by using the filldir function. f_pos 0 and 1 are . and .., which are
+ * not on the disk; after them f_pos is 2 + the position of the entry.
+ *
+ * Where the listing stopped is kept in the open file's cursor. If the next call
+ * asks for the same f_pos and the directory did not change in between, it
+ * starts from the block the cursor has, without looking it up again.
+ *
+ * filldir(dirent, name, name_len, pos, ino, flags)
+ */
+int ash_readdir (struct file *filp, void *dirent, filldir_t filldir) {
+	struct dentry *de = filp->f_path.dentry;
+	struct inode *dir = de->d_inode;
+	struct ash_dir_cursor *cur = filp->private_data;
+	struct ash_dir_iter it;
+	int err;
+	
+	// test if we passed the . and .. virtual dirs
+	if (filp->f_pos == 0) {
+		if (filldir(dirent, ".", 1, 0, dir->i_ino, DT_DIR) < 0)
+			return 0;
+		filp->f_pos++;
+	}
+	
+	if (filp->f_pos == 1) {
+		if (filldir(dirent, "..", 2, 1, parent_ino(de), DT_DIR) < 0)
+			return 0;
+		filp->f_pos++;
+	}
+	
+	// the entries are read in place, in the buffer cache
+	if (cur && cur->f_pos == filp->f_pos && cur->version == dir->i_version)
+		err = ash_dir_iter_resume(dir, filp->f_pos - 2, cur->lblock, cur->pblock, &it);
+	else
+		err = ash_dir_iter_start(dir, filp->f_pos - 2, &it);
+	
+	for (; !err; err = ash_dir_iter_next(&it)) {
 		
-		cpos += sb->s_blocksize - lO;
-		filp->f_pos += sb->s_blocksize - lO;
-		
-		// find out next block from BAT
-		lB = BAT_read(sb, lB);
-		lO = 0;
-		
-		if (lB<0) {
-			kfree(point);
-			return -EIO;
-		}
+		if (it.live && filldir(dirent, it.name, it.name_len, 2 + it.pos, it.fno, it.type) < 0)
+			break;
 		
-		// we have reached the end of the direntry list
-		if (lB == 0)
-			done = 1;
+		// a deleted entry, not the padding at the end of a block
+		if (!it.live && it.name_len)
+			ASH_I(dir)->dir_holes = 1;
 		
-		// free the buffer of the read block from disk
-		kfree(point);
+		filp->f_pos = 2 + it.pos + it.rec_len;
+	}
+	
+	// f_pos is in the last block read, or in the one after it
+	if (cur && it.known) {
+		cur->f_pos = filp->f_pos;
+		cur->version = dir->i_version;
+		cur->lblock = it.lblock;
+		cur->pblock = it.pblock;
 	}
 	
+	ash_dir_iter_end(&it);
+	
+	return err == -EIO ? -EIO : 0;
+}
+
+
+
+/*
+ * Gives an open directory its readdir cursor
+ */
+int ash_dir_open (struct inode *inode, struct file *filp)
+{
+	struct ash_dir_cursor *cur;
+	
+	cur = kzalloc(sizeof(*cur), GFP_KERNEL);
+	if (!cur)
+		return -ENOMEM;
+	
+	// not at any f_pos yet
+	cur->f_pos = -1;
+	filp->private_data = cur;
+	
+	mutex_lock(&inode->i_mutex);
+	ASH_I(inode)->dir_open++;
+	mutex_unlock(&inode->i_mutex);
+	
+	return 0;
+}
+
+
+
+/*
+ * Drops the readdir cursor of an open directory. Once nobody has the
+ * directory open, nobody holds a position in it and it can be compacted.
+ */
+int ash_dir_release (struct inode *inode, struct file *filp)
+{
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct super_block *sb = inode->i_sb;
+	
+	kfree(filp->private_data);
+	filp->private_data = NULL;
+	
+	mutex_lock(&inode->i_mutex);
+	
+	if (!--ei->dir_open && ei->dir_holes && inode->i_nlink && !(sb->s_flags & MS_RDONLY))
+		ash_dir_compact(inode);
+	
+	mutex_unlock(&inode->i_mutex);
+	
 	return 0;
 }
 
 
+extern int ash_sync_file (struct file *, struct dentry *, int);
+
 struct file_operations ash_dir_operations = {
 	.read		=	generic_read_dir,
 	.readdir	=	ash_readdir,
+	.fsync		=	ash_sync_file,
+	.open		=	ash_dir_open,
+	.release	=	ash_dir_release,
 };
 
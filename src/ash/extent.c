@@ -0,0 +1,1040 @@
+/*
+ * Ash File System
+ *
+ * Extent mapped files. On a filesystem formatted with ASH_FEATURE_EXTENTS, the
+ * startblock of a regular file (marked ASH_FL_EXTENTS) is the root block of a
+ * small extent tree instead of the first block of a BAT chain. The tree is at
+ * most 2 levels deep: the root holds the extents themselves (depth 0), or the
+ * leaf blocks holding them (depth 1). Entries are kept sorted by logical block,
+ * so finding a block is a binary search per level.
+ *
+ * Logical blocks no extent maps are holes, which read as zeroes. Blocks are
+ * added at the end of a file by ash_alloc_delayed, or in its holes when they
+ * are written (ash_ext_insert), and only given back when the file is deleted
+ * (ash_ext_free).
+ *
+ * The extents fallocate adds are unwritten (ASH_EXT_UNWRITTEN): their blocks
+ * hold whatever was on the disk, so they read as zeroes like a hole until
+ * pages are written over them. Then the blocks written are split off into
+ * an extent of their own (ash_ext_convert).
+ *
+ * For licensing information, see the file 'LICENSE'
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include "ash.h"
+
+
+// where entry i of an extent block is
+#define ASH_EXT_OFF(i)	(sizeof(struct ash_raw_extent_header) + (i) * sizeof(struct ash_raw_extent))
+
+
+/*
+ * Header of an extent block. It is at the start of the block, so it never
+ * crosses a buffer_head and is used in place.
+ */
+static inline struct ash_raw_extent_header* ash_ext_header (struct ash_bview *view)
+{
+	return ash_bptr(view, 0, sizeof(struct ash_raw_extent_header), NULL);
+}
+
+
+
+/*
+ * Reads entry i of an extent block
+ */
+static inline void ash_ext_get (struct ash_bview *view, int i, struct ash_raw_extent *e)
+{
+	ash_bview_copy(view, ASH_EXT_OFF(i), e, sizeof(*e), ASH_BVIEW_READ);
+}
+
+
+
+/*
+ * Writes entry i of an extent block
+ */
+static inline void ash_ext_put (struct ash_bview *view, int i, struct ash_raw_extent *e)
+{
+	ash_bview_copy(view, ASH_EXT_OFF(i), e, sizeof(*e), ASH_BVIEW_WRITE);
+}
+
+
+
+/*
+ * Pins an extent block and checks that it is one
+ * @return 0 on success
+ */
+static int ash_ext_bget (struct super_block *sb, uint32_t block, struct ash_bview *view)
+{
+	if (ash_bget(sb, block, view))
+		return -EIO;
+	
+	if (ash_ext_header(view)->magic != ASH_EXT_MAGIC) {
+		printk(KERN_ERR "block %u is not an extent block\n", block);
+		ash_bput(view);
+		return -EIO;
+	}
+	
+	return 0;
+}
+
+
+
+/*
+ * Finds the last entry of an extent block that starts at or before lblock
+ * @return its index (and the entry in e), or -1 if lblock is before all of them
+ */
+static int ash_ext_search (struct ash_bview *view, uint32_t lblock, struct ash_raw_extent *e)
+{
+	struct ash_raw_extent x;
+	int lo, hi, mid, found;
+	
+	lo = 0;
+	hi = ash_ext_header(view)->nr - 1;
+	found = -1;
+	
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		ash_ext_get(view, mid, &x);
+	
+		if (x.lblock <= lblock) {
+			found = mid;
+			*e = x;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+	
+	return found;
+}
+
+
+
+/*
+ * Finds the extent holding logical block lblock of an extent mapped file
+ * @return 0 on success, 1 if the block is in an unwritten extent,
+ * -ENOENT if it is not mapped, -EIO on error
+ */
+int ash_ext_map (struct inode *inode, uint32_t lblock, uint32_t *pblock)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_raw_extent e;
+	struct ash_bview view;
+	int err;
+	
+	if (!ASH_I(inode)->startblock)
+		return -ENOENT;
+	
+	err = ash_ext_bget(sb, ASH_I(inode)->startblock, &view);
+	if (err)
+		return err;
+	
+	if (ash_ext_search(&view, lblock, &e) < 0)
+		goto out_hole;
+	
+	// down to the leaf holding the extent
+	if (ash_ext_header(&view)->depth) {
+		ash_bput(&view);
+	
+		err = ash_ext_bget(sb, e.start, &view);
+		if (err)
+			return err;
+	
+		if (ash_ext_search(&view, lblock, &e) < 0)
+			goto out_hole;
+	}
+	
+	ash_bput(&view);
+	
+	if (lblock >= e.lblock + ASH_EXT_LEN(&e))
+		return -ENOENT;
+	
+	*pblock = e.start + (lblock - e.lblock);
+	
+	return (e.len & ASH_EXT_UNWRITTEN) ? 1 : 0;
+	
+out_hole:
+	ash_bput(&view);
+	return -ENOENT;
+}
+
+
+
+/*
+ * Finds the first extent of a file that ends after logical block lblock
+ * @return 0 on success, -ENOENT if there is none, -EIO on error
+ */
+int ash_ext_next (struct inode *inode, uint32_t lblock, struct ash_raw_extent *e)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_raw_extent idx;
+	struct ash_bview root, leaf, *view;
+	int i, j, n, err = -ENOENT;
+	
+	if (!ASH_I(inode)->startblock)
+		return -ENOENT;
+	
+	if (ash_ext_bget(sb, ASH_I(inode)->startblock, &root))
+		return -EIO;
+	
+	// depth 0: the root is the only leaf
+	i = 0;
+	n = 1;
+	if (ash_ext_header(&root)->depth) {
+		i = max(ash_ext_search(&root, lblock, &idx), 0);
+		n = ash_ext_header(&root)->nr;
+	}
+	
+	for (; i < n && err == -ENOENT; i++) {
+		view = &root;
+	
+		if (ash_ext_header(&root)->depth) {
+			ash_ext_get(&root, i, &idx);
+			if (ash_ext_bget(sb, idx.start, &leaf)) {
+				err = -EIO;
+				break;
+			}
+			view = &leaf;
+		}
+	
+		// the extent holding lblock, or else the one after it
+		j = max(ash_ext_search(view, lblock, e), 0);
+	
+		for (; j < ash_ext_header(view)->nr; j++) {
+			ash_ext_get(view, j, e);
+	
+			if (e->lblock + ASH_EXT_LEN(e) > lblock) {
+				err = 0;
+				break;
+			}
+		}
+	
+		if (view != &root)
+			ash_bput(view);
+	}
+	
+	ash_bput(&root);
+	
+	return err;
+}
+
+
+
+/*
+ * Finds the last extent of a file: the last entry of the root, or of the
+ * last leaf. An empty tree gives an extent with len 0.
+ * @return 0 on success
+ */
+static int ash_ext_last (struct super_block *sb, uint32_t root, struct ash_raw_extent *e)
+{
+	struct ash_raw_extent_header *hdr;
+	struct ash_bview view;
+	int err;
+	
+	err = ash_ext_bget(sb, root, &view);
+	if (err)
+		return err;
+	
+	hdr = ash_ext_header(&view);
+	memset(e, 0, sizeof(*e));
+	
+	if (hdr->nr)
+		ash_ext_get(&view, hdr->nr - 1, e);
+	
+	if (hdr->depth && hdr->nr) {
+		ash_bput(&view);
+	
+		err = ash_ext_bget(sb, e->start, &view);
+		if (err)
+			return err;
+	
+		hdr = ash_ext_header(&view);
+		memset(e, 0, sizeof(*e));
+	
+		if (hdr->nr)
+			ash_ext_get(&view, hdr->nr - 1, e);
+	}
+	
+	ash_bput(&view);
+	
+	return 0;
+}
+
+
+
+/*
+ * Last physical block of an extent mapped file, and in *end the logical
+ * block right after it
+ * @return block number, 0 if the file has no blocks, or -1 on error
+ */
+int ash_ext_tail (struct inode *inode, uint32_t *end)
+{
+	struct ash_raw_extent e;
+	
+	*end = 0;
+	
+	if (!ASH_I(inode)->startblock)
+		return 0;
+	
+	if (ash_ext_last(inode->i_sb, ASH_I(inode)->startblock, &e))
+		return -1;
+	
+	*end = e.lblock + ASH_EXT_LEN(&e);
+	
+	return e.len ? e.start + ASH_EXT_LEN(&e) - 1 : 0;
+}
+
+
+
+/*
+ * Counts the blocks the extents of a file map, unwritten ones included
+ * @return 0 on success, the count in *count
+ */
+int ash_ext_count (struct inode *inode, uint32_t *count)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_raw_extent e, x;
+	struct ash_bview root, leaf;
+	int i, j, err = 0;
+	
+	*count = 0;
+	
+	if (!ASH_I(inode)->startblock)
+		return 0;
+	
+	if (ash_ext_bget(sb, ASH_I(inode)->startblock, &root))
+		return -EIO;
+	
+	for (i = 0; i < ash_ext_header(&root)->nr; i++) {
+		ash_ext_get(&root, i, &e);
+	
+		if (!ash_ext_header(&root)->depth) {
+			*count += ASH_EXT_LEN(&e);
+			continue;
+		}
+	
+		if (ash_ext_bget(sb, e.start, &leaf)) {
+			err = -EIO;
+			break;
+		}
+	
+		for (j = 0; j < ash_ext_header(&leaf)->nr; j++) {
+			ash_ext_get(&leaf, j, &x);
+			*count += ASH_EXT_LEN(&x);
+		}
+	
+		ash_bput(&leaf);
+	}
+	
+	ash_bput(&root);
+	
+	return err;
+}
+
+
+
+/*
+ * Allocates and sets up an empty extent block, near goal if possible
+ * @return 0 on success, the block number in *block
+ */
+static int ash_ext_new_block (struct super_block *sb, uint32_t goal, uint16_t depth, uint32_t *block)
+{
+	struct ash_raw_extent_header *hdr;
+	struct ash_bview view;
+	int len;
+	
+	len = ash_alloc_run(sb, goal, 1, block);
+	if (len < 0)
+		return len;
+	
+	if (ash_bget_new(sb, *block, &view)) {
+		ash_free_run(sb, *block, 1);
+		return -EIO;
+	}
+	
+	hdr = ash_ext_header(&view);
+	hdr->magic = ASH_EXT_MAGIC;
+	hdr->nr = 0;
+	hdr->depth = depth;
+	hdr->max = (ASH_SB(sb)->blocksize - sizeof(*hdr)) / sizeof(struct ash_raw_extent);
+	
+	ash_bdirty(&view);
+	ash_bput(&view);
+	
+	return 0;
+}
+
+
+
+/*
+ * Whether leaf extent b continues a, in the file and on the disk, and they
+ * can be one: both are written or both unwritten, and the length fits
+ */
+static inline int ash_ext_follows (struct ash_raw_extent *a, struct ash_raw_extent *b)
+{
+	return a->lblock + ASH_EXT_LEN(a) == b->lblock && a->start + ASH_EXT_LEN(a) == b->start &&
+			!((a->len ^ b->len) & ASH_EXT_UNWRITTEN) && ASH_EXT_LEN(a) + ASH_EXT_LEN(b) < ASH_EXT_UNWRITTEN;
+}
+
+
+
+/*
+ * Adds the entry e after the last one of an extent block. A leaf extent that
+ * continues the last one on the disk just makes it longer.
+ * @return 0 on success, -ENOSPC if the block is full
+ */
+static int ash_ext_add (struct ash_bview *view, struct ash_raw_extent *e)
+{
+	struct ash_raw_extent_header *hdr = ash_ext_header(view);
+	struct ash_raw_extent last;
+	
+	if (hdr->nr && !hdr->depth) {
+		ash_ext_get(view, hdr->nr - 1, &last);
+	
+		if (ash_ext_follows(&last, e)) {
+			last.len += ASH_EXT_LEN(e);
+			ash_ext_put(view, hdr->nr - 1, &last);
+			ash_bdirty(view);
+			return 0;
+		}
+	}
+	
+	if (hdr->nr == hdr->max)
+		return -ENOSPC;
+	
+	ash_ext_put(view, hdr->nr, e);
+	hdr->nr++;
+	ash_bdirty(view);
+	
+	return 0;
+}
+
+
+
+/*
+ * Puts the entry e in an extent block, among the others by logical block.
+ * A leaf extent that continues one of its neighbours on the disk is merged
+ * with it instead (with both, when it fills the gap between them).
+ * @return 0 on success, -ENOSPC if the block is full
+ */
+static int ash_ext_place (struct ash_bview *view, struct ash_raw_extent *e)
+{
+	struct ash_raw_extent_header *hdr = ash_ext_header(view);
+	struct ash_raw_extent prev, next, x;
+	int i, j, has_next;
+	
+	i = ash_ext_search(view, e->lblock, &prev);
+	
+	has_next = i + 1 < hdr->nr;
+	if (has_next)
+		ash_ext_get(view, i + 1, &next);
+	
+	if (!hdr->depth && i >= 0 && ash_ext_follows(&prev, e)) {
+		prev.len += ASH_EXT_LEN(e);
+	
+		if (has_next && ash_ext_follows(&prev, &next)) {
+			prev.len += ASH_EXT_LEN(&next);
+	
+			for (j = i + 2; j < hdr->nr; j++) {
+				ash_ext_get(view, j, &x);
+				ash_ext_put(view, j - 1, &x);
+			}
+			hdr->nr--;
+		}
+	
+		ash_ext_put(view, i, &prev);
+		ash_bdirty(view);
+		return 0;
+	}
+	
+	if (!hdr->depth && has_next && ash_ext_follows(e, &next)) {
+		next.lblock = e->lblock;
+		next.start = e->start;
+		next.len += ASH_EXT_LEN(e);
+		ash_ext_put(view, i + 1, &next);
+		ash_bdirty(view);
+		return 0;
+	}
+	
+	if (hdr->nr == hdr->max)
+		return -ENOSPC;
+	
+	for (j = hdr->nr; j > i + 1; j--) {
+		ash_ext_get(view, j - 1, &x);
+		ash_ext_put(view, j, &x);
+	}
+	
+	ash_ext_put(view, i + 1, e);
+	hdr->nr++;
+	ash_bdirty(view);
+	
+	return 0;
+}
+
+
+
+/*
+ * Moves the extents of a full root into a new leaf, and makes the root
+ * point to it, so the tree gets one level deeper
+ * @return 0 on success
+ */
+static int ash_ext_grow (struct super_block *sb, struct ash_bview *root)
+{
+	struct ash_raw_extent_header *hdr;
+	struct ash_raw_extent e;
+	uint32_t leaf;
+	void *data;
+	int err;
+	
+	err = ash_ext_new_block(sb, root->block + 1, 0, &leaf);
+	if (err)
+		return err;
+	
+	// the leaf becomes a copy of the root
+	data = kmalloc(ASH_SB(sb)->blocksize, GFP_NOFS);
+	if (!data) {
+		ash_free_run(sb, leaf, 1);
+		return -ENOMEM;
+	}
+	
+	ash_bview_copy(root, 0, data, ASH_SB(sb)->blocksize, ASH_BVIEW_READ);
+	err = block_write(sb, data, leaf);
+	kfree(data);
+	
+	if (err) {
+		ash_free_run(sb, leaf, 1);
+		return err;
+	}
+	
+	hdr = ash_ext_header(root);
+	hdr->depth = 1;
+	hdr->nr = 1;
+	
+	e.lblock = 0;
+	e.start = leaf;
+	e.len = 0;
+	ash_ext_put(root, 0, &e);
+	ash_bdirty(root);
+	
+	return 0;
+}
+
+
+
+/*
+ * Moves the upper half of the entries of a full leaf to a new leaf right
+ * after it in the root
+ * @return 0 on success, -EFBIG if the root is full too
+ */
+static int ash_ext_split (struct super_block *sb, struct ash_bview *root, struct ash_bview *leaf)
+{
+	struct ash_raw_extent_header *hdr = ash_ext_header(leaf);
+	struct ash_raw_extent e, idx;
+	struct ash_bview newv;
+	uint32_t block;
+	int i, half, err;
+	
+	if (ash_ext_header(root)->nr == ash_ext_header(root)->max)
+		return -EFBIG;
+	
+	err = ash_ext_new_block(sb, leaf->block + 1, 0, &block);
+	if (err)
+		return err;
+	
+	err = ash_ext_bget(sb, block, &newv);
+	if (err) {
+		ash_free_run(sb, block, 1);
+		return err;
+	}
+	
+	half = hdr->nr / 2;
+	ash_ext_get(leaf, half, &idx);
+	
+	for (i = half; i < hdr->nr; i++) {
+		ash_ext_get(leaf, i, &e);
+		ash_ext_put(&newv, i - half, &e);
+	}
+	
+	ash_ext_header(&newv)->nr = hdr->nr - half;
+	hdr->nr = half;
+	ash_bdirty(&newv);
+	ash_bdirty(leaf);
+	ash_bput(&newv);
+	
+	// the new leaf holds the extents from its first one on
+	idx.start = block;
+	idx.len = 0;
+	
+	return ash_ext_place(root, &idx);
+}
+
+
+
+/*
+ * Maps len blocks starting with start from logical block lblock on, which
+ * is at or past the end of the last extent (what is between is a hole),
+ * making the root (and a leaf) when they are needed. An unwritten extent
+ * has ASH_EXT_UNWRITTEN in len.
+ * Called with the inode's alloc_lock held.
+ * @return 0 on success, -EFBIG if the file has too many extents
+ */
+int ash_ext_append (struct inode *inode, uint32_t lblock, uint32_t start, uint32_t len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct ash_raw_extent e, idx;
+	struct ash_bview root, leafv;
+	uint32_t leaf;
+	int err;
+	
+	if (!ei->startblock) {
+		err = ash_ext_new_block(sb, start ? start - 1 : 0, 0, &ei->startblock);
+		if (err)
+			return err;
+	}
+	
+	e.lblock = lblock;
+	e.start = start;
+	e.len = len;
+	
+	err = ash_ext_bget(sb, ei->startblock, &root);
+	if (err)
+		return err;
+	
+	if (!ash_ext_header(&root)->depth) {
+		err = ash_ext_add(&root, &e);
+	
+		if (err != -ENOSPC)
+			goto out;
+	
+		err = ash_ext_grow(sb, &root);
+		if (err)
+			goto out;
+	}
+	
+	// depth 1: add to the last leaf, or to a new one after it
+	ash_ext_get(&root, ash_ext_header(&root)->nr - 1, &idx);
+	
+	err = ash_ext_bget(sb, idx.start, &leafv);
+	if (err)
+		goto out;
+	
+	err = ash_ext_add(&leafv, &e);
+	ash_bput(&leafv);
+	
+	if (err != -ENOSPC)
+		goto out;
+	
+	if (ash_ext_header(&root)->nr == ash_ext_header(&root)->max) {
+		err = -EFBIG;
+		goto out;
+	}
+	
+	err = ash_ext_new_block(sb, idx.start + 1, 0, &leaf);
+	if (err)
+		goto out;
+	
+	err = ash_ext_bget(sb, leaf, &leafv);
+	if (err) {
+		ash_free_run(sb, leaf, 1);
+		goto out;
+	}
+	
+	ash_ext_add(&leafv, &e);
+	ash_bput(&leafv);
+	
+	idx.lblock = e.lblock;
+	idx.start = leaf;
+	idx.len = 0;
+	err = ash_ext_add(&root, &idx);
+	
+out:
+	ash_bput(&root);
+	
+	return err;
+}
+
+
+
+/*
+ * Maps len blocks starting with start from logical block lblock on, in a
+ * hole of the file or past its last extent (see ash_ext_append). A full leaf
+ * is split in two, a full root makes the tree one level deeper.
+ * Called with the inode's alloc_lock held, and ei->nr_blocks known.
+ * @return 0 on success, -EFBIG if the file has too many extents
+ */
+int ash_ext_insert (struct inode *inode, uint32_t lblock, uint32_t start, uint32_t len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct ash_raw_extent e, idx;
+	struct ash_bview root, leaf;
+	int err;
+	
+	if (!ei->startblock || lblock >= ei->nr_blocks)
+		return ash_ext_append(inode, lblock, start, len);
+	
+	e.lblock = lblock;
+	e.start = start;
+	e.len = len;
+	
+	err = ash_ext_bget(sb, ei->startblock, &root);
+	if (err)
+		return err;
+	
+	if (!ash_ext_header(&root)->depth) {
+		err = ash_ext_place(&root, &e);
+	
+		if (err != -ENOSPC)
+			goto out;
+	
+		err = ash_ext_grow(sb, &root);
+		if (err)
+			goto out;
+	}
+	
+	// depth 1: the leaf holding the extents around lblock, split once if it is full
+	do {
+		if (ash_ext_search(&root, lblock, &idx) < 0)
+			ash_ext_get(&root, 0, &idx);
+	
+		err = ash_ext_bget(sb, idx.start, &leaf);
+		if (err)
+			goto out;
+	
+		err = ash_ext_place(&leaf, &e);
+		if (err == -ENOSPC) {
+			err = ash_ext_split(sb, &root, &leaf);
+			if (!err)
+				err = -EAGAIN;
+		}
+	
+		ash_bput(&leaf);
+	} while (err == -EAGAIN);
+	
+out:
+	ash_bput(&root);
+	
+	return err;
+}
+
+
+
+/*
+ * Pins the root of a file's extent tree, and the leaf holding the extents
+ * around logical block lblock if the root is not a leaf itself
+ * @return the view of the leaf (root or leaf), NULL on error
+ */
+static struct ash_bview* ash_ext_leaf (struct inode *inode, uint32_t lblock,
+		struct ash_bview *root, struct ash_bview *leaf)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_raw_extent idx;
+	
+	if (ash_ext_bget(sb, ASH_I(inode)->startblock, root))
+		return NULL;
+	
+	if (!ash_ext_header(root)->depth)
+		return root;
+	
+	if (ash_ext_search(root, lblock, &idx) < 0)
+		ash_ext_get(root, 0, &idx);
+	
+	if (!ash_ext_bget(sb, idx.start, leaf))
+		return leaf;
+	
+	ash_bput(root);
+	
+	return NULL;
+}
+
+
+
+/*
+ * Lets go of what ash_ext_leaf pinned
+ */
+static inline void ash_ext_unleaf (struct ash_bview *root, struct ash_bview *view)
+{
+	if (view != root)
+		ash_bput(view);
+	ash_bput(root);
+}
+
+
+
+/*
+ * Replaces the leaf extent that starts with logical block x->lblock by x
+ * @return 0 on success, -ENOENT if there is none, -EIO on error
+ */
+static int ash_ext_set (struct inode *inode, struct ash_raw_extent *x)
+{
+	struct ash_raw_extent e;
+	struct ash_bview root, leaf, *view;
+	int i, err = -ENOENT;
+	
+	view = ash_ext_leaf(inode, x->lblock, &root, &leaf);
+	if (!view)
+		return -EIO;
+	
+	i = ash_ext_search(view, x->lblock, &e);
+	
+	if (i >= 0 && e.lblock == x->lblock) {
+		ash_ext_put(view, i, x);
+		ash_bdirty(view);
+		err = 0;
+	}
+	
+	ash_ext_unleaf(&root, view);
+	
+	return err;
+}
+
+
+
+/*
+ * Moves the first n blocks of the unwritten extent that starts with logical
+ * block lblock to the written extent before it in the leaf, if that one ends
+ * right where they start, in the file and on the disk. Pages written in order
+ * over preallocated blocks then keep growing the same extent.
+ * @return 1 if it did, 0 if they don't follow it, -EIO on error
+ */
+static int ash_ext_absorb (struct inode *inode, uint32_t lblock, uint32_t n)
+{
+	struct ash_raw_extent_header *hdr;
+	struct ash_raw_extent prev, e, x;
+	struct ash_bview root, leaf, *view;
+	int i, j, done = 0;
+	
+	view = ash_ext_leaf(inode, lblock, &root, &leaf);
+	if (!view)
+		return -EIO;
+	
+	hdr = ash_ext_header(view);
+	i = ash_ext_search(view, lblock, &e);
+	
+	if (i > 0 && e.lblock == lblock && (e.len & ASH_EXT_UNWRITTEN) && n <= ASH_EXT_LEN(&e)) {
+		ash_ext_get(view, i - 1, &prev);
+	
+		if (!(prev.len & ASH_EXT_UNWRITTEN) && prev.lblock + prev.len == e.lblock &&
+				prev.start + prev.len == e.start && prev.len + n < ASH_EXT_UNWRITTEN)
+			done = 1;
+	}
+	
+	if (done) {
+		prev.len += n;
+		ash_ext_put(view, i - 1, &prev);
+	
+		// what is left of the unwritten extent, if anything
+		if (n < ASH_EXT_LEN(&e)) {
+			e.lblock += n;
+			e.start += n;
+			e.len -= n;
+			ash_ext_put(view, i, &e);
+		} else {
+			for (j = i + 1; j < hdr->nr; j++) {
+				ash_ext_get(view, j, &x);
+				ash_ext_put(view, j - 1, &x);
+			}
+			hdr->nr--;
+		}
+	
+		ash_bdirty(view);
+	}
+	
+	ash_ext_unleaf(&root, view);
+	
+	return done;
+}
+
+
+
+/*
+ * Whether some of the blocks of a file from lblock to end are in unwritten extents
+ * Called with the inode's alloc_lock held.
+ * @return 1 if some are, 0 if not, -EIO on error
+ */
+int ash_ext_unwritten (struct inode *inode, uint32_t lblock, uint32_t end)
+{
+	struct ash_raw_extent e;
+	int err;
+	
+	while (lblock < end) {
+		err = ash_ext_next(inode, lblock, &e);
+		if (err)
+			return err == -ENOENT ? 0 : err;
+	
+		if (e.lblock >= end)
+			break;
+		if (e.len & ASH_EXT_UNWRITTEN)
+			return 1;
+	
+		lblock = e.lblock + ASH_EXT_LEN(&e);
+	}
+	
+	return 0;
+}
+
+
+
+/*
+ * Marks the blocks of a file from lblock to end written, as pages are written
+ * over them. Blocks at the start of an unwritten extent go to the written
+ * extent before it when they follow it (see ash_ext_absorb). Otherwise the
+ * unwritten extent is split: the part before them stays in its entry and the
+ * part after them gets one of its own, both unwritten still. The tail goes in
+ * first, so a failure leaves at worst some of the blocks unwritten, never
+ * unmapped.
+ * Called with the inode's alloc_lock held.
+ * @return 0 on success
+ */
+int ash_ext_convert (struct inode *inode, uint32_t lblock, uint32_t end)
+{
+	struct ash_raw_extent e, x;
+	uint32_t from, to, n;
+	int err;
+	
+	while (lblock < end) {
+		err = ash_ext_next(inode, lblock, &e);
+		if (err)
+			return err == -ENOENT ? 0 : err;
+	
+		if (e.lblock >= end)
+			break;
+	
+		n = ASH_EXT_LEN(&e);
+		from = max(lblock, e.lblock);
+		to = min(end, e.lblock + n);
+		lblock = e.lblock + n;
+	
+		if (!(e.len & ASH_EXT_UNWRITTEN))
+			continue;
+	
+		if (from == e.lblock) {
+			err = ash_ext_absorb(inode, from, to - from);
+			if (err < 0)
+				return err;
+			if (err)
+				continue;
+		}
+	
+		if (to < e.lblock + n) {
+			err = ash_ext_insert(inode, to, e.start + (to - e.lblock), (e.lblock + n - to) | ASH_EXT_UNWRITTEN);
+			if (err)
+				return err;
+		}
+	
+		// the entry keeps the head, or becomes the written part
+		x.lblock = e.lblock;
+		x.start = e.start;
+		x.len = from > e.lblock ? (from - e.lblock) | ASH_EXT_UNWRITTEN : to - from;
+	
+		err = ash_ext_set(inode, &x);
+		if (err)
+			return err;
+		if (from == e.lblock)
+			continue;
+	
+		err = ash_ext_insert(inode, from, e.start + (from - e.lblock), to - from);
+		if (err) {
+			x.len = (to - e.lblock) | ASH_EXT_UNWRITTEN;
+			ash_ext_set(inode, &x);
+			return err;
+		}
+	}
+	
+	return 0;
+}
+
+
+
+/*
+ * Gives back to the UBB the blocks of extent e from logical block *lblock on,
+ * at most *left of them; both are moved past what was freed.
+ * @return 1 if some of the extent is left
+ */
+static int ash_ext_free_part (struct super_block *sb, struct ash_raw_extent *e, uint32_t *lblock, uint32_t *left)
+{
+	uint32_t end = e->lblock + ASH_EXT_LEN(e);
+	uint32_t from = max(*lblock, e->lblock);
+	uint32_t n;
+	
+	if (from >= end)
+		return 0;
+	
+	n = min(end - from, *left);
+	ash_free_run(sb, e->start + (from - e->lblock), n);
+	
+	*lblock = from + n;
+	*left -= n;
+	
+	return *lblock < end;
+}
+
+
+
+/*
+ * Gives back to the UBB the blocks the extents of a file map from logical
+ * block *lblock on, at most max of them, so that a big file can be freed in
+ * several journal operations; *lblock is moved past them. A leaf goes with
+ * its last extent, and *lblock to the first block of the next leaf, so it is
+ * never read once it may be used again; the root goes with the last leaf.
+ * Whatever can't be read is left allocated.
+ * @return 1 if there is more to free, 0 if not
+ */
+int ash_ext_free (struct inode *inode, uint32_t *lblock, uint32_t max)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_raw_extent e, x;
+	struct ash_bview root, leaf;
+	uint32_t next;
+	int i, j, more = 0;
+	
+	if (!ASH_I(inode)->startblock || ash_ext_bget(sb, ASH_I(inode)->startblock, &root))
+		return 0;
+	
+	for (i = 0; i < ash_ext_header(&root)->nr && !more; i++) {
+		ash_ext_get(&root, i, &e);
+	
+		if (!ash_ext_header(&root)->depth) {
+			more = ash_ext_free_part(sb, &e, lblock, &max) || (!max && i + 1 < ash_ext_header(&root)->nr);
+			continue;
+		}
+	
+		next = ~0U;
+		if (i + 1 < ash_ext_header(&root)->nr) {
+			ash_ext_get(&root, i + 1, &x);
+			next = x.lblock;
+		}
+	
+		// the leaf was freed already
+		if (*lblock >= next)
+			continue;
+	
+		if (!ash_ext_bget(sb, e.start, &leaf)) {
+			for (j = 0; j < ash_ext_header(&leaf)->nr && !more; j++) {
+				ash_ext_get(&leaf, j, &x);
+				more = ash_ext_free_part(sb, &x, lblock, &max) ||
+					(!max && j + 1 < ash_ext_header(&leaf)->nr);
+			}
+	
+			ash_bput(&leaf);
+	
+			if (more)
+				break;
+	
+			ash_free_run(sb, e.start, 1);
+		}
+	
+		*lblock = next;
+		more = !max && next != ~0U;
+	}
+	
+	ash_bput(&root);
+	
+	if (!more)
+		ash_free_run(sb, ASH_I(inode)->startblock, 1);
+	
+	return more;
+}
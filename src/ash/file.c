@@ -11,20 +11,2159 @@
 #include <linux/fs.h>
 #include <linux/dcache.h>
 #include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/blkdev.h>
+#include <linux/uio.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/writeback.h>
+#include <linux/sched.h>
+#include <linux/falloc.h>
+#include <linux/uaccess.h>
+#include "ash.h"
+
+
+/*
+ * Pages of a file that sit one after the other on the disk, gathered to go
+ * in as few bios as possible
+ */
+struct ash_page_run {
+	struct page		*pages[ASH_RA_MAX];
+	int			nr;
+	int			rw;		// READ or WRITE
+	sector_t		start;		// sector of the first page
+	sector_t		next;		// sector right after the last one
+	unsigned long		bytes;
+};
+
+/*
+ * Completion of a readahead bio: the pages are ready (or failed) and can be unlocked
+ */
+static void ash_ra_end_io (struct bio *bio, int err)
+{
+	const int uptodate = bio_flagged(bio, BIO_UPTODATE);
+	struct bio_vec *bvec;
+	int i;
+	
+	for (i = 0; i < bio->bi_vcnt; i++) {
+		bvec = bio->bi_io_vec + i;
+		
+		if (uptodate)
+			SetPageUptodate(bvec->bv_page);
+		else {
+			ClearPageUptodate(bvec->bv_page);
+			SetPageError(bvec->bv_page);
+		}
+		
+		unlock_page(bvec->bv_page);
+	}
+	
+	bio_put(bio);
+}
+
+
+
+/*
+ * Moves the readahead cursor along the file's BAT chain to logical block lblock.
+ * The cursor steps forward one entry at a time; going back, jumping far
+ * ahead or an extent mapped file asks ash_bmap instead.
+ * @return the physical block, or 0 if the chain ends before lblock
+ */
+static uint32_t ash_ra_map (struct inode *inode, struct ash_ra_state *ra, uint32_t lblock)
+{
+	struct super_block *sb = inode->i_sb;
+	int next;
+	
+	// extent mapped files have no chain to step along
+	if (lblock < ra->lblock || ra->pblock == 0 || lblock - ra->lblock > ASH_SKIP_STEP ||
+			(ASH_I(inode)->flags & ASH_FL_EXTENTS)) {
+		if (ash_bmap(inode, lblock, &ra->pblock)) {
+			ra->pblock = 0;
+			return 0;
+		}
+		
+		ra->lblock = lblock;
+	}
+	
+	while (ra->lblock < lblock) {
+		next = BAT_read(sb, ra->pblock);
+		
+		// end of the chain, or error
+		if (next <= 0)
+			return 0;
+		
+		ra->pblock = next;
+		ra->lblock++;
+	}
+	
+	return ra->pblock;
+}
+
+
+
+/*
+ * Finds the first sector holding page index of the file and how many bytes
+ * of the page are in the file. A page bigger than a block must have all its
+ * blocks next to each other on the disk to be read or written in one piece.
+ * @return 0 if it can, -ENOENT if its first block is not on the disk,
+ * 1 if its blocks are apart
+ */
+static int ash_ra_page (struct inode *inode, struct ash_ra_state *ra, pgoff_t index,
+		sector_t *sector, unsigned int *bytes)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	uint64_t pos, left;
+	uint32_t lblock, pblock, first, n;
+	
+	pos = (uint64_t) index << PAGE_CACHE_SHIFT;
+	left = i_size_read(inode) - pos;
+	
+	*bytes = min_t(uint64_t, left, PAGE_CACHE_SIZE);
+	
+	// reads go in whole sectors, the tail of the last one is zeroed by the caller
+	*bytes = (*bytes + ASH_SECTORSIZE - 1) & ~(ASH_SECTORSIZE - 1);
+	
+	lblock = pos >> sbi->blockbits;
+	first = ash_ra_map(inode, ra, lblock);
+	if (!first)
+		return -ENOENT;
+	
+	*sector = ash_block_sector(sb, first) + ((pos & (sbi->blocksize - 1)) >> ASH_SECTORBITS);
+	
+	// the rest of the blocks in the page have to follow the first one
+	n = (*bytes + sbi->blocksize - 1) >> sbi->blockbits;
+	pblock = first;
+	
+	while (--n > 0) {
+		if (ash_ra_map(inode, ra, ++lblock) != ++pblock)
+			return 1;
+	}
+	
+	return 0;
+}
+
+
+
+/*
+ * i_blocks of count Ash blocks, which it keeps in sectors
+ */
+static inline blkcnt_t ash_iblocks (struct super_block *sb, uint32_t count)
+{
+	return (blkcnt_t) count << (ASH_SB(sb)->blockbits - ASH_SECTORBITS);
+}
+
+
+
+/*
+ * Finds the last block of the file's data, at the end of its BAT chain
+ * or of its last extent. The entry doesn't keep how many blocks the file
+ * has, so the first call after the inode is read counts them as well, and
+ * sets i_blocks: an extent mapped file has fewer on the disk than its
+ * holes make it look. Allocations add theirs to it from then on.
+ * Called with alloc_lock held.
+ * @return block number, 0 if the file has no blocks, or -1 on error
+ */
+static int ash_chain_tail (struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_inode_info *ei = ASH_I(inode);
+	uint32_t block, n;
+	int next;
+	
+	if (ei->lastblock || !ei->startblock)
+		return ei->lastblock;
+	
+	if (ei->flags & ASH_FL_EXTENTS) {
+		next = ash_ext_tail(inode, &ei->nr_blocks);
+		if (next > 0 && ash_ext_count(inode, &n))
+			next = -1;
+		if (next > 0) {
+			ei->lastblock = next;
+			inode->i_blocks = ash_iblocks(sb, n);
+		}
+		return next;
+	}
+	
+	block = ei->startblock;
+	
+	// a chain never has more links than the disk has blocks
+	for (n = 0; n < ASH_SB(sb)->raw.maxblocks; n++) {
+		next = BAT_read(sb, block);
+	
+		if (next < 0)
+			return -1;
+		if (next == 0) {
+			ei->lastblock = block;
+			ei->nr_blocks = n + 1;
+			inode->i_blocks = ash_iblocks(sb, ei->nr_blocks);
+			return block;
+		}
+	
+		block = next;
+	}
+	
+	return -1;
+}
+
+
+
+/*
+ * Whether the file can have holes: an extent mapped one can, if its pages
+ * are made of whole blocks (a hole in a block shared with other pages would
+ * leave them to read what was on the disk)
+ */
+static inline int ash_sparse (struct inode *inode)
+{
+	struct ash_sb_info *sbi = ASH_SB(inode->i_sb);
+	
+	return (ASH_I(inode)->flags & ASH_FL_EXTENTS) && sbi->blocksize <= PAGE_CACHE_SIZE;
+}
+
+
+
+/*
+ * First logical block from lblock on that the file has data for: on the
+ * disk, or reserved by a write (those follow the last extent). Unwritten
+ * extents read as zeroes like holes, they only count if unwritten is set.
+ * Called with alloc_lock held.
+ * @return 0 with the block in *data, -ENOENT if there is none, -EIO on error
+ */
+static int ash_next_data (struct inode *inode, uint32_t lblock, uint32_t *data, int unwritten)
+{
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct ash_raw_extent e;
+	int err;
+	
+	if (ash_chain_tail(inode) < 0)
+		return -EIO;
+	
+	if (lblock >= ei->nr_blocks + ei->resv_blocks)
+		return -ENOENT;
+	
+	*data = lblock;
+	if (!(ei->flags & ASH_FL_EXTENTS))
+		return 0;
+	
+	for (;;) {
+		err = ash_ext_next(inode, lblock, &e);
+		if (err || unwritten || !(e.len & ASH_EXT_UNWRITTEN))
+			break;
+	
+		lblock = e.lblock + ASH_EXT_LEN(&e);
+	}
+	
+	if (err == -ENOENT) {
+		*data = max(lblock, ei->nr_blocks);
+		return *data < ei->nr_blocks + ei->resv_blocks ? 0 : -ENOENT;
+	}
+	if (err)
+		return err;
+	
+	*data = max(lblock, e.lblock);
+	
+	return 0;
+}
+
+
+
+/*
+ * First logical block from lblock on that is a hole: neither on the disk nor
+ * reserved. Past the last one there is always one.
+ * Called with alloc_lock held.
+ * @return 0 with the block in *hole, -EIO on error
+ */
+static int ash_next_hole (struct inode *inode, uint32_t lblock, uint32_t *hole)
+{
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct ash_raw_extent e;
+	int err;
+	
+	if (ash_chain_tail(inode) < 0)
+		return -EIO;
+	
+	while ((ei->flags & ASH_FL_EXTENTS) && lblock < ei->nr_blocks) {
+		err = ash_ext_next(inode, lblock, &e);
+		if (err)
+			return err == -ENOENT ? -EIO : err;
+	
+		if (e.lblock > lblock)
+			break;
+	
+		lblock = e.lblock + ASH_EXT_LEN(&e);
+	}
+	
+	if (lblock >= ei->nr_blocks)
+		lblock = max(lblock, ei->nr_blocks + ei->resv_blocks);
+	
+	*hole = lblock;
+	
+	return 0;
+}
+
+
+
+/*
+ * Bytes at the start of the file that its blocks hold. Past them are the
+ * blocks fallocate gave an ASH_FL_UNWRITTEN file, never written: they read as
+ * zeroes without going to the disk.
+ */
+static inline loff_t ash_valid_bytes (struct inode *inode)
+{
+	struct ash_inode_info *ei = ASH_I(inode);
+	
+	if (!(ei->flags & ASH_FL_UNWRITTEN))
+		return LLONG_MAX;
+	
+	return (loff_t) ei->valid << ASH_SB(inode->i_sb)->blockbits;
+}
+
+
+
+/*
+ * Marks the blocks from pos to end written, as pages are written over them:
+ * unwritten extents among them are split (see ash_ext_convert), and the end
+ * of the written blocks of an ASH_FL_UNWRITTEN file moves up to end. Once
+ * all its blocks were written, it is a file like the others.
+ * @return 0 on success
+ */
+static int ash_valid_extend (struct inode *inode, loff_t pos, loff_t end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	uint32_t first, blocks;
+	int started, err = 0, dirty = 0;
+	
+	first = pos >> sbi->blockbits;
+	blocks = (end + sbi->blocksize - 1) >> sbi->blockbits;
+	
+	if (ei->flags & ASH_FL_EXTENTS) {
+		mutex_lock(&ei->alloc_lock);
+		err = ash_ext_unwritten(inode, first, blocks);
+		mutex_unlock(&ei->alloc_lock);
+	
+		if (err > 0) {
+			started = ash_journal_start(sb);
+			mutex_lock(&ei->alloc_lock);
+			err = ash_ext_convert(inode, first, blocks);
+			mutex_unlock(&ei->alloc_lock);
+			ash_journal_stop(sb, started);
+		}
+	}
+	
+	if (err || !(ei->flags & ASH_FL_UNWRITTEN))
+		return err;
+	
+	mutex_lock(&ei->alloc_lock);
+	
+	if (ash_chain_tail(inode) >= 0 && (ei->flags & ASH_FL_UNWRITTEN) && blocks > ei->valid) {
+		ei->valid = min(blocks, ei->nr_blocks);
+		if (ei->valid == ei->nr_blocks)
+			ei->flags &= ~ASH_FL_UNWRITTEN;
+		dirty = 1;
+	}
+	
+	mutex_unlock(&ei->alloc_lock);
+	
+	if (dirty)
+		mark_inode_dirty(inode);
+	
+	return 0;
+}
+
+
+
+/*
+ * Completion of a bio writing pages of a file
+ */
+static void ash_wr_end_io (struct bio *bio, int err)
+{
+	const int uptodate = bio_flagged(bio, BIO_UPTODATE);
+	struct bio_vec *bvec;
+	int i;
+	
+	for (i = 0; i < bio->bi_vcnt; i++) {
+		bvec = bio->bi_io_vec + i;
+	
+		if (!uptodate) {
+			SetPageError(bvec->bv_page);
+			if (bvec->bv_page->mapping)
+				mapping_set_error(bvec->bv_page->mapping, -EIO);
+		}
+	
+		end_page_writeback(bvec->bv_page);
+	}
+	
+	bio_put(bio);
+}
+
+
+
+/*
+ * Sends the pages gathered in a run. Pages read drop our reference to them,
+ * the page cache keeps its own.
+ */
+static void ash_run_submit (struct super_block *sb, struct ash_page_run *run)
+{
+	int i, sent;
+	
+	if (run->nr == 0)
+		return;
+	
+	if (run->rw == READ) {
+		sent = ash_rw_pages(sb, READ, run->start, run->pages, run->bytes, ash_ra_end_io, NULL);
+	
+		for (i = 0; i < run->nr; i++) {
+			// never sent, readpage will have to deal with them
+			if (i >= sent)
+				unlock_page(run->pages[i]);
+	
+			page_cache_release(run->pages[i]);
+		}
+	} else {
+		sent = ash_rw_pages(sb, WRITE, run->start, run->pages, run->bytes, ash_wr_end_io, NULL);
+	
+		// never sent, they stay dirty for the next writeback
+		for (i = sent; i < run->nr; i++) {
+			set_page_dirty(run->pages[i]);
+			end_page_writeback(run->pages[i]);
+		}
+	}
+	
+	run->nr = 0;
+}
+
+
+
+/*
+ * Adds a page to a run; len bytes of it go from or to the disk at sector.
+ * The run is sent first if the page doesn't follow it on the disk.
+ */
+static void ash_run_add (struct super_block *sb, struct ash_page_run *run, struct page *page,
+		sector_t sector, unsigned int len)
+{
+	if (run->nr && sector != run->next)
+		ash_run_submit(sb, run);
+	
+	if (run->nr == 0) {
+		run->start = sector;
+		run->bytes = 0;
+	}
+	
+	run->pages[run->nr++] = page;
+	run->bytes += len;
+	run->next = sector + (len >> ASH_SECTORBITS);
+	
+	// a partial page can't have anything after it in the same run
+	if (run->nr == ASH_RA_MAX || len < PAGE_CACHE_SIZE)
+		ash_run_submit(sb, run);
+}
+
+
+
+/*
+ * Reads ahead pages from to to (included) of the file. The BAT chain is followed
+ * to find where they are, and pages that sit one after the other on the disk are
+ * sent together in as few bios as possible. Pages already in the page cache, or
+ * whose blocks are not contiguous, are left for readpage.
+ */
+static void ash_ra_issue (struct file *filp, struct ash_ra_state *ra, pgoff_t from, pgoff_t to)
+{
+	struct address_space *mapping = filp->f_mapping;
+	struct inode *inode = mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct ash_page_run run;
+	struct page *page;
+	sector_t sector;
+	unsigned int len;
+	pgoff_t index;
+	
+	run.nr = 0;
+	run.rw = READ;
+	
+	for (index = from; index <= to; index++) {
+		
+		page = find_get_page(mapping, index);
+		if (page) {
+			page_cache_release(page);
+			ash_run_submit(sb, &run);
+			continue;
+		}
+	
+		// unwritten blocks are not read, readpage zeroes them
+		if (((loff_t) (index + 1) << PAGE_CACHE_SHIFT) > ash_valid_bytes(inode) ||
+				ash_ra_page(inode, ra, index, &sector, &len)) {
+			ash_run_submit(sb, &run);
+			continue;
+		}
+	
+		page = page_cache_alloc_cold(mapping);
+		if (!page)
+			break;
+		
+		// comes back locked, ash_ra_end_io unlocks it
+		if (add_to_page_cache_lru(page, mapping, index, GFP_KERNEL)) {
+			page_cache_release(page);
+			ash_run_submit(sb, &run);
+			continue;
+		}
+		
+		// last page of the file
+		if (len < PAGE_CACHE_SIZE)
+			zero_user_segment(page, len, PAGE_CACHE_SIZE);
+	
+		ash_run_add(sb, &run, page, sector, len);
+	}
+	
+	ash_run_submit(sb, &run);
+	
+	// don't let the bios wait for the unplug timer
+	blk_run_address_space(sb->s_bdev->bd_inode->i_mapping);
+}
+
+
+
+/*
+ * Readahead for Ash files. The VM readahead is off for Ash (see ash_backing_dev_info),
+ * as the blocks of a file are not found by going linearly over the disk but by
+ * following the BAT. Each open file keeps a window of pages to read ahead of
+ * the reader: it doubles on every sequential read, up to ASH_RA_MAX pages, and
+ * starts over from ASH_RA_MIN when the reader jumps. New reads are sent once the
+ * reader gets within half a window of what was already read ahead, so the next
+ * blocks are on their way while the current ones are being used.
+ */
+static void ash_readahead (struct file *filp, loff_t pos, size_t count)
+{
+	struct inode *inode = filp->f_mapping->host;
+	struct ash_ra_state *ra = filp->private_data;
+	loff_t size = i_size_read(inode);
+	pgoff_t first, last, end, to;
+	
+	// nothing on the disk to read ahead from; blocks in a slice of a
+	// kernel block are read by readpage, through the buffer cache
+	if (!ra || !ASH_I(inode)->startblock || count == 0 || pos >= size || ASH_SB(inode->i_sb)->aper_bits)
+		return;
+	
+	first = pos >> PAGE_CACHE_SHIFT;
+	last = (pos + count - 1) >> PAGE_CACHE_SHIFT;
+	end = (size - 1) >> PAGE_CACHE_SHIFT;
+	
+	// readers of the same open file share the window and the chain cursor
+	mutex_lock(&ra->lock);
+	
+	if (first == ra->next || first + 1 == ra->next) {
+		// sequential, let the window grow
+		ra->window = min_t(unsigned long, ra->window << 1, ASH_RA_MAX);
+	} else {
+		ra->window = ASH_RA_MIN;
+		ra->ahead = first;
+	}
+	
+	ra->next = last + 1;
+	
+	if (ra->ahead < first)
+		ra->ahead = first;
+	
+	to = min(last + ra->window, end);
+	
+	// unless still far enough ahead of the reader
+	if (ra->ahead <= last + (ra->window >> 1) && ra->ahead <= to) {
+		ash_ra_issue(filp, ra, ra->ahead, to);
+		ra->ahead = to + 1;
+	}
+	
+	mutex_unlock(&ra->lock);
+}
+
+
+
+/*
+ * Reads (rw READ) or writes (rw WRITE) a page of a file a block at a time,
+ * when its blocks are apart on the disk or not all there. Blocks in a slice
+ * of a kernel block go through the buffer cache, the others get a bio each.
+ * Waits until it is done. Reading, what is not on the disk reads as zeroes.
+ * @return 0 on success
+ */
+static int ash_page_blocks (struct inode *inode, struct page *page, int rw)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_extent_io io;
+	struct ash_ra_state ra;
+	struct ash_bview view;
+	uint64_t pos, size;
+	uint32_t lblock, pblock, off, n, nr;
+	char *kaddr;
+	int err = 0;
+	
+	pos = page_offset(page);
+	size = i_size_read(inode);
+	nr = 0;
+	
+	if (pos < size)
+		nr = (min_t(uint64_t, size - pos, PAGE_CACHE_SIZE) + sbi->blocksize - 1) >> sbi->blockbits;
+	
+	memset(&ra, 0, sizeof(ra));
+	ash_extent_io_init(&io);
+	lblock = pos >> sbi->blockbits;
+	
+	// a page inside a bigger block is in one piece, unless it is not on the disk
+	if (sbi->blocksize > PAGE_CACHE_SIZE) {
+		if (rw == WRITE)
+			return -EIO;
+	
+		pblock = nr ? ash_ra_map(inode, &ra, lblock) : 0;
+		if (!pblock) {
+			zero_user_segment(page, 0, PAGE_CACHE_SIZE);
+			return 0;
+		}
+	
+		// the page stays not uptodate if it can't be read
+		if (ash_rw_pages(sb, READ, ash_block_sector(sb, pblock) + ((pos & (sbi->blocksize - 1)) >> ASH_SECTORBITS),
+				&page, PAGE_CACHE_SIZE, ash_extent_end_io, &io) != 1)
+			err = -ENOMEM;
+	
+		if (ash_extent_io_wait(sb, &io) && !err)
+			err = -EIO;
+	
+		return err;
+	}
+	
+	for (n = 0; n < nr && !err; n++) {
+		off = n << sbi->blockbits;
+		pblock = ash_ra_map(inode, &ra, lblock + n);
+	
+		if (!pblock) {
+			if (rw == WRITE)
+				err = -EIO;
+			else
+				zero_user_segment(page, off, off + sbi->blocksize);
+			continue;
+		}
+	
+		if (!sbi->aper_bits) {
+			err = ash_block_bio(sb, rw, pblock, page, off, &io);
+			continue;
+		}
+	
+		if (ash_bget(sb, pblock, &view)) {
+			err = -EIO;
+			continue;
+		}
+	
+		kaddr = kmap(page);
+		ash_bview_copy(&view, 0, kaddr + off, sbi->blocksize, rw == READ ? ASH_BVIEW_READ : ASH_BVIEW_WRITE);
+		kunmap(page);
+	
+		if (rw == WRITE)
+			ash_bdirty(&view);
+		ash_bput(&view);
+	}
+	
+	// past the end of the file
+	if (rw == READ && (nr << sbi->blockbits) < PAGE_CACHE_SIZE)
+		zero_user_segment(page, nr << sbi->blockbits, PAGE_CACHE_SIZE);
+	
+	if (ash_extent_io_wait(sb, &io) && !err)
+		err = -EIO;
+	
+	return err;
+}
+
+
+
+/*
+ * Bytes of data an ASH_FL_INLINE file has room for in its entry
+ */
+static inline uint32_t ash_inline_room (struct inode *inode)
+{
+	struct ash_inode_info *ei = ASH_I(inode);
+	
+	if (!ei->rec_block || !ei->inline_off)
+		return 0;
+	
+	return sizeof(struct ash_raw_file) - ei->inline_off;
+}
+
+
+
+/*
+ * Reads (rw READ) or writes (rw WRITE) a page of an ASH_FL_INLINE file from
+ * or to its entry. The entry is in the directory block lookup read, usually
+ * still in the buffer cache, so nothing else is read. Only page 0 has data.
+ * @return 0 on success
+ */
+static int ash_inline_page (struct inode *inode, struct page *page, int rw)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct ash_bview view;
+	uint32_t len = 0;
+	char *kaddr;
+	int started, err = 0;
+	
+	// unlinked, the entry may be another file's by now: the data is only
+	// in the page cache (see ash_inline_unlink)
+	if (!inode->i_nlink)
+		return rw == READ ? -EIO : 0;
+	
+	if (page->index == 0)
+		len = ash_inline_room(inode);
+	
+	if (!len) {
+		if (rw == READ)
+			zero_user_segment(page, 0, PAGE_CACHE_SIZE);
+		return 0;
+	}
+	
+	if (ash_bget(sb, ei->rec_block, &view))
+		return -EIO;
+	
+	kaddr = kmap(page);
+	
+	if (rw == READ) {
+		ash_bview_copy(&view, ei->rec_off + ei->inline_off, kaddr, len, ASH_BVIEW_READ);
+		memset(kaddr + len, 0, PAGE_CACHE_SIZE - len);
+	} else {
+		// all the room: past the end of the file the page is zeroes (ash_write_tail)
+		started = ash_journal_start(sb);
+		ash_bview_copy(&view, ei->rec_off + ei->inline_off, kaddr, len, ASH_BVIEW_WRITE);
+		ash_bdirty(&view);
+		err = ash_wbatch_add(&ei->wb, &view);
+		ash_journal_stop(sb, started);
+	}
+	
+	kunmap(page);
+	ash_bput(&view);
+	
+	return err;
+}
+
+
+
+/*
+ * Reads a page of a file from the disk. A page in one piece on the disk goes
+ * in a bio and is unlocked when it completes, others are read a block at a time.
+ */
+static int ash_readpage (struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct ash_ra_state ra;
+	loff_t valid = ash_valid_bytes(inode);
+	sector_t sector;
+	unsigned int len;
+	int err;
+	
+	memset(&ra, 0, sizeof(ra));
+	
+	// blocks fallocate gave the file and nothing wrote yet
+	if (page_offset(page) >= valid) {
+		zero_user_segment(page, 0, PAGE_CACHE_SIZE);
+		SetPageUptodate(page);
+		unlock_page(page);
+		return 0;
+	}
+	
+	if (!ASH_SB(sb)->aper_bits && page_offset(page) + PAGE_CACHE_SIZE <= valid &&
+			!ash_ra_page(inode, &ra, page->index, &sector, &len)) {
+		if (len < PAGE_CACHE_SIZE)
+			zero_user_segment(page, len, PAGE_CACHE_SIZE);
+	
+		if (ash_rw_pages(sb, READ, sector, &page, len, ash_ra_end_io, NULL) == 1) {
+			blk_run_address_space(sb->s_bdev->bd_inode->i_mapping);
+			return 0;
+		}
+	}
+	
+	if (ASH_I(inode)->flags & ASH_FL_INLINE)
+		err = ash_inline_page(inode, page, READ);
+	else
+		err = ash_page_blocks(inode, page, READ);
+	
+	if (!err && page_offset(page) + PAGE_CACHE_SIZE > valid)
+		zero_user_segment(page, valid - page_offset(page), PAGE_CACHE_SIZE);
+	
+	if (!err)
+		SetPageUptodate(page);
+	else
+		SetPageError(page);
+	
+	unlock_page(page);
+	
+	return err;
+}
+
+
+
+/*
+ * Reads the pages the VM asks for (fadvise, madvise, forced readahead) in runs
+ * of pages that follow each other on the disk, like ash_readahead does
+ */
+static int ash_readpages (struct file *filp, struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct ash_page_run run;
+	struct ash_ra_state ra;
+	struct page *page;
+	sector_t sector;
+	unsigned int len, i;
+	
+	memset(&ra, 0, sizeof(ra));
+	run.nr = 0;
+	run.rw = READ;
+	
+	for (i = 0; i < nr_pages; i++) {
+		page = list_entry(pages->prev, struct page, lru);
+		list_del(&page->lru);
+	
+		if (add_to_page_cache_lru(page, mapping, page->index, GFP_KERNEL)) {
+			page_cache_release(page);
+			continue;
+		}
+	
+		if (ASH_SB(sb)->aper_bits || page_offset(page) + PAGE_CACHE_SIZE > ash_valid_bytes(inode) ||
+				ash_ra_page(inode, &ra, page->index, &sector, &len)) {
+			ash_run_submit(sb, &run);
+			ash_readpage(filp, page);
+			page_cache_release(page);
+			continue;
+		}
+	
+		if (len < PAGE_CACHE_SIZE)
+			zero_user_segment(page, len, PAGE_CACHE_SIZE);
+	
+		ash_run_add(sb, &run, page, sector, len);
+	}
+	
+	ash_run_submit(sb, &run);
+	blk_run_address_space(sb->s_bdev->bd_inode->i_mapping);
+	
+	return 0;
+}
+
+
+
+/*
+ * Gets a page ready to be written: what is past the end of the file is zeroed
+ * @return 0, or -1 if the whole page is past the end (it was truncated away)
+ */
+static int ash_write_tail (struct inode *inode, struct page *page)
+{
+	loff_t size = i_size_read(inode);
+	pgoff_t end = size >> PAGE_CACHE_SHIFT;
+	unsigned int off = size & (PAGE_CACHE_SIZE - 1);
+	
+	if (page->index > end || (page->index == end && !off))
+		return -1;
+	
+	if (page->index == end)
+		zero_user_segment(page, off, PAGE_CACHE_SIZE);
+	
+	return 0;
+}
+
+
+
+/*
+ * Writes a dirty page of a file to the disk. The blocks the file only has
+ * reserved get allocated first (all of them, see ash_alloc_delayed), unless
+ * the page is written to free memory: then it stays dirty for later.
+ */
+static int ash_writepage (struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct ash_page_run run;
+	struct ash_ra_state ra;
+	sector_t sector;
+	unsigned int len;
+	int err;
+	
+	if (ash_write_tail(inode, page)) {
+		unlock_page(page);
+		return 0;
+	}
+	
+	// the data goes in the entry, with the page locked so it doesn't stop being inline meanwhile
+	if (ASH_I(inode)->flags & ASH_FL_INLINE) {
+		// no entry any more, the page keeps the data until the inode goes
+		if (!inode->i_nlink) {
+			redirty_page_for_writepage(wbc, page);
+			unlock_page(page);
+			return 0;
+		}
+	
+		err = ash_inline_page(inode, page, WRITE);
+		if (err) {
+			SetPageError(page);
+			mapping_set_error(page->mapping, err);
+		}
+	
+		set_page_writeback(page);
+		unlock_page(page);
+		end_page_writeback(page);
+	
+		return err;
+	}
+	
+	if (ASH_I(inode)->resv_blocks) {
+		err = (current->flags & PF_MEMALLOC) ? -EAGAIN : ash_alloc_delayed(inode);
+	
+		if (err) {
+			redirty_page_for_writepage(wbc, page);
+			unlock_page(page);
+			return err == -EAGAIN ? 0 : err;
+		}
+	}
+	
+	err = ash_valid_extend(inode, page_offset(page), page_offset(page) + PAGE_CACHE_SIZE);
+	if (err) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return err;
+	}
+	
+	memset(&ra, 0, sizeof(ra));
+	set_page_writeback(page);
+	unlock_page(page);
+	
+	if (!ASH_SB(sb)->aper_bits && !ash_ra_page(inode, &ra, page->index, &sector, &len)) {
+		run.nr = 0;
+		run.rw = WRITE;
+	
+		ash_run_add(sb, &run, page, sector, len);
+		ash_run_submit(sb, &run);
+		blk_run_address_space(sb->s_bdev->bd_inode->i_mapping);
+	
+		return 0;
+	}
+	
+	err = ash_page_blocks(inode, page, WRITE);
+	if (err) {
+		SetPageError(page);
+		mapping_set_error(page->mapping, err);
+	}
+	
+	end_page_writeback(page);
+	
+	return err;
+}
+
+
+
+/*
+ * Where ash_writepages is while write_cache_pages hands it the dirty pages
+ */
+struct ash_wp_state {
+	struct ash_page_run	run;
+	struct ash_ra_state	ra;		// where the pages are in the BAT chain
+};
+
+
+
+/*
+ * A dirty page of an extent mapped file has unwritten blocks: they are marked
+ * written together with those of the dirty pages right after it, in one
+ * operation, so the run goes to the disk in one piece and ends up in one
+ * extent (see ash_ext_convert). Called with the page locked.
+ * @return 1 if blocks were converted, 0 if none was unwritten, or an error
+ */
+static int ash_convert_run (struct inode *inode, struct page *page)
+{
+	struct ash_inode_info *ei = ASH_I(inode);
+	int blockbits = ASH_SB(inode->i_sb)->blockbits;
+	struct page *next;
+	pgoff_t end;
+	int dirty, err;
+	
+	if (!(ei->flags & ASH_FL_EXTENTS))
+		return 0;
+	
+	mutex_lock(&ei->alloc_lock);
+	err = ash_ext_unwritten(inode, page_offset(page) >> blockbits,
+			(page_offset(page) + PAGE_CACHE_SIZE) >> blockbits);
+	mutex_unlock(&ei->alloc_lock);
+	
+	if (err <= 0)
+		return err;
+	
+	for (end = page->index + 1; end < page->index + ASH_CONVERT_MAX; end++) {
+		next = find_get_page(inode->i_mapping, end);
+		if (!next)
+			break;
+	
+		dirty = PageDirty(next);
+		page_cache_release(next);
+		if (!dirty)
+			break;
+	}
+	
+	err = ash_valid_extend(inode, page_offset(page), (loff_t) end << PAGE_CACHE_SHIFT);
+	
+	return err ? err : 1;
+}
+
+
+
+/*
+ * Adds a dirty page to the run being written, or writes it on its own
+ * if it can't go in one piece
+ */
+static int ash_writepages_page (struct page *page, struct writeback_control *wbc, void *data)
+{
+	struct ash_wp_state *wp = data;
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	sector_t sector;
+	unsigned int len;
+	int one;
+	
+	if (ash_write_tail(inode, page)) {
+		unlock_page(page);
+		return 0;
+	}
+	
+	one = ASH_SB(sb)->aper_bits || ASH_I(inode)->resv_blocks;
+	
+	if (!one && ash_ra_page(inode, &wp->ra, page->index, &sector, &len))
+		one = ash_convert_run(inode, page) <= 0 || ash_ra_page(inode, &wp->ra, page->index, &sector, &len);
+	
+	if (one) {
+		ash_run_submit(sb, &wp->run);
+		return ash_writepage(page, wbc);
+	}
+	
+	// all its blocks are on the disk and written
+	if (ASH_I(inode)->flags & ASH_FL_UNWRITTEN)
+		ash_valid_extend(inode, page_offset(page), page_offset(page) + PAGE_CACHE_SIZE);
+	set_page_writeback(page);
+	unlock_page(page);
+	
+	ash_run_add(sb, &wp->run, page, sector, len);
+	
+	return 0;
+}
+
+
+
+/*
+ * Writes the dirty pages of a file. The blocks it has reserved are allocated
+ * first, all in one go, so the pages end up next to each other on the disk
+ * and runs of them are sent in multi-page bios.
+ */
+static int ash_writepages (struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct ash_wp_state *wp;
+	int err;
+	
+	err = ash_alloc_delayed(inode);
+	if (err)
+		return err;
+	
+	wp = kmalloc(sizeof(*wp), GFP_NOFS);
+	if (!wp)
+		return generic_writepages(mapping, wbc);
+	
+	memset(&wp->ra, 0, sizeof(wp->ra));
+	wp->run.nr = 0;
+	wp->run.rw = WRITE;
+	
+	err = write_cache_pages(mapping, wbc, ash_writepages_page, wp);
+	
+	ash_run_submit(sb, &wp->run);
+	blk_run_address_space(sb->s_bdev->bd_inode->i_mapping);
+	kfree(wp);
+	
+	return err;
+}
+
+
+
+ssize_t ash_file_aio_read (struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos)
+{
+	// O_DIRECT reads don't go through the page cache
+	if (!(iocb->ki_filp->f_flags & O_DIRECT))
+		ash_readahead(iocb->ki_filp, pos, iov_length(iov, nr_segs));
+	
+	return generic_file_aio_read(iocb, iov, nr_segs, pos);
+}
+
+
+
+int ash_file_open (struct inode *inode, struct file *filp)
+{
+	struct ash_ra_state *ra;
+	
+	ra = kzalloc(sizeof(*ra), GFP_KERNEL);
+	if (!ra)
+		return -ENOMEM;
+	
+	ra->window = ASH_RA_MIN;
+	mutex_init(&ra->lock);
+	filp->private_data = ra;
+	
+	return 0;
+}
+
+
+
+int ash_file_release (struct inode *inode, struct file *filp)
+{
+	kfree(filp->private_data);
+	filp->private_data = NULL;
+	
+	return 0;
+}
+
+
+
+/*
+ * Allocates up to max of the blocks the writes to the file reserved and links
+ * them at the end of its BAT chain, or adds them to its extents.
+ * Called with alloc_lock held.
+ * @return 0 on success
+ */
+static int ash_alloc_some (struct inode *inode, uint32_t max)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_inode_info *ei = ASH_I(inode);
+	uint32_t start, b;
+	int tail, len, err = 0;
+	
+	tail = ash_chain_tail(inode);
+	if (tail < 0)
+		return -EIO;
+	
+	while (ei->resv_blocks && max) {
+		len = ash_alloc_reserved(sb, tail ? tail + 1 : 0, min(ei->resv_blocks, max), &start);
+	
+		if (len < 0) {
+			err = len;
+			break;
+		}
+		
+		if (ei->flags & ASH_FL_EXTENTS) {
+			err = ash_ext_append(inode, ei->nr_blocks, start, len);
+	
+			if (err) {
+				ash_free_reserved(sb, start, len);
+				break;
+			}
+		} else {
+			// the run ends the chain, then the old end points to it
+			for (b = start; b < start + len - 1; b++)
+				BAT_write(sb, b, b + 1);
+			
+			if (BAT_write(sb, start + len - 1, 0) ||
+			    (tail && BAT_write(sb, tail, start))) {
+				ash_free_reserved(sb, start, len);
+				err = -EIO;
+				break;
+			}
+			
+			if (!tail)
+				ei->startblock = start;
+		}
+	
+		// the data goes in bios, not through the buffer cache
+		ash_forget_blocks(sb, start, len);
+	
+		tail = start + len - 1;
+		ei->lastblock = tail;
+		ei->nr_blocks += len;
+		ei->resv_blocks -= len;
+		inode->i_blocks += ash_iblocks(sb, len);
+		max -= len;
+	}
+	
+	// the chain changes of this allocation go to the buffer cache together
+	if (ash_bat_commit(sb) && !err)
+		err = -EIO;
+	
+	mark_inode_dirty(inode);
+	
+	return err;
+}
+
+
+
+/*
+ * Allocates the blocks the writes to the file reserved (see ash_alloc_some).
+ * Done when the file goes to the disk, so the whole reservation is known at
+ * once and ends up in as few runs as the free space allows, right after the
+ * current last block if it can. With a journal, each operation only takes
+ * as many blocks as the BAT blocks a transaction has room for can link.
+ * @return 0 on success
+ */
+int ash_alloc_delayed (struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_inode_info *ei = ASH_I(inode);
+	uint32_t max = ~0U;
+	int started, more, err;
+	
+	if (sbi->journal)
+		max = (ASH_JOURNAL_OP / 2) << (sbi->blockbits - 2);
+	
+	do {
+		started = ash_journal_start(sb);
+		mutex_lock(&ei->alloc_lock);
+	
+		err = ei->resv_blocks ? ash_alloc_some(inode, max) : 0;
+		more = ei->resv_blocks != 0;
+	
+		mutex_unlock(&ei->alloc_lock);
+		ash_journal_stop(sb, started);
+	} while (more && !err);
+	
+	return err;
+}
+
+
+
+/*
+ * Gives back to the UBB all the blocks of a file that is being deleted:
+ * its BAT chain (for a directory, that is its hashed index too) or its
+ * extents and extent tree. The UBB blocks of a big file don't fit in one
+ * journal operation, so each one frees at most as many blocks as half of
+ * ASH_JOURNAL_OP UBB blocks describe. A crash in between leaves the rest
+ * allocated, as one before the delete would.
+ */
+void ash_free_blocks (struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_inode_info *ei = ASH_I(inode);
+	uint32_t max, lblock, done;
+	int next, started;
+	
+	max = (ASH_JOURNAL_OP / 2) << (sbi->blockbits + 3);
+	next = ei->startblock;
+	
+	// a chain never has more links than the disk has blocks
+	for (lblock = done = 0; next > 0 && done < sbi->raw.maxblocks; done += max) {
+		started = ash_journal_start(sb);
+		mutex_lock(&ei->alloc_lock);
+	
+		if (ei->flags & ASH_FL_EXTENTS)
+			next = ash_ext_free(inode, &lblock, max) ? ei->startblock : 0;
+		else
+			next = ash_free_chain(sb, next, max);
+	
+		mutex_unlock(&ei->alloc_lock);
+		ash_journal_stop(sb, started);
+	}
+	
+	mutex_lock(&ei->alloc_lock);
+	
+	ei->startblock = 0;
+	ei->lastblock = 0;
+	ei->nr_blocks = 0;
+	inode->i_blocks = 0;
+	ash_bmap_forget(ei);
+	
+	mutex_unlock(&ei->alloc_lock);
+}
+
+
+
+/*
+ * Reserves the blocks the file will need to hold end bytes, past its last block.
+ * Nothing is taken from the UBB here, ash_alloc_delayed does it later.
+ * @return 0 on success, -ENOSPC if the disk doesn't have them
+ */
+static int ash_reserve_to (struct inode *inode, loff_t end)
+{
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct ash_sb_info *sbi = ASH_SB(inode->i_sb);
+	uint32_t need, have;
+	int err, tries = 0;
+	
+	need = (end + sbi->blocksize - 1) >> sbi->blockbits;
+	
+again:
+	err = 0;
+	mutex_lock(&ei->alloc_lock);
+	
+	if (ash_chain_tail(inode) < 0) {
+		mutex_unlock(&ei->alloc_lock);
+		return -EIO;
+	}
+	
+	have = ei->nr_blocks + ei->resv_blocks;
+	
+	if (need > have) {
+		err = ash_reserve_blocks(inode->i_sb, need - have);
+		if (!err)
+			ei->resv_blocks = need - ei->nr_blocks;
+	}
+	
+	mutex_unlock(&ei->alloc_lock);
+	
+	// blocks freed in the running transaction come back with its commit
+	if (err == -ENOSPC && sbi->pend_blocks && !tries++) {
+		ash_journal_commit(inode->i_sb);
+		goto again;
+	}
+	
+	return err;
+}
+
+
+
+/*
+ * Whether a write at pos leaves a hole in a sparse file: it starts at least
+ * a block past the last extent and the blocks reserved after it
+ */
+static int ash_leaves_hole (struct inode *inode, loff_t pos)
+{
+	struct ash_inode_info *ei = ASH_I(inode);
+	int hole;
+	
+	if (!ash_sparse(inode))
+		return 0;
+	
+	mutex_lock(&ei->alloc_lock);
+	hole = ash_chain_tail(inode) >= 0 &&
+			(pos >> ASH_SB(inode->i_sb)->blockbits) > ei->nr_blocks + ei->resv_blocks;
+	mutex_unlock(&ei->alloc_lock);
+	
+	return hole;
+}
+
+
+
+/*
+ * Gives the blocks of a page of a sparse file that are in a hole, up to end
+ * bytes, blocks of their own right away: delayed allocation only reserves
+ * blocks after the last extent. If the page is past those, they get theirs
+ * first, so they stay in order at the end. Called with the page locked and
+ * up to date, so what it has for those blocks is zeroes or the write's data.
+ * @return 0 on success
+ */
+static int ash_hole_alloc (struct inode *inode, struct page *page, loff_t end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_inode_info *ei = ASH_I(inode);
+	uint32_t lblock, last, stop, hole, pblock, goal, start, n;
+	int started, flush, len, done = 0, err = 0;
+	
+	if (!ash_sparse(inode) || end <= page_offset(page))
+		return 0;
+	
+	lblock = page_offset(page) >> sbi->blockbits;
+	last = (min_t(loff_t, end, page_offset(page) + PAGE_CACHE_SIZE) + sbi->blocksize - 1) >> sbi->blockbits;
+	
+	mutex_lock(&ei->alloc_lock);
+	if (ash_chain_tail(inode) < 0)
+		err = -EIO;
+	flush = ei->resv_blocks && last > ei->nr_blocks + ei->resv_blocks;
+	mutex_unlock(&ei->alloc_lock);
+	
+	if (!err && flush)
+		err = ash_alloc_delayed(inode);
+	if (err)
+		return err;
+	
+	started = ash_journal_start(sb);
+	mutex_lock(&ei->alloc_lock);
+	
+	while (lblock < last) {
+		err = ash_next_hole(inode, lblock, &hole);
+		if (err || hole >= last)
+			break;
+	
+		// the hole ends at the next extent, or where the reserved blocks start
+		stop = last;
+		if (hole < ei->nr_blocks && ei->resv_blocks)
+			stop = min(stop, ei->nr_blocks);
+	
+		for (n = 1; hole + n < stop && ash_ext_map(inode, hole + n, &pblock) == -ENOENT; n++)
+			;
+	
+		goal = (hole && ash_ext_map(inode, hole - 1, &pblock) >= 0) ? pblock + 1 : 0;
+	
+		// taken right away, but not from what writes were promised
+		len = ash_alloc_run(sb, goal, n, &start);
+	
+		if (len < 0) {
+			err = len;
+			break;
+		}
+	
+		err = ash_ext_insert(inode, hole, start, len);
+		if (err) {
+			ash_free_run(sb, start, len);
+			break;
+		}
+	
+		// the data goes in bios, not through the buffer cache
+		ash_forget_blocks(sb, start, len);
+		inode->i_blocks += ash_iblocks(sb, len);
+	
+		if (hole + len > ei->nr_blocks) {
+			ei->nr_blocks = hole + len;
+			ei->lastblock = start + len - 1;
+		}
+	
+		lblock = hole + len;
+		done = 1;
+	}
+	
+	mutex_unlock(&ei->alloc_lock);
+	ash_journal_stop(sb, started);
+	
+	if (done)
+		mark_inode_dirty(inode);
+	
+	return err;
+}
+
+
+
+/*
+ * Gives an ASH_FL_INLINE file whose data won't fit in its entry any more
+ * blocks like any other file: its data becomes a dirty page, which gets the
+ * blocks reserved for it when it is written
+ * @return 0 on success
+ */
+static int ash_inline_convert (struct inode *inode)
+{
+	struct page *page;
+	
+	page = read_mapping_page(inode->i_mapping, 0, NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	
+	// not while writepage has it
+	lock_page(page);
+	ASH_I(inode)->flags &= ~ASH_FL_INLINE;
+	if (i_size_read(inode))
+		set_page_dirty(page);
+	unlock_page(page);
+	
+	page_cache_release(page);
+	mark_inode_dirty(inode);
+	
+	return 0;
+}
+
+
+
+/*
+ * Moves the data of an ASH_FL_INLINE file out of its entry, to blocks of its
+ * own, before the entry moves. Called with i_mutex held.
+ * @return 0 on success
+ */
+int ash_inline_detach (struct inode *inode)
+{
+	int err;
+	
+	if (!(ASH_I(inode)->flags & ASH_FL_INLINE))
+		return 0;
+	
+	err = ash_reserve_to(inode, i_size_read(inode));
+	if (!err)
+		err = ash_inline_convert(inode);
+	
+	return err;
+}
+
+
+
+/*
+ * Before the last entry of an ASH_FL_INLINE file goes, reads its data into
+ * the page cache and keeps it there dirty: the entry may be reused right
+ * away, while the file can still be open
+ */
+void ash_inline_unlink (struct inode *inode)
+{
+	struct page *page;
+	
+	if (!i_size_read(inode))
+		return;
+	
+	page = read_mapping_page(inode->i_mapping, 0, NULL);
+	if (IS_ERR(page))
+		return;
+	
+	lock_page(page);
+	set_page_dirty(page);
+	unlock_page(page);
+	
+	page_cache_release(page);
+}
+
+
+
+/*
+ * Before a write at pos past the end of the file, or past the written blocks
+ * of an ASH_FL_UNWRITTEN file, what the file reads as in between becomes pages
+ * of zeroes to write: the blocks under them hold whatever was on the disk.
+ * A sparse file skips its holes and unwritten extents, they read as zeroes
+ * anyway, so a write far into the blocks fallocate gave it zeroes none. Only
+ * the page the gap starts in is read, before the file grows to pos: writepage
+ * leaves pages past the end alone.
+ * @return 0 on success
+ */
+static int ash_gap_fill (struct inode *inode, loff_t pos)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct page *page, *first = NULL;
+	loff_t from = min(i_size_read(inode), ash_valid_bytes(inode));
+	pgoff_t index, end;
+	uint32_t data, shift;
+	int err = 0;
+	
+	if (pos <= from)
+		return 0;
+	
+	index = from >> PAGE_CACHE_SHIFT;
+	end = (pos + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	
+	if (from & (PAGE_CACHE_SIZE - 1)) {
+		first = read_mapping_page(mapping, index, NULL);
+		if (IS_ERR(first))
+			return PTR_ERR(first);
+	}
+	
+	if (pos > i_size_read(inode)) {
+		i_size_write(inode, pos);
+		mark_inode_dirty(inode);
+	}
+	
+	while (index < end && !err) {
+		if (ash_sparse(inode)) {
+			shift = PAGE_CACHE_SHIFT - ASH_SB(inode->i_sb)->blockbits;
+	
+			mutex_lock(&ei->alloc_lock);
+			err = ash_next_data(inode, index << shift, &data, 0);
+			mutex_unlock(&ei->alloc_lock);
+	
+			if (err) {
+				err = err == -ENOENT ? 0 : err;
+				break;
+			}
+	
+			if ((data >> shift) > index) {
+				index = data >> shift;
+				continue;
+			}
+		}
+	
+		if (first && index == first->index) {
+			page = first;
+			lock_page(page);
+		} else {
+			page = __grab_cache_page(mapping, index);
+			if (!page) {
+				err = -ENOMEM;
+				break;
+			}
+	
+			if (!PageUptodate(page)) {
+				zero_user_segment(page, 0, PAGE_CACHE_SIZE);
+				SetPageUptodate(page);
+			}
+		}
+	
+		err = ash_hole_alloc(inode, page, pos);
+		if (!err)
+			set_page_dirty(page);
+	
+		unlock_page(page);
+		if (page != first)
+			page_cache_release(page);
+		index++;
+	}
+	
+	if (first)
+		page_cache_release(first);
+	
+	return err;
+}
+
+
+
+/*
+ * Reserves the blocks a write past the last block of the file will need
+ * (see ash_reserve_to), unless the file is inline and the write still fits
+ * in its entry, or it leaves a hole in a sparse file: then the page gets
+ * its blocks now (see ash_hole_alloc). A page the write only covers part
+ * of is read first.
+ */
+static int ash_write_begin (struct file *file, struct address_space *mapping,
+			loff_t pos, unsigned len, unsigned flags,
+			struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	struct page *page;
+	unsigned int from;
+	int err = 0;
+	
+	if (!(ASH_I(inode)->flags & ASH_FL_INLINE) || pos + len > ash_inline_room(inode)) {
+		if (!ash_leaves_hole(inode, pos))
+			err = ash_reserve_to(inode, pos + len);
+		if (!err && (ASH_I(inode)->flags & ASH_FL_INLINE))
+			err = ash_inline_convert(inode);
+	}
+	if (!err && !(ASH_I(inode)->flags & ASH_FL_INLINE))
+		err = ash_gap_fill(inode, pos);
+	if (err)
+		return err;
+	
+	page = __grab_cache_page(mapping, pos >> PAGE_CACHE_SHIFT);
+	if (!page)
+		return -ENOMEM;
+	
+	*pagep = page;
+	from = pos & (PAGE_CACHE_SIZE - 1);
+	
+	if (PageUptodate(page) || len == PAGE_CACHE_SIZE)
+		goto out_hole;
+	
+	// what the write doesn't cover comes from the disk, if the file has it
+	if (page_offset(page) >= i_size_read(inode)) {
+		zero_user_segments(page, 0, from, from + len, PAGE_CACHE_SIZE);
+		goto out_hole;
+	}
+	
+	// readpage unlocks the page when the read is done
+	err = ash_readpage(file, page);
+	if (err) {
+		page_cache_release(page);
+		return err;
+	}
+	
+	lock_page(page);
+	if (!PageUptodate(page)) {
+		unlock_page(page);
+		page_cache_release(page);
+		return -EIO;
+	}
+	
+out_hole:
+	err = ash_hole_alloc(inode, page, max_t(loff_t, pos + len, i_size_read(inode)));
+	if (err) {
+		unlock_page(page);
+		page_cache_release(page);
+	}
+	
+	return err;
+}
+
+
+
+/*
+ * get_block for direct I/O. Maps kernel block iblock of the file and as many
+ * of the following ones as sit right after it on the disk, up to the size
+ * asked for in bh_result. Past the end of the chain nothing is mapped: a
+ * read sees a hole there, a write falls back to the page cache.
+ */
+static int ash_get_block (struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_ra_state ra;
+	uint32_t lblock, pblock;
+	sector_t kB, want, got, valid;
+	
+	memset(&ra, 0, sizeof(ra));
+	
+	// unwritten blocks read as a hole, which the VM fills with zeroes
+	valid = ash_valid_bytes(inode) >> inode->i_blkbits;
+	if (!create && iblock >= valid)
+		return 0;
+	
+	lblock = iblock >> sbi->kper_bits;
+	pblock = ash_ra_map(inode, &ra, lblock);
+	if (!pblock)
+		return 0;
+	
+	kB = ((sector_t) pblock << sbi->kper_bits) + (iblock & ((1 << sbi->kper_bits) - 1));
+	want = bh_result->b_size >> inode->i_blkbits;
+	if (!create && want > valid - iblock)
+		want = valid - iblock;
+	
+	// kernel blocks left in the first Ash block, then whole Ash blocks while they follow
+	got = ((sector_t) (lblock + 1) << sbi->kper_bits) - iblock;
+	
+	while (got < want && ash_ra_map(inode, &ra, ++lblock) == ++pblock)
+		got += 1 << sbi->kper_bits;
+	
+	map_bh(bh_result, sb, kB);
+	bh_result->b_size = min(got, want) << inode->i_blkbits;
+	
+	return 0;
+}
+
+
+
+/*
+ * O_DIRECT reads and writes, straight between the user's buffers and the disk.
+ * A write gets its blocks allocated first, get_block doesn't allocate. Blocks
+ * in a slice of a kernel block share buffer heads with their neighbours, so
+ * those stay in the page cache: returning 0 makes the VM do the I/O buffered.
+ * So does an inline file, which has no blocks, a write to unwritten blocks
+ * which would leave some of them neither written nor zeroed, and a write past
+ * the end of the file, which has the gap to zero or to leave a hole. The
+ * unwritten extents of whole blocks a write covers are marked written first,
+ * get_block maps only written ones.
+ */
+static ssize_t ash_direct_IO (int rw, struct kiocb *iocb, const struct iovec *iov,
+		loff_t offset, unsigned long nr_segs)
+{
+	struct inode *inode = iocb->ki_filp->f_mapping->host;
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct ash_sb_info *sbi = ASH_SB(inode->i_sb);
+	loff_t end = offset + iov_length(iov, nr_segs);
+	ssize_t ret;
+	int err;
+	
+	if (sbi->aper_bits || (ei->flags & ASH_FL_INLINE))
+		return 0;
+	
+	if (rw == WRITE && (ei->flags & ASH_FL_UNWRITTEN) && (offset > ash_valid_bytes(inode) ||
+			(end & (sbi->blocksize - 1))))
+		return 0;
+	
+	if (rw == WRITE && offset > i_size_read(inode))
+		return 0;
+	
+	if (rw == WRITE && (ei->flags & ASH_FL_EXTENTS) && ((offset | end) & (sbi->blocksize - 1))) {
+		mutex_lock(&ei->alloc_lock);
+		err = ash_ext_unwritten(inode, offset >> sbi->blockbits,
+				(end + sbi->blocksize - 1) >> sbi->blockbits);
+		mutex_unlock(&ei->alloc_lock);
+	
+		if (err)
+			return err < 0 ? err : 0;
+	}
+	
+	if (rw == WRITE) {
+		err = ash_reserve_to(inode, end);
+		if (!err)
+			err = ash_alloc_delayed(inode);
+		if (!err && (ei->flags & ASH_FL_EXTENTS))
+			err = ash_valid_extend(inode, offset, end);
+		if (err)
+			return err;
+	}
+	
+	ret = blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev, iov, offset,
+			nr_segs, ash_get_block, NULL);
+	
+	if (rw == WRITE && ret > 0)
+		ash_valid_extend(inode, offset, offset + ret);
+	
+	return ret;
+}
+
+
+
+/*
+ * A page of a shared mapping is about to be written to: the unwritten
+ * blocks before it are zeroed (see ash_gap_fill), and it gets the blocks it
+ * has in a hole of a sparse file
+ */
+static int ash_page_mkwrite (struct vm_area_struct *vma, struct page *page)
+{
+	struct inode *inode = vma->vm_file->f_mapping->host;
+	int err;
+	
+	err = ash_gap_fill(inode, page_offset(page));
+	if (err)
+		return err;
+	
+	lock_page(page);
+	if (page->mapping == inode->i_mapping)
+		err = ash_hole_alloc(inode, page, i_size_read(inode));
+	unlock_page(page);
+	
+	return err;
+}
+
+
+
+static struct vm_operations_struct ash_file_vm_ops = {
+	.fault			= filemap_fault,
+	.page_mkwrite	= ash_page_mkwrite,
+};
+
+
+
+static int ash_file_mmap (struct file *file, struct vm_area_struct *vma)
+{
+	int err;
+	
+	err = generic_file_mmap(file, vma);
+	if (!err)
+		vma->vm_ops = &ash_file_vm_ops;
+	
+	return err;
+}
+
+
+
+/*
+ * The page is copied to and dirty. A write past the end of the file makes
+ * the inode dirty too, so write_inode puts the new size in its record.
+ */
+static int ash_write_end (struct file *file, struct address_space *mapping,
+			loff_t pos, unsigned len, unsigned copied,
+			struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+	loff_t size = i_size_read(inode);
+	int ret;
+	
+	ret = simple_write_end(file, mapping, pos, len, copied, page, fsdata);
+	
+	if (i_size_read(inode) != size)
+		mark_inode_dirty(inode);
+	
+	return ret;
+}
+
+
+
+/*
+ * Gives the file its delayed blocks, then sends the blocks it wrote
+ * since the last sync, its record among them, and waits for them. With a
+ * journal, the transaction holding the metadata among them is committed.
+ */
+int ash_sync_file (struct file *file, struct dentry *dentry, int datasync)
+{
+	struct inode *inode = dentry->d_inode;
+	int err;
+	
+	err = ash_alloc_delayed(inode);
+	if (err)
+		return err;
+	
+	err = ash_write_inode(inode, 0);
+	if (err)
+		return err;
+	
+	err = ash_wbatch_flush(inode->i_sb, &ASH_I(inode)->wb, 1);
+	if (err)
+		return err;
+	
+	return ash_journal_commit(inode->i_sb);
+}
+
+
+
+/*
+ * Where the data (origin SEEK_DATA) or the hole (SEEK_HOLE) from offset on
+ * is, for the holes of a sparse file. Blocks reserved by writes and unwritten
+ * ones count as data. Other files have just the hole at their end.
+ * Called with i_mutex held.
+ * @return the position, -ENXIO if offset is past the end or no data follows
+ */
+static loff_t ash_seek_data (struct inode *inode, loff_t offset, int origin)
+{
+	struct ash_inode_info *ei = ASH_I(inode);
+	int blockbits = ASH_SB(inode->i_sb)->blockbits;
+	loff_t size, pos;
+	uint32_t lblock;
+	int err = 0;
+	
+	size = i_size_read(inode);
+	pos = origin == SEEK_DATA ? offset : size;
+	
+	if (offset < 0 || offset >= size)
+		return -ENXIO;
+	
+	if (ei->flags & ASH_FL_EXTENTS) {
+		mutex_lock(&ei->alloc_lock);
+		if (origin == SEEK_DATA)
+			err = ash_next_data(inode, offset >> blockbits, &lblock, 1);
+		else
+			err = ash_next_hole(inode, offset >> blockbits, &lblock);
+		mutex_unlock(&ei->alloc_lock);
+	
+		pos = max(offset, (loff_t) lblock << blockbits);
+	}
+	
+	// past the end is the last hole
+	if (origin == SEEK_HOLE)
+		pos = min(pos, size);
+	
+	if (err == -ENOENT || (origin == SEEK_DATA && pos >= size))
+		err = -ENXIO;
+	
+	return err ? err : pos;
+}
+
+
+
+/*
+ * lseek, with SEEK_DATA and SEEK_HOLE (see ash_seek_data) for a VFS that
+ * passes them on. The sys_lseek of this kernel refuses origins past
+ * SEEK_END before it gets here, ASH_IOC_SEEK has them meanwhile.
+ */
+static loff_t ash_file_llseek (struct file *file, loff_t offset, int origin)
+{
+	struct inode *inode = file->f_mapping->host;
+	loff_t pos;
+	
+	if (origin != SEEK_DATA && origin != SEEK_HOLE)
+		return generic_file_llseek(file, offset, origin);
+	
+	mutex_lock(&inode->i_mutex);
+	
+	pos = ash_seek_data(inode, offset, origin);
+	
+	if (pos >= 0 && pos != file->f_pos) {
+		file->f_pos = pos;
+		file->f_version = 0;
+	}
+	
+	mutex_unlock(&inode->i_mutex);
+	
+	return pos;
+}
+
+
+
+/*
+ * ioctls of Ash files. ASH_IOC_SEEK finds data and holes like lseek with
+ * SEEK_DATA and SEEK_HOLE, without moving the file position.
+ */
+static long ash_file_ioctl (struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct ash_seek __user *useek = (struct ash_seek __user *) arg;
+	struct ash_seek seek;
+	loff_t pos;
+	
+	if (cmd != ASH_IOC_SEEK)
+		return -ENOTTY;
+	
+	if (copy_from_user(&seek, useek, sizeof(seek)))
+		return -EFAULT;
+	
+	if (seek.origin != SEEK_DATA && seek.origin != SEEK_HOLE)
+		return -EINVAL;
+	
+	mutex_lock(&inode->i_mutex);
+	pos = ash_seek_data(inode, seek.offset, seek.origin);
+	mutex_unlock(&inode->i_mutex);
+	
+	if (pos < 0)
+		return pos;
+	
+	seek.offset = pos;
+	if (copy_to_user(useek, &seek, sizeof(seek)))
+		return -EFAULT;
+	
+	return 0;
+}
+
+
+
+/*
+ * stat of a file. Its blocks are those on the disk (i_blocks, see
+ * ash_chain_tail) and those writes reserved, so a sparse file shows
+ * only what it has.
+ */
+int ash_getattr (struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat)
+{
+	struct inode *inode = dentry->d_inode;
+	struct ash_inode_info *ei = ASH_I(inode);
+	int err = 0;
+	
+	generic_fillattr(inode, stat);
+	
+	mutex_lock(&ei->alloc_lock);
+	if (ash_chain_tail(inode) < 0)
+		err = -EIO;
+	stat->blocks = inode->i_blocks + ash_iblocks(inode->i_sb, ei->resv_blocks);
+	mutex_unlock(&ei->alloc_lock);
+	
+	return err;
+}
+
+
+
+/*
+ * Fills the holes of a sparse file from logical block lblock to last with
+ * unwritten extents, in as few runs as the free space allows. The blocks
+ * writes reserved get theirs first, so the holes are only between and after
+ * the extents. Each run is an operation of its own, taking at most as many
+ * blocks as the UBB blocks a transaction has room for can hold.
+ * @return 0 on success
+ */
+static int ash_prealloc (struct inode *inode, uint32_t lblock, uint32_t last)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct ash_raw_extent e;
+	uint32_t hole, n, goal, pblock, start, max = ~0U;
+	int started, len, tries = 0, err;
+	
+	if (sbi->journal)
+		max = (ASH_JOURNAL_OP / 2) << (sbi->blockbits + 3);
+	
+	err = ash_alloc_delayed(inode);
+	
+	while (!err && lblock < last) {
+		started = ash_journal_start(sb);
+		mutex_lock(&ei->alloc_lock);
+	
+		err = ash_next_hole(inode, lblock, &hole);
+		if (!err && hole >= last)
+			lblock = last;
+	
+		// the hole ends at the next extent
+		if (!err && hole < last) {
+			n = last - hole;
+			err = ash_ext_next(inode, hole, &e);
+			if (!err)
+				n = min(n, e.lblock - hole);
+			else if (err == -ENOENT)
+				err = 0;
+		}
+	
+		if (!err && hole < last) {
+			goal = (hole && ash_ext_map(inode, hole - 1, &pblock) >= 0) ? pblock + 1 : 0;
+			len = ash_alloc_run(sb, goal, min(n, max), &start);
+	
+			err = len < 0 ? len : ash_ext_insert(inode, hole, start, len | ASH_EXT_UNWRITTEN);
+			if (err && len > 0)
+				ash_free_run(sb, start, len);
+		}
+	
+		if (!err && hole < last) {
+			// the data goes in bios, not through the buffer cache
+			ash_forget_blocks(sb, start, len);
+			inode->i_blocks += ash_iblocks(sb, len);
+	
+			if (hole + len > ei->nr_blocks) {
+				ei->nr_blocks = hole + len;
+				ei->lastblock = start + len - 1;
+			}
+	
+			lblock = hole + len;
+		}
+	
+		mutex_unlock(&ei->alloc_lock);
+		ash_journal_stop(sb, started);
+	
+		// blocks freed in the running transaction come back with its commit
+		if (err == -ENOSPC && sbi->pend_blocks && !tries++) {
+			ash_journal_commit(sb);
+			err = 0;
+		}
+	}
+	
+	return err;
+}
+
+
+
+/*
+ * Gives the file the blocks to hold the bytes up to offset + len now, and
+ * grows it to there unless FALLOC_FL_KEEP_SIZE. The new blocks aren't zeroed.
+ * A sparse file gets unwritten extents in its holes from offset on (see
+ * ash_prealloc), which read as zeroes until pages are written over them.
+ * A BAT chain only grows at its end: it gets all the blocks up to there, in
+ * as few runs as the free space allows, and the file becomes ASH_FL_UNWRITTEN,
+ * the blocks past those it had written reading as zeroes until they are
+ * written. A name too long to leave the room for their count in the entry
+ * can't have them.
+ * @return 0 on success
+ */
+long ash_fallocate (struct inode *inode, int mode, loff_t offset, loff_t len)
+{
+	struct ash_sb_info *sbi = ASH_SB(inode->i_sb);
+	struct ash_inode_info *ei = ASH_I(inode);
+	loff_t end = offset + len;
+	int err;
+	
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+	
+	// pages must hold whole blocks, see ash_valid_extend
+	if (!S_ISREG(inode->i_mode) || sbi->blocksize > PAGE_CACHE_SIZE ||
+			(!ash_sparse(inode) && ei->inline_off > ASH_VALID_OFF))
+		return -EOPNOTSUPP;
+	
+	if (end > inode->i_sb->s_maxbytes)
+		return -EFBIG;
+	
+	mutex_lock(&inode->i_mutex);
+	
+	// an inline file gets its blocks for the data it has like any other
+	err = ash_inline_detach(inode);
+	if (err)
+		goto out;
+	
+	if (ash_sparse(inode)) {
+		err = ash_prealloc(inode, offset >> sbi->blockbits, (end + sbi->blocksize - 1) >> sbi->blockbits);
+	} else {
+		mutex_lock(&ei->alloc_lock);
+		if (!(ei->flags & ASH_FL_UNWRITTEN))
+			ei->valid = (i_size_read(inode) + sbi->blocksize - 1) >> sbi->blockbits;
+		mutex_unlock(&ei->alloc_lock);
+	
+		err = ash_reserve_to(inode, end);
+		if (!err)
+			err = ash_alloc_delayed(inode);
+	
+		// what it got before an error is unwritten as well
+		mutex_lock(&ei->alloc_lock);
+		if (ei->valid < ei->nr_blocks + ei->resv_blocks)
+			ei->flags |= ASH_FL_UNWRITTEN;
+		mutex_unlock(&ei->alloc_lock);
+	}
+	
+	if (!err && !(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode))
+		i_size_write(inode, end);
+	
+	inode->i_ctime = CURRENT_TIME;
+	mark_inode_dirty(inode);
+	
+out:
+	mutex_unlock(&inode->i_mutex);
+	
+	return err;
+}
+
 
 struct address_space_operations ash_aops = {
-	.readpage		= simple_readpage,
-	.write_begin	= simple_write_begin,
-	.write_end		= simple_write_end,
+	.readpage		= ash_readpage,
+	.readpages		= ash_readpages,
+	.writepage		= ash_writepage,
+	.writepages		= ash_writepages,
+	.write_begin	= ash_write_begin,
+	.write_end		= ash_write_end,
+	.set_page_dirty	= __set_page_dirty_nobuffers,
+	.direct_IO		= ash_direct_IO,
 };
 
 
 struct file_operations ash_file_operations = {
 	.read		= do_sync_read,
-	.aio_read	= generic_file_aio_read,
+	.aio_read	= ash_file_aio_read,
 	.write		= do_sync_write,
 	.aio_write	= generic_file_aio_write,
-	.mmap		= generic_file_mmap,
-	.fsync		= simple_sync_file,
-	.llseek		= generic_file_llseek,
+	.mmap		= ash_file_mmap,
+	.fsync		= ash_sync_file,
+	.llseek		= ash_file_llseek,
+	.unlocked_ioctl	= ash_file_ioctl,
+	.open		= ash_file_open,
+	.release	= ash_file_release,
 };
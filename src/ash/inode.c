@@ -13,28 +13,32 @@
 #include <linux/sched.h>
 #include <linux/pagemap.h>
 #include <linux/backing-dev.h>
+#include <linux/slab.h>
+#include "ash.h"
 
 extern struct file_operations ash_file_operations;
+extern struct file_operations ash_dir_operations;
 extern struct address_space_operations ash_aops;
+extern struct dentry* ash_lookup (struct inode *, struct dentry *, struct nameidata *);
+extern long ash_fallocate (struct inode *, int, loff_t, loff_t);
+extern int ash_getattr (struct vfsmount *, struct dentry *, struct kstat *);
 
 struct inode_operations ash_file_inode_operations;
 struct inode_operations ash_dir_inode_operations;
 
 struct backing_dev_info ash_backing_dev_info = {
-	.ra_pages		= 0,	// no readahead
-	.capabilities	=  BDI_CAP_NO_ACCT_DIRTY | BDI_CAP_NO_WRITEBACK |
-                       BDI_CAP_MAP_DIRECT | BDI_CAP_MAP_COPY |
-                       BDI_CAP_READ_MAP | BDI_CAP_WRITE_MAP | BDI_CAP_EXEC_MAP,
+	.ra_pages		= 0,	// no VM readahead, ash_readahead follows the BAT instead
+	.capabilities	=  BDI_CAP_MAP_COPY,	// dirty pages are counted and written back
 };
 
 
-struct inode* ash_get_inode (struct super_block *sb, int mode)
+/*
+ * Gives a new inode its mode and operations
+ */
+static void ash_init_inode (struct super_block *sb, struct inode *inode, int mode)
 {
-	struct inode *inode = new_inode(sb);
+	struct ash_inode_info *ei = ASH_I(inode);
 	
-	if (!inode)
-		return NULL;
-		
 	inode->i_mode = mode;
 	inode->i_uid = current->fsuid;
 	inode->i_gid = current->fsgid;
@@ -45,23 +49,350 @@ struct inode* ash_get_inode (struct super_block *sb, int mode)
 	inode->i_atime = inode->i_mtime = inode->i_ctime = CURRENT_TIME;
 		
 	if (S_ISREG(mode)) {
+		// new files get the mapping chosen at format
+		if (ASH_SB(sb)->raw.features & ASH_FEATURE_EXTENTS)
+			ei->flags |= ASH_FL_EXTENTS;
+	
+		// and keep their data in their entry until it doesn't fit any more
+		if ((ASH_SB(sb)->raw.features & ASH_FEATURE_INLINE) && !ASH_DIRENT2(sb))
+			ei->flags |= ASH_FL_INLINE;
+	
 		inode->i_op = &ash_file_inode_operations;
 		inode->i_fop = &ash_file_operations;
 	} else if (S_ISDIR(mode)) {
 		inode->i_op = &ash_dir_inode_operations;
-		inode->i_fop = &simple_dir_operations;
+		inode->i_fop = &ash_dir_operations;
 				
 		inc_nlink(inode);	// for "." reference
 	}
+}
+
+
+
+struct inode* ash_get_inode (struct super_block *sb, int mode)
+{
+	struct inode *inode = new_inode(sb);
+	
+	if (!inode)
+		return NULL;
+	
+	ash_init_inode(sb, inode, mode);
+	
+	return inode;
+}
+
+
+
+/*
+ * Inode hash callbacks: inodes of files on the disk are hashed by fno. They run
+ * under the inode_lock; set gives a new inode its fno right away, so a lookup
+ * racing with the one filling it in finds it and waits.
+ */
+static int ash_inode_test (struct inode *inode, void *data)
+{
+	return ASH_I(inode)->fno == *(uint64_t*) data;
+}
+
+
+
+static int ash_inode_set (struct inode *inode, void *data)
+{
+	inode->i_ino = *(uint64_t*) data;
+	ASH_I(inode)->fno = *(uint64_t*) data;
+	
+	return 0;
+}
+
+
+
+/*
+ * Puts an inode made for a new file on the disk in the inode hash,
+ * so it is found by ash_iget_raw like the others
+ */
+static void ash_hash_inode (struct inode *inode)
+{
+	__insert_inode_hash(inode, (unsigned long) ASH_I(inode)->fno);
+}
+
+
+
+/*
+ * Gets the inode of a file or directory from its entry on the disk. The inode
+ * hash is searched by fno first: a file already in memory is not made again,
+ * and keeps what it has there.
+ * @return the inode, or NULL if out of memory
+ */
+struct inode* ash_iget_raw (struct super_block *sb, struct ash_raw_file *rfile)
+{
+	struct ash_inode_info *ei;
+	struct inode *inode;
+	uint64_t fno = rfile->fno;
+	
+	inode = iget5_locked(sb, (unsigned long) fno, ash_inode_test, ash_inode_set, &fno);
+	if (!inode)
+		return NULL;
+	
+	if (!(inode->i_state & I_NEW))
+		return inode;
+	
+	ash_init_inode(sb, inode, rfile->mode);
+	
+	inode->i_uid = rfile->uid;
+	inode->i_gid = rfile->gid;
+	inode->i_size = rfile->size;
+	inode->i_atime.tv_sec = rfile->atime;
+	inode->i_mtime.tv_sec = rfile->wtime;
+	inode->i_ctime.tv_sec = rfile->ctime;
+	inode->i_atime.tv_nsec = inode->i_mtime.tv_nsec = inode->i_ctime.tv_nsec = 0;
+	
+	// keep what we need from the dir entry
+	ei = ASH_I(inode);
+	ei->startblock = rfile->startblock;
+	ei->size = rfile->size;
+	ei->ashtype = rfile->ashtype;
+	ei->flags = rfile->flags;
+	
+	if (ei->flags & ASH_FL_UNWRITTEN)
+		memcpy(&ei->valid, (char*) rfile + ASH_VALID_OFF, sizeof(ei->valid));
+	
+	if (S_ISDIR(rfile->mode))
+		inode->i_fop = &ash_dir_operations;
+	
+	unlock_new_inode(inode);
 	
 	return inode;
 }
 
 
 
+/*
+ * Fills in an entry with what the inode knows about the file, all but the name.
+ * The count of written blocks of an ASH_FL_UNWRITTEN file goes at its end.
+ */
+void ash_fill_raw (struct inode *inode, struct ash_raw_file *rfile)
+{
+	struct ash_inode_info *ei = ASH_I(inode);
+	
+	rfile->mode = inode->i_mode;
+	rfile->ashtype = ei->ashtype;
+	rfile->flags = ei->flags;
+	rfile->uid = inode->i_uid;
+	rfile->gid = inode->i_gid;
+	rfile->size = S_ISDIR(inode->i_mode) ? ei->size : i_size_read(inode);
+	rfile->atime = inode->i_atime.tv_sec;
+	rfile->wtime = inode->i_mtime.tv_sec;
+	rfile->ctime = inode->i_ctime.tv_sec;
+	rfile->startblock = ei->startblock;
+	rfile->fno = ei->fno;
+	
+	if (ei->flags & ASH_FL_UNWRITTEN)
+		memcpy((char*) rfile + ASH_VALID_OFF, &ei->valid, sizeof(ei->valid));
+}
+
+
+
+/*
+ * Writes what the inode knows about the file into its record on the disk: its
+ * entry in the parent directory (the root's is at the start of the data), or
+ * with ASH_FEATURE_DIRENT2 its record in the inode table. The name is left
+ * as it is.
+ * @return 0 on success
+ */
+int ash_write_record (struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct ash_raw_file rfile;
+	struct ash_bview view;
+	int err;
+	
+	ash_fill_raw(inode, &rfile);
+	
+	if (!ei->rec_block)
+		return ASH_DIRENT2(sb) ? ash_itable_write(sb, ei->fno, &rfile, &ei->wb) : -EIO;
+	
+	if (ash_bget(sb, ei->rec_block, &view))
+		return -EIO;
+	
+	ash_bview_copy(&view, ei->rec_off, &rfile, offsetof(struct ash_raw_file, name), ASH_BVIEW_WRITE);
+	if (ei->flags & ASH_FL_UNWRITTEN)
+		ash_bview_copy(&view, ei->rec_off + ASH_VALID_OFF, &ei->valid, sizeof(ei->valid), ASH_BVIEW_WRITE);
+	ash_bdirty(&view);
+	
+	err = ash_wbatch_add(&ei->wb, &view);
+	ash_bput(&view);
+	
+	return err;
+}
+
+
+
+/*
+ * Writes the record of a dirty inode. It only goes as far as the buffer cache:
+ * the records that share a block, in a directory or the inode table, are then
+ * sent together by the next sync. wait sends the block right away, or commits
+ * the journal.
+ * @return 0 on success
+ */
+int ash_write_inode (struct inode *inode, int wait)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_inode_info *ei = ASH_I(inode);
+	int err, started;
+	
+	// nothing on the disk for it, or an unlinked file whose entry may be reused already
+	if (!ei->fno || !inode->i_nlink)
+		return 0;
+	
+	started = ash_journal_start(sb);
+	err = ash_write_record(inode);
+	ash_journal_stop(sb, started);
+	
+	if (err || !wait)
+		return err;
+	
+	err = ash_wbatch_flush(sb, &ei->wb, 1);
+	if (ash_journal_commit(sb))
+		err = -EIO;
+	
+	return err;
+}
+
+
+
+/*
+ * Gives out a file number no other file of the filesystem has: the one of a
+ * free record of the inode table if there is one, else a new one
+ */
+static uint64_t ash_new_fno (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	uint64_t fno;
+	
+	fno = ash_itable_reuse(sb);
+	if (fno)
+		return fno;
+	
+	spin_lock(&sbi->raw_lock);
+	fno = ++sbi->raw.fnogen;
+	spin_unlock(&sbi->raw_lock);
+	
+	return fno;
+}
+
+
+
+/*
+ * Puts a new file on the disk: its number, a first block if it is a directory,
+ * its record and its entry in dir. If it fails, the inode is dropped with
+ * i_nlink 0 and ash_delete_inode gives back what it got.
+ * @return 0 on success
+ */
+static int ash_new_file (struct inode *dir, struct dentry *dentry, struct inode *inode)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct ash_bview view;
+	uint32_t block;
+	int err;
+	
+	ei->fno = ash_new_fno(sb);
+	ei->ashtype = ASHTYPE_NORMAL;
+	inode->i_ino = ei->fno;
+	ash_hash_inode(inode);
+	
+	// a directory has its first block even when it is empty
+	if (S_ISDIR(inode->i_mode)) {
+		err = ash_alloc_run(sb, ASH_I(dir)->startblock, 1, &block);
+		if (err < 0)
+			return err;
+	
+		ei->startblock = block;
+		BAT_write(sb, block, 0);
+		ash_bat_commit(sb);
+	
+		if (ash_bget_new(sb, block, &view))
+			return -EIO;
+	
+		ash_bdirty(&view);
+		err = ash_wbatch_add(&ei->wb, &view);
+		ash_bput(&view);
+	
+		if (err)
+			return err;
+	}
+	
+	if (ASH_DIRENT2(sb)) {
+		err = ash_write_record(inode);
+		if (err)
+			return err;
+	}
+	
+	return ash_dir_add(dir, dentry->d_name.name, dentry->d_name.len, inode);
+}
+
+
+
+/*
+ * Frees what a file has on the disk once its last link is gone and
+ * it leaves the memory
+ */
+void ash_delete_inode (struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_inode_info *ei = ASH_I(inode);
+	struct ash_raw_file rfile;
+	int started;
+	
+	truncate_inode_pages(&inode->i_data, 0);
+	
+	// still linked, only the memory copy goes away
+	if (inode->i_nlink || !ei->fno)
+		goto out;
+	
+	ash_free_blocks(inode);
+	
+	started = ash_journal_start(sb);
+	
+	ash_bat_commit(sb);
+	
+	if (ASH_DIRENT2(sb) && !ei->rec_block) {
+		memset(&rfile, 0, sizeof(rfile));
+		ash_itable_write(sb, ei->fno, &rfile, NULL);
+	}
+	
+	ash_journal_stop(sb, started);
+	
+out:
+	clear_inode(inode);
+}
+
+
+
+/*
+ * Lets go of what the Ash information of an inode that is leaving the memory
+ * holds; it goes back to ash_inode_cachep with the inode
+ */
+void ash_clear_inode (struct inode *inode)
+{
+	struct ash_inode_info *ei = ASH_I(inode);
+	
+	// last chance for delayed blocks, unless the file is gone and never needs them
+	if (ei->resv_blocks && inode->i_nlink)
+		ash_alloc_delayed(inode);
+	if (ei->resv_blocks)
+		ash_release_blocks(inode->i_sb, ei->resv_blocks);
+	
+	ash_wbatch_release(&ei->wb);
+	ash_bmap_forget(ei);
+}
+
+
+
 int ash_mknod (struct inode *dir, struct dentry *dentry, int mode, dev_t dev)
 {
 	struct inode *inode;
+	int err, started;
 	
 	inode = ash_get_inode (dir->i_sb, mode);
 	
@@ -75,8 +406,20 @@ int ash_mknod (struct inode *dir, struct dentry *dentry, int mode, dev_t dev)
 			inode->i_mode |= S_ISGID;
 	}
 	
+	started = ash_journal_start(dir->i_sb);
+	err = ash_new_file(dir, dentry, inode);
+	
+	if (err) {
+		clear_nlink(inode);
+		iput(inode);
+	}
+	
+	ash_journal_stop(dir->i_sb, started);
+	
+	if (err)
+		return err;
+	
 	d_instantiate (dentry, inode);
-	dget (dentry);
 	
 	dir->i_mtime = dir->i_ctime = CURRENT_TIME;
 		
@@ -100,18 +443,144 @@ int ash_create (struct inode *dir, struct dentry *dentry, int mode, struct namei
 }
 
 
+/*
+ * Deletes the entry of a file from its directory on the disk. The file's
+ * blocks go when its inode does, see ash_delete_inode.
+ */
+int ash_unlink (struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = dentry->d_inode;
+	int err, started;
+	
+	// the data of an inline file is in the entry that goes
+	if (inode->i_nlink == 1 && (ASH_I(inode)->flags & ASH_FL_INLINE))
+		ash_inline_unlink(inode);
+	
+	started = ash_journal_start(dir->i_sb);
+	err = ash_dir_remove(dir, dentry->d_name.name, dentry->d_name.len);
+	ash_journal_stop(dir->i_sb, started);
+	if (err)
+		return err;
+	
+	inode->i_ctime = dir->i_ctime = dir->i_mtime = CURRENT_TIME;
+	drop_nlink(inode);
+	
+	return 0;
+}
+
+
+
+int ash_rmdir (struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = dentry->d_inode;
+	int err;
+	
+	err = ash_dir_empty(inode);
+	if (err <= 0)
+		return err ? err : -ENOTEMPTY;
+	
+	err = ash_unlink(dir, dentry);
+	if (err)
+		return err;
+	
+	drop_nlink(inode);	// for "."
+	drop_nlink(dir);	// for its ".."
+	
+	return 0;
+}
+
+
+
+/*
+ * Moves the entry of a file to a new name, in the same directory or in
+ * another one, in place of the file that had the name if there is one.
+ * Everything is done in one journal operation, the new entry before the old
+ * one goes. With ash_raw_file entries the record moves with the entry.
+ */
+int ash_rename (struct inode *old_dir, struct dentry *old_dentry,
+		struct inode *new_dir, struct dentry *new_dentry)
+{
+	struct super_block *sb = old_dir->i_sb;
+	struct inode *inode = old_dentry->d_inode;
+	struct inode *target = new_dentry->d_inode;
+	struct qstr *old_name = &old_dentry->d_name;
+	struct qstr *new_name = &new_dentry->d_name;
+	int err, started;
+	
+	// see ash_dir_add
+	if (!ASH_DIRENT2(sb) && (ASH_I(inode)->flags & ASH_FL_UNWRITTEN) && new_name->len > ASH_VALID_NAME_MAX)
+		return -ENAMETOOLONG;
+	
+	if (target && S_ISDIR(target->i_mode)) {
+		err = ash_dir_empty(target);
+		if (err <= 0)
+			return err ? err : -ENOTEMPTY;
+	}
+	
+	// the data of an inline file is in the entry that moves
+	if (ASH_I(inode)->flags & ASH_FL_INLINE) {
+		mutex_lock(&inode->i_mutex);
+		err = ash_inline_detach(inode);
+		mutex_unlock(&inode->i_mutex);
+	
+		if (err)
+			return err;
+	}
+	
+	// and the one of the file replaced in the entry that goes
+	if (target && target->i_nlink == 1 && (ASH_I(target)->flags & ASH_FL_INLINE))
+		ash_inline_unlink(target);
+	
+	started = ash_journal_start(sb);
+	
+	err = target ? ash_dir_remove(new_dir, new_name->name, new_name->len) : 0;
+	if (!err) {
+		err = ash_dir_add(new_dir, new_name->name, new_name->len, inode);
+	
+		// the file replaced keeps its name then
+		if (err && target)
+			ash_dir_add(new_dir, new_name->name, new_name->len, target);
+	}
+	if (!err)
+		err = ash_dir_remove(old_dir, old_name->name, old_name->len);
+	
+	ash_journal_stop(sb, started);
+	
+	if (err)
+		return err;
+	
+	if (target) {
+		target->i_ctime = CURRENT_TIME;
+		drop_nlink(target);
+	
+		if (S_ISDIR(target->i_mode)) {
+			drop_nlink(target);	// for "."
+			drop_nlink(old_dir);	// the ".." of the one moved replaces its ".."
+		}
+	} else if (S_ISDIR(inode->i_mode)) {
+		drop_nlink(old_dir);
+		inc_nlink(new_dir);
+	}
+	
+	old_dir->i_ctime = old_dir->i_mtime = CURRENT_TIME;
+	new_dir->i_ctime = new_dir->i_mtime = inode->i_ctime = CURRENT_TIME;
+	
+	return 0;
+}
+
+
 struct inode_operations ash_dir_inode_operations = {
 	.create		= ash_create,
-	.lookup		= simple_lookup,
-	.link		= simple_link,
-	.unlink		= simple_unlink,
+	.lookup		= ash_lookup,
+	.unlink		= ash_unlink,
 	.mkdir 		= ash_mkdir,
-	.rmdir		= simple_rmdir,
-	.rename		= simple_rename,
+	.rmdir		= ash_rmdir,
+	.rename		= ash_rename,
 };
 
 
 struct inode_operations ash_file_inode_operations = {
-	.getattr	= simple_getattr,
+	.getattr	= ash_getattr,
+	.fallocate	= ash_fallocate,
 };
 
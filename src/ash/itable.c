@@ -0,0 +1,337 @@
+/*
+ * Ash File System
+ *
+ * Inode table, on a filesystem formatted with ASH_FEATURE_DIRENT2. Directories
+ * then only hold names (ash_raw_dirent); what else an ash_raw_file has is the
+ * file's 64 byte record (ash_raw_inode) here, record n for the file with fno n.
+ * The table is a BAT chain starting at the superblock's itable block, and is
+ * read through an inode of its own, so ash_bmap and its skip index find a
+ * record's block without walking the chain.
+ *
+ * The records of deleted files are given to new files before the table grows:
+ * those freed while mounted are kept on a stack, the ones there were at mount
+ * are looked for a block at a time when the stack is empty.
+ *
+ * For licensing information, see the file 'LICENSE'
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include "ash.h"
+
+
+extern struct inode* ash_get_inode (struct super_block *, int);
+
+// free file numbers the stack holds, it takes a page
+#define ASH_FNO_FREE	(PAGE_SIZE / sizeof(uint64_t))
+
+
+/*
+ * Makes the inode the table is read through
+ * @return 0 on success
+ */
+int ash_itable_init (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct inode *inode;
+	
+	if (!ASH_DIRENT2(sb))
+		return 0;
+	
+	if (sbi->raw.itable < sbi->raw.datastart || sbi->raw.itable >= sbi->raw.maxblocks) {
+		printk(KERN_ERR "bad inode table block %u\n", sbi->raw.itable);
+		return -EINVAL;
+	}
+	
+	inode = ash_get_inode(sb, S_IFREG);
+	if (!inode)
+		return -ENOMEM;
+	
+	// the table is always a BAT chain, whatever regular files use
+	ASH_I(inode)->flags = 0;
+	ASH_I(inode)->startblock = sbi->raw.itable;
+	
+	sbi->itable = inode;
+	
+	// without the stack, new files only get new records
+	mutex_init(&sbi->fno_lock);
+	sbi->fno_free = kmalloc(ASH_FNO_FREE * sizeof(uint64_t), GFP_KERNEL);
+	sbi->fno_nfree = 0;
+	
+	// fno 1 is the root, its record is not in the table
+	sbi->fno_scan = 2;
+	sbi->fno_scan_end = sbi->raw.fnogen;
+	
+	return 0;
+}
+
+
+
+/*
+ * Drops the inode of the table at umount
+ */
+void ash_itable_free (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	
+	if (!sbi->itable)
+		return;
+	
+	iput(sbi->itable);
+	sbi->itable = NULL;
+	
+	kfree(sbi->fno_free);
+	sbi->fno_free = NULL;
+}
+
+
+
+/*
+ * Reads the record of file fno from the inode table and fills in rfile with it.
+ * The name is not in the record, rfile->name is left as it is.
+ * @return 0 on success, -EIO if there is no such record
+ */
+int ash_itable_read (struct super_block *sb, uint64_t fno, struct ash_raw_file *rfile)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_raw_inode ri;
+	struct ash_bview view;
+	uint64_t pos;
+	uint32_t block;
+	
+	pos = fno * sizeof(ri);
+	
+	if (!sbi->itable || ash_bmap(sbi->itable, pos >> sbi->blockbits, &block))
+		return -EIO;
+	
+	if (ash_bget(sb, block, &view))
+		return -EIO;
+	
+	// records never cross a block, but may cross a buffer_head
+	ash_bview_copy(&view, pos & (sbi->blocksize - 1), &ri, sizeof(ri), ASH_BVIEW_READ);
+	ash_bput(&view);
+	
+	if (ri.fno != fno) {
+		printk(KERN_ERR "inode table record %llu is not in use\n", (unsigned long long) fno);
+		return -EIO;
+	}
+	
+	rfile->mode = ri.mode;
+	rfile->ashtype = ri.ashtype;
+	rfile->flags = ri.flags;
+	rfile->uid = ri.uid;
+	rfile->gid = ri.gid;
+	rfile->size = ri.size;
+	rfile->atime = ri.atime;
+	rfile->wtime = ri.wtime;
+	rfile->ctime = ri.ctime;
+	rfile->startblock = ri.startblock;
+	rfile->fno = ri.fno;
+	
+	// where an ash_raw_file has it (ash_dir_entry puts a name before it)
+	memcpy((char*) rfile + ASH_VALID_OFF, &ri.valid, sizeof(ri.valid));
+	
+	return 0;
+}
+
+
+
+/*
+ * Finds the block of the table holding its logical block lblock. A table too
+ * short for it gets zeroed blocks (free records) at the end of its chain.
+ * @return 0 on success
+ */
+static int ash_itable_block (struct super_block *sb, uint32_t lblock, uint32_t *block)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_inode_info *ei = ASH_I(sbi->itable);
+	struct ash_bview view;
+	uint32_t start;
+	int next, len, err;
+	
+	err = ash_bmap(sbi->itable, lblock, block);
+	if (err != -ENOENT)
+		return err;
+	
+	mutex_lock(&ei->alloc_lock);
+	
+	// the end of the chain is only looked for once
+	if (!ei->lastblock) {
+		ei->lastblock = ei->startblock;
+		ei->nr_blocks = 1;
+	
+		while ((next = BAT_read(sb, ei->lastblock)) > 0 && ei->nr_blocks < sbi->raw.maxblocks) {
+			ei->lastblock = next;
+			ei->nr_blocks++;
+		}
+	
+		if (next < 0)
+			ei->lastblock = 0;
+	}
+	
+	err = ei->lastblock ? 0 : -EIO;
+	
+	while (!err && ei->nr_blocks <= lblock) {
+		len = ash_alloc_run(sb, ei->lastblock + 1, 1, &start);
+	
+		if (len < 0) {
+			err = len;
+			break;
+		}
+	
+		if (ash_bget_new(sb, start, &view)) {
+			ash_free_run(sb, start, 1);
+			err = -EIO;
+			break;
+		}
+	
+		ash_bdirty(&view);
+		ash_bput(&view);
+	
+		BAT_write(sb, start, 0);
+		BAT_write(sb, ei->lastblock, start);
+		ei->lastblock = start;
+		ei->nr_blocks++;
+	}
+	
+	ash_bat_commit(sb);
+	mutex_unlock(&ei->alloc_lock);
+	
+	if (err)
+		return err;
+	
+	return ash_bmap(sbi->itable, lblock, block);
+}
+
+
+
+/*
+ * Writes the record of a file in the inode table, from rfile (all but the
+ * name), growing the table if the record is past its end. rfile->fno 0
+ * frees the record at fno. The block is left dirty in the buffer cache,
+ * and added to wb if the caller is going to send it.
+ * @return 0 on success
+ */
+int ash_itable_write (struct super_block *sb, uint64_t fno, struct ash_raw_file *rfile,
+		struct ash_wbatch *wb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_raw_inode ri;
+	struct ash_bview view;
+	uint64_t pos;
+	uint32_t block;
+	int err = 0;
+	
+	if (!sbi->itable)
+		return -EIO;
+	
+	memset(&ri, 0, sizeof(ri));
+	ri.mode = rfile->mode;
+	ri.ashtype = rfile->ashtype;
+	ri.flags = rfile->flags;
+	ri.uid = rfile->uid;
+	ri.gid = rfile->gid;
+	ri.size = rfile->size;
+	ri.atime = rfile->atime;
+	ri.wtime = rfile->wtime;
+	ri.ctime = rfile->ctime;
+	ri.startblock = rfile->startblock;
+	ri.fno = rfile->fno;
+	
+	if (rfile->flags & ASH_FL_UNWRITTEN)
+		memcpy(&ri.valid, (char*) rfile + ASH_VALID_OFF, sizeof(ri.valid));
+	
+	pos = fno * sizeof(ri);
+	
+	err = ash_itable_block(sb, pos >> sbi->blockbits, &block);
+	if (err)
+		return err;
+	
+	if (ash_bget(sb, block, &view))
+		return -EIO;
+	
+	ash_bview_copy(&view, pos & (sbi->blocksize - 1), &ri, sizeof(ri), ASH_BVIEW_WRITE);
+	ash_bdirty(&view);
+	
+	if (wb)
+		err = ash_wbatch_add(wb, &view);
+	ash_bput(&view);
+	
+	// a freed record is for the next new file, unless the scan will find it
+	if (!rfile->fno && sbi->fno_free) {
+		mutex_lock(&sbi->fno_lock);
+		if ((fno < sbi->fno_scan || fno > sbi->fno_scan_end) && sbi->fno_nfree < ASH_FNO_FREE)
+			sbi->fno_free[sbi->fno_nfree++] = fno;
+		mutex_unlock(&sbi->fno_lock);
+	}
+	
+	return err;
+}
+
+
+
+/*
+ * Looks for free records among those there were at mount, from fno_scan on,
+ * a block of the table at a time until it finds some.
+ * Called with fno_lock held.
+ */
+static void ash_itable_scan (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_raw_inode ri;
+	struct ash_bview view;
+	uint64_t pos, end;
+	uint32_t block;
+	
+	while (!sbi->fno_nfree && sbi->fno_scan <= sbi->fno_scan_end) {
+		pos = sbi->fno_scan * sizeof(ri);
+	
+		// not worth failing a new file for, the table grows instead
+		if (ash_bmap(sbi->itable, pos >> sbi->blockbits, &block) || ash_bget(sb, block, &view)) {
+			sbi->fno_scan = sbi->fno_scan_end + 1;
+			break;
+		}
+	
+		// the records of this block
+		end = (pos | (sbi->blocksize - 1)) / sizeof(ri) + 1;
+		end = min(end, sbi->fno_scan_end + 1);
+	
+		for (; sbi->fno_scan < end; sbi->fno_scan++) {
+			pos = sbi->fno_scan * sizeof(ri);
+			ash_bview_copy(&view, pos & (sbi->blocksize - 1), &ri, sizeof(ri), ASH_BVIEW_READ);
+	
+			if (ri.fno != sbi->fno_scan && sbi->fno_nfree < ASH_FNO_FREE)
+				sbi->fno_free[sbi->fno_nfree++] = sbi->fno_scan;
+		}
+	
+		ash_bput(&view);
+	}
+}
+
+
+
+/*
+ * Takes a free record of the table for a new file. Nobody else gets it
+ * until ash_itable_write frees it again.
+ * @return the file number of the record, or 0 if there is no free one
+ */
+uint64_t ash_itable_reuse (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	uint64_t fno = 0;
+	
+	if (!sbi->itable || !sbi->fno_free)
+		return 0;
+	
+	mutex_lock(&sbi->fno_lock);
+	
+	ash_itable_scan(sb);
+	if (sbi->fno_nfree)
+		fno = sbi->fno_free[--sbi->fno_nfree];
+	
+	mutex_unlock(&sbi->fno_lock);
+	
+	return fno;
+}
@@ -0,0 +1,705 @@
+/*
+ * Ash File System
+ *
+ * Metadata journal, on a filesystem formatted with ASH_FEATURE_JOURNAL. The
+ * journal is a region ashformat leaves after the BAT, holding one transaction
+ * at a time: a head block (ash_raw_jhead) saying where each block of the
+ * transaction goes, and the new contents of these blocks right after it.
+ *
+ * Metadata is still changed in place in the buffer cache, but ash_bdirty does
+ * not mark it dirty: the block is pinned in the running transaction instead,
+ * so none of it reaches its place on the disk before the whole transaction is
+ * in the journal. Operations run between ash_journal_start and ash_journal_stop,
+ * and a commit waits for the running ones, so a transaction never holds half
+ * of an operation. Commits are batched: they happen at sync and fsync, when
+ * the superblock is written back (write_super), or when a transaction is
+ * close to full.
+ *
+ * An operation only starts if the transaction has room for it and for what
+ * the commit adds: the changed UBB blocks, the BAT blocks of the logged
+ * entries and the superblock. Work that changes more blocks than that (the
+ * delayed allocation of a big write, building the hashed index of a
+ * directory, compacting one) is done in several operations, each of them
+ * leaving the filesystem consistent. A transaction that still grows past
+ * what the journal holds can't be committed whole; see ash_journal_write.
+ *
+ * A commit writes the contents of the blocks, then the head, each followed by a
+ * cache flush, then the blocks to their places and clears the head. A mount
+ * only has the journal to look at: a head with a good checksum is replayed,
+ * anything else was either never committed or is already in place.
+ *
+ * For licensing information, see the file 'LICENSE'
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
+#include <linux/crc32.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/backing-dev.h>
+#include "ash.h"
+
+
+/*
+ * The running transaction of a mounted filesystem
+ *
+ */
+struct ash_journal {
+	struct rw_semaphore	sem;		// held for reading by operations, for writing by a commit
+	spinlock_t		lock;		// for the fields below
+	uint32_t		start;		// block of the head
+	uint32_t		cap;		// blocks a transaction can hold
+	uint32_t		nr;		// blocks in the running transaction
+	uint32_t		size;		// views has room for, cap unless it grew past it
+	struct ash_bview	*views;		// these blocks, pinned; nr 0 for a forgotten one
+	uint32_t		*hash;		// block number -> index in views + 1, 0 for an empty slot
+	int			hbits;
+	uint32_t		seq;		// number of the running transaction
+	struct ash_raw_jhead	*head;		// a block, the head of the transaction being written
+	char			*buf;		// a block, for copying through
+	struct ash_wbatch	wb;
+};
+
+
+
+/*
+ * Where block is in the hash of the transaction, or the empty slot it would go to
+ */
+static uint32_t* ash_journal_slot (struct ash_journal *j, uint32_t block)
+{
+	uint32_t h = hash_long(block, j->hbits);
+	uint32_t mask = (1 << j->hbits) - 1;
+	
+	while (j->hash[h] && j->views[j->hash[h] - 1].block != block)
+		h = (h + 1) & mask;
+	
+	return &j->hash[h];
+}
+
+
+
+/*
+ * Sends what is in the write batch of the journal and waits for it to be on
+ * the disk itself, not in the cache of the drive
+ * @return 0 on success
+ */
+static int ash_journal_send (struct super_block *sb, struct ash_journal *j)
+{
+	int err;
+	
+	err = ash_wbatch_flush(sb, &j->wb, 1);
+	blkdev_issue_flush(sb->s_bdev, NULL);
+	
+	return err;
+}
+
+
+
+/*
+ * Dirties a view and adds it to the write batch of the journal
+ * @return 0 on success
+ */
+static int ash_journal_queue (struct ash_journal *j, struct ash_bview *view)
+{
+	int i;
+	
+	for (i = 0; i < view->nr; i++)
+		mark_buffer_dirty(view->bh[i]);
+	
+	return ash_wbatch_add(&j->wb, view);
+}
+
+
+
+/*
+ * Writes a block of the journal from buf
+ * @return 0 on success
+ */
+static int ash_journal_put (struct super_block *sb, struct ash_journal *j, uint32_t block, void *buf)
+{
+	struct ash_bview view;
+	int err;
+	
+	if (ash_bget_new(sb, block, &view))
+		return -EIO;
+	
+	ash_bview_copy(&view, 0, buf, ASH_SB(sb)->blocksize, ASH_BVIEW_WRITE);
+	err = ash_journal_queue(j, &view);
+	ash_bput(&view);
+	
+	return err;
+}
+
+
+
+/*
+ * Writes the blocks of the running transaction from *from on to the journal,
+ * as many as it holds, then to their places, and moves *from past them.
+ * Called with the semaphore held for writing, nothing changes meanwhile.
+ * If the journal can't be written, the blocks still go to their places, as
+ * they would without a journal.
+ * @return 0 on success
+ */
+static int ash_journal_write_part (struct super_block *sb, struct ash_journal *j, uint32_t *from)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_bview *view;
+	uint32_t i, n = 0, crc = ~0;
+	int err = 0;
+	
+	// the new contents, one after the other after the head
+	for (i = *from; i < j->nr && n < j->cap && !err; i++) {
+		view = &j->views[i];
+		if (!view->nr)
+			continue;
+	
+		ash_bview_copy(view, 0, j->buf, sbi->blocksize, ASH_BVIEW_READ);
+		crc = crc32_le(crc, j->buf, sbi->blocksize);
+		j->head->blocks[n++] = view->block;
+	
+		err = ash_journal_put(sb, j, j->start + n, j->buf);
+	}
+	
+	if (!n) {
+		*from = i;
+		return 0;
+	}
+	
+	if (!err)
+		err = ash_journal_send(sb, j);
+	
+	// once the head is on the disk, the transaction is committed
+	if (!err) {
+		j->head->magic = ASH_JMAGIC;
+		j->head->seq = j->seq;
+		j->head->nr = n;
+		j->head->csum = crc;
+	
+		err = ash_journal_put(sb, j, j->start, j->head);
+		if (!err)
+			err = ash_journal_send(sb, j);
+	}
+	
+	if (err)
+		printk(KERN_ERR "ash: cannot write transaction %u to the journal\n", j->seq);
+	
+	// the blocks go to their places
+	for (; *from < i; (*from)++)
+		if (j->views[*from].nr && ash_journal_queue(j, &j->views[*from]))
+			err = -EIO;
+	
+	if (ash_journal_send(sb, j))
+		err = -EIO;
+	
+	// and the transaction doesn't have to be replayed any more; the rest of
+	// the head stays, the next mount goes on from its seq
+	if (!err) {
+		j->head->magic = 0;
+		err = ash_journal_put(sb, j, j->start, j->head);
+		if (!err)
+			err = ash_journal_send(sb, j);
+	}
+	
+	j->seq++;
+	
+	return err;
+}
+
+
+
+/*
+ * Writes the running transaction to the journal, then its blocks to their
+ * places. A transaction the journal can't hold means an operation changed
+ * more than ASH_JOURNAL_OP blocks: a crash could leave half of it on the
+ * disk. Its blocks still go out, in as many transactions as it takes, but
+ * the filesystem goes read-only.
+ * Called with the semaphore held for writing.
+ * @return 0 on success
+ */
+static int ash_journal_write (struct super_block *sb, struct ash_journal *j)
+{
+	uint32_t i = 0, parts = 0;
+	int err = 0;
+	
+	while (i < j->nr) {
+		if (ash_journal_write_part(sb, j, &i))
+			err = -EIO;
+		parts++;
+	}
+	
+	if (parts > 1) {
+		printk(KERN_CRIT "ash: %u blocks did not fit in one transaction of %s, remounting read-only\n",
+			j->nr, sb->s_id);
+		sb->s_flags |= MS_RDONLY;
+		err = -EIO;
+	}
+	
+	return err;
+}
+
+
+
+/*
+ * Blocks the commit adds to the running transaction: the UBB blocks and the
+ * BAT blocks changed since the last one, and the superblock
+ */
+static uint32_t ash_journal_extra (struct super_block *sb)
+{
+	return ash_ubb_dirty_blocks(sb) + ash_bat_log_blocks(sb) + 1;
+}
+
+
+
+/*
+ * Gives the running transaction room for twice as many blocks, when an
+ * operation went past what the journal holds. Called without j->lock.
+ * @return 0 on success, -ENOMEM
+ */
+static int ash_journal_grow (struct ash_journal *j)
+{
+	struct ash_bview *views, *old_views;
+	uint32_t *hash, *old_hash, size, i;
+	int hbits;
+	
+	spin_lock(&j->lock);
+	size = j->size << 1;
+	spin_unlock(&j->lock);
+	
+	hbits = ilog2(size) + 2;
+	views = vmalloc(size * sizeof(*views));
+	hash = vmalloc(sizeof(*hash) << hbits);
+	
+	if (!views || !hash) {
+		vfree(views);
+		vfree(hash);
+		return -ENOMEM;
+	}
+	
+	memset(hash, 0, sizeof(*hash) << hbits);
+	
+	spin_lock(&j->lock);
+	
+	// somebody else grew it meanwhile
+	if (j->size >= size) {
+		spin_unlock(&j->lock);
+		vfree(views);
+		vfree(hash);
+		return 0;
+	}
+	
+	memcpy(views, j->views, j->nr * sizeof(*views));
+	old_views = j->views;
+	old_hash = j->hash;
+	
+	j->views = views;
+	j->hash = hash;
+	j->hbits = hbits;
+	j->size = size;
+	
+	for (i = 0; i < j->nr; i++)
+		*ash_journal_slot(j, j->views[i].block) = i + 1;
+	
+	spin_unlock(&j->lock);
+	
+	vfree(old_views);
+	vfree(old_hash);
+	
+	return 0;
+}
+
+
+
+/*
+ * Commits the running transaction: it goes to the journal with the UBB, the
+ * BAT changes and the superblock as they are now (see ash_sync_super).
+ * Does nothing inside an operation, which would wait for itself.
+ * @return 0 on success
+ */
+int ash_journal_commit (struct super_block *sb)
+{
+	struct ash_journal *j = ASH_SB(sb)->journal;
+	uint32_t i;
+	int err;
+	
+	if (!j || current->journal_info)
+		return 0;
+	
+	down_write(&j->sem);
+	
+	err = ash_sync_super(sb);
+	if (ash_journal_write(sb, j))
+		err = -EIO;
+	
+	// what the transaction freed can be used again
+	ash_ubb_committed(sb);
+	
+	spin_lock(&j->lock);
+	
+	for (i = 0; i < j->nr; i++)
+		ash_bput(&j->views[i]);
+	
+	memset(j->hash, 0, sizeof(*j->hash) << j->hbits);
+	j->nr = 0;
+	sb->s_dirt = 0;
+	
+	spin_unlock(&j->lock);
+	
+	up_write(&j->sem);
+	
+	return err;
+}
+
+
+
+/*
+ * Takes a changed block into the running transaction, instead of marking it
+ * dirty. The transaction is committed soon after its first block (write_super).
+ * Past what the journal holds, the transaction grows in memory so nothing is
+ * lost (see ash_journal_write); this waits for the memory if it has to.
+ */
+void ash_journal_dirty (struct ash_bview *view)
+{
+	struct ash_journal *j = ASH_SB(view->sb)->journal;
+	struct ash_bview *jview;
+	uint32_t *slot;
+	int i;
+	
+	spin_lock(&j->lock);
+	
+again:
+	slot = ash_journal_slot(j, view->block);
+	
+	if (*slot) {
+		jview = &j->views[*slot - 1];
+	
+		// already in
+		if (jview->nr) {
+			spin_unlock(&j->lock);
+			return;
+		}
+	} else {
+		if (j->nr == j->size) {
+			spin_unlock(&j->lock);
+	
+			while (ash_journal_grow(j))
+				congestion_wait(WRITE, HZ / 50);
+	
+			spin_lock(&j->lock);
+			goto again;
+		}
+	
+		jview = &j->views[j->nr++];
+		*slot = j->nr;
+	
+		if (j->nr == 1)
+			view->sb->s_dirt = 1;
+	}
+	
+	*jview = *view;
+	for (i = 0; i < jview->nr; i++)
+		get_bh(jview->bh[i]);
+	
+	spin_unlock(&j->lock);
+}
+
+
+
+/*
+ * Drops blocks [start, start + len) from the running transaction: they hold
+ * file data now, which their old contents must not be written over
+ */
+void ash_journal_forget (struct super_block *sb, uint32_t start, uint32_t len)
+{
+	struct ash_journal *j = ASH_SB(sb)->journal;
+	struct ash_bview *view;
+	uint32_t i;
+	
+	if (!j)
+		return;
+	
+	spin_lock(&j->lock);
+	
+	for (i = 0; i < j->nr; i++) {
+		view = &j->views[i];
+		if (view->nr && view->block >= start && view->block - start < len)
+			ash_bput(view);
+	}
+	
+	spin_unlock(&j->lock);
+}
+
+
+
+/*
+ * Starts an operation that changes metadata: a commit waits until it is done.
+ * The transaction is committed first if it may not have room for it.
+ * Operations inside an operation are part of it.
+ * @return what ash_journal_stop needs
+ */
+int ash_journal_start (struct super_block *sb)
+{
+	struct ash_journal *j = ASH_SB(sb)->journal;
+	uint32_t extra;
+	int full;
+	
+	if (!j || current->journal_info)
+		return 0;
+	
+	extra = ash_journal_extra(sb);
+	
+	spin_lock(&j->lock);
+	full = j->nr + extra + ASH_JOURNAL_OP > j->cap;
+	spin_unlock(&j->lock);
+	
+	if (full)
+		ash_journal_commit(sb);
+	
+	down_read(&j->sem);
+	current->journal_info = j;
+	
+	return 1;
+}
+
+
+
+void ash_journal_stop (struct super_block *sb, int started)
+{
+	if (!started)
+		return;
+	
+	current->journal_info = NULL;
+	up_read(&ASH_SB(sb)->journal->sem);
+}
+
+
+
+/*
+ * Tells if the caller is inside an operation. Work split in operations of
+ * its own can't be done there: they would all be part of that one.
+ */
+int ash_journal_inside (void)
+{
+	return current->journal_info != NULL;
+}
+
+
+
+/*
+ * Puts the blocks of a committed transaction the journal still holds in their
+ * places, in case the crash came before they all were
+ * @return 0 on success
+ */
+static int ash_journal_replay (struct super_block *sb, uint32_t *seq)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_raw_jhead *head;
+	struct ash_bview view;
+	struct ash_wbatch wb;
+	uint32_t i, crc = ~0, start = sbi->raw.journal;
+	char *buf;
+	int err = -ENOMEM;
+	
+	head = kmalloc(sbi->blocksize, GFP_KERNEL);
+	buf = kmalloc(sbi->blocksize, GFP_KERNEL);
+	if (!head || !buf)
+		goto out;
+	
+	err = -EIO;
+	if (ash_bget(sb, start, &view))
+		goto out;
+	
+	ash_bview_copy(&view, 0, head, sbi->blocksize, ASH_BVIEW_READ);
+	ash_bput(&view);
+	
+	*seq = head->seq + 1;
+	err = 0;
+	
+	if (head->magic != ASH_JMAGIC)
+		goto out;
+	
+	// not a head this code wrote
+	if (head->nr > min_t(uint32_t, sbi->raw.journalblocks - 1, (sbi->blocksize - sizeof(*head)) / 4)) {
+		printk(KERN_WARNING "ash: bad journal head, not replayed\n");
+		goto out;
+	}
+	
+	for (i = 0; i < head->nr; i++) {
+		if (ash_bget(sb, start + 1 + i, &view)) {
+			err = -EIO;
+			goto out;
+		}
+		ash_bview_copy(&view, 0, buf, sbi->blocksize, ASH_BVIEW_READ);
+		ash_bput(&view);
+	
+		crc = crc32_le(crc, buf, sbi->blocksize);
+	}
+	
+	if (crc != head->csum) {
+		printk(KERN_WARNING "ash: transaction %u in the journal is incomplete, not replayed\n", head->seq);
+		goto out;
+	}
+	
+	if (bdev_read_only(sb->s_bdev)) {
+		printk(KERN_ERR "ash: the journal needs to be replayed, the device is read-only\n");
+		err = -EROFS;
+		goto out;
+	}
+	
+	ash_wbatch_init(&wb);
+	
+	for (i = 0; i < head->nr && !err; i++) {
+		if (head->blocks[i] >= sbi->raw.maxblocks) {
+			err = -EIO;
+			break;
+		}
+	
+		if (ash_bget(sb, start + 1 + i, &view)) {
+			err = -EIO;
+			break;
+		}
+		ash_bview_copy(&view, 0, buf, sbi->blocksize, ASH_BVIEW_READ);
+		ash_bput(&view);
+	
+		if (ash_bget_new(sb, head->blocks[i], &view)) {
+			err = -EIO;
+			break;
+		}
+		ash_bview_copy(&view, 0, buf, sbi->blocksize, ASH_BVIEW_WRITE);
+		ash_bdirty(&view);
+		err = ash_wbatch_add(&wb, &view);
+		ash_bput(&view);
+	}
+	
+	if (ash_wbatch_flush(sb, &wb, 1))
+		err = -EIO;
+	blkdev_issue_flush(sb->s_bdev, NULL);
+	
+	// replayed, the head can go
+	if (!err) {
+		head->magic = 0;
+	
+		if (ash_bget_new(sb, start, &view)) {
+			err = -EIO;
+		} else {
+			ash_bview_copy(&view, 0, head, sbi->blocksize, ASH_BVIEW_WRITE);
+			ash_bdirty(&view);
+			err = ash_wbatch_add(&wb, &view);
+			ash_bput(&view);
+		}
+	
+		if (ash_wbatch_flush(sb, &wb, 1))
+			err = -EIO;
+		blkdev_issue_flush(sb->s_bdev, NULL);
+	}
+	
+	ash_wbatch_release(&wb);
+	
+	if (err)
+		printk(KERN_ERR "ash: replaying the journal failed\n");
+	else
+		printk(KERN_INFO "ash: replayed %u blocks of transaction %u from the journal\n",
+			i, *seq - 1);
+	
+out:
+	kfree(buf);
+	kfree(head);
+	
+	return err;
+}
+
+
+
+/*
+ * Replays what the journal holds, then sets up the running transaction.
+ * Blocks smaller than a kernel block share their buffer_heads with file data
+ * and neighbouring metadata, which can't be held back: on such a device the
+ * journal is only replayed, metadata goes to the disk as without one.
+ * @return 0 on success
+ */
+int ash_journal_load (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_journal *j;
+	uint32_t seq = 0;
+	int err;
+	
+	if (!(sbi->raw.features & ASH_FEATURE_JOURNAL))
+		return 0;
+	
+	if (sbi->raw.vers < 14 || sbi->raw.journalblocks < 2 ||
+			sbi->raw.journal < sbi->raw.BATstart + sbi->raw.BATblocks ||
+			sbi->raw.journal + sbi->raw.journalblocks > sbi->raw.datastart) {
+		printk(KERN_ERR "ash: bad journal at block %u\n", sbi->raw.journal);
+		return -EINVAL;
+	}
+	
+	err = ash_journal_replay(sb, &seq);
+	if (err)
+		return err;
+	
+	if (sbi->aper_bits || (sb->s_flags & MS_RDONLY))
+		return 0;
+	
+	j = kzalloc(sizeof(*j), GFP_KERNEL);
+	if (!j)
+		return -ENOMEM;
+	
+	init_rwsem(&j->sem);
+	spin_lock_init(&j->lock);
+	ash_wbatch_init(&j->wb);
+	
+	j->start = sbi->raw.journal;
+	j->cap = min_t(uint32_t, sbi->raw.journalblocks - 1, (sbi->blocksize - sizeof(*j->head)) / 4);
+	j->size = j->cap;
+	j->seq = seq;
+	
+	// at most half full, so probing stays short
+	j->hbits = ilog2(j->size) + 2;
+	
+	j->views = vmalloc(j->size * sizeof(*j->views));
+	j->hash = vmalloc(sizeof(*j->hash) << j->hbits);
+	if (j->hash)
+		memset(j->hash, 0, sizeof(*j->hash) << j->hbits);
+	j->head = kzalloc(sbi->blocksize, GFP_KERNEL);
+	j->buf = kmalloc(sbi->blocksize, GFP_KERNEL);
+	
+	sbi->journal = j;
+	
+	if (!j->views || !j->hash || !j->head || !j->buf) {
+		ash_journal_free(sb);
+		return -ENOMEM;
+	}
+	
+	return 0;
+}
+
+
+
+/*
+ * Drops the journal at umount, after the last commit; anything it still holds
+ * is not written
+ */
+void ash_journal_free (struct super_block *sb)
+{
+	struct ash_journal *j = ASH_SB(sb)->journal;
+	uint32_t i;
+	
+	if (!j)
+		return;
+	
+	for (i = 0; i < j->nr; i++)
+		ash_bput(&j->views[i]);
+	
+	ash_wbatch_release(&j->wb);
+	vfree(j->views);
+	vfree(j->hash);
+	kfree(j->head);
+	kfree(j->buf);
+	kfree(j);
+	
+	ASH_SB(sb)->journal = NULL;
+}
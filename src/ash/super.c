@@ -15,20 +15,298 @@
 #include <linux/dcache.h>
 #include <linux/buffer_head.h>
 #include <linux/spinlock.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/sort.h>
+#include <linux/backing-dev.h>
+#include <linux/slab.h>
+#include <linux/proc_fs.h>
 #include <asm/string.h>
 #include "ash.h"
 #include "crypt.h"
 
 
+extern void ash_clear_inode (struct inode *);
+extern void ash_delete_inode (struct inode *);
+extern struct backing_dev_info ash_backing_dev_info;
+
+// /proc/fs/ash, with a file for each mounted device
+static struct proc_dir_entry *ash_proc_root;
+
+/*
+ * Copies the in memory superblock to the start of block 0, where it is on
+ * the disk, for the fields that change while mounted (fnogen)
+ * @return 0 on success
+ */
+static int ash_commit_super (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_raw_superblock raw;
+	struct ash_bview view;
+	
+	if (ash_bget(sb, 0, &view))
+		return -EIO;
+	
+	spin_lock(&sbi->raw_lock);
+	memcpy(&raw, &sbi->raw, sizeof(raw));
+	spin_unlock(&sbi->raw_lock);
+	
+	ash_bview_copy(&view, 0, &raw, sizeof(raw), ASH_BVIEW_WRITE);
+	ash_bdirty(&view);
+	ash_bput(&view);
+	
+	return 0;
+}
+
+
+
+/*
+ * Puts what the filesystem keeps in memory in the buffer cache: the UBB, the
+ * BAT changes and the superblock. The superblock gets the time of the write
+ * and the free block count once per sync, whatever number of operations it
+ * covers. With a journal, this is part of each commit.
+ * @return 0 on success
+ */
+int ash_sync_super (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	uint32_t free;
+	int err = 0;
+	
+	if (ash_ubb_sync(sb))
+		err = -EIO;
+	if (ash_bat_commit(sb))
+		err = -EIO;
+	
+	spin_lock(&sbi->ubb_lock);
+	free = sbi->free_blocks;
+	spin_unlock(&sbi->ubb_lock);
+	
+	spin_lock(&sbi->raw_lock);
+	sbi->raw.write_time = get_seconds();
+	sbi->raw.free_blocks = free;
+	spin_unlock(&sbi->raw_lock);
+	
+	if (ash_commit_super(sb))
+		err = -EIO;
+	
+	return err;
+}
+
+
+
+/*
+ * Writes back what the filesystem keeps in memory (see ash_sync_super). The
+ * inode records are written by write_inode before, they are dirty buffers of
+ * the device like these, or blocks of the running transaction.
+ * @return 0 on success
+ */
+static int ash_sync_fs (struct super_block *sb, int wait)
+{
+	int err;
+	
+	if (ASH_SB(sb)->journal)
+		err = ash_journal_commit(sb);
+	else
+		err = ash_sync_super(sb);
+	
+	if (wait && sync_blockdev(sb->s_bdev))
+		err = -EIO;
+	
+	return err;
+}
+
+
+
+/*
+ * Commits the running transaction; called every writeback period once it
+ * has blocks (s_dirt, see ash_journal_dirty)
+ */
+static void ash_write_super (struct super_block *sb)
+{
+	if (ASH_SB(sb)->journal)
+		ash_journal_commit(sb);
+	
+	sb->s_dirt = 0;
+}
+
+
+
+/*
+ * Statistics of the filesystem for statfs(2), from the counts the allocator
+ * keeps, without looking at the UBB. What writes have reserved is not available.
+ */
+static int ash_statfs (struct dentry *dentry, struct kstatfs *buf)
+{
+	struct ash_sb_info *sbi = ASH_SB(dentry->d_sb);
+	
+	buf->f_type = ASH_MAGIC;
+	buf->f_bsize = sbi->blocksize;
+	buf->f_blocks = sbi->raw.maxblocks;
+	
+	spin_lock(&sbi->ubb_lock);
+	buf->f_bfree = sbi->free_blocks;
+	buf->f_bavail = ash_avail_blocks(sbi);
+	spin_unlock(&sbi->ubb_lock);
+	
+	buf->f_namelen = sizeof(((struct ash_raw_file*) 0)->name) - 1;
+	
+	return 0;
+}
+
+
+
+/*
+ * Frees the Ash information of the superblock at umount
+ */
+static void ash_put_super (struct super_block *sb)
+{
+	if (!sb->s_fs_info)
+		return;
+	
+	ash_itable_free(sb);
+	
+	// the free count in the superblock is right once everything else is on the disk
+	if (!(sb->s_flags & MS_RDONLY)) {
+		ash_sync_fs(sb, 1);
+		ash_journal_free(sb);
+		ASH_SB(sb)->raw.state = ASH_UMOUNT;
+		ash_commit_super(sb);
+		sync_blockdev(sb->s_bdev);
+	}
+	
+	ash_ubb_free(sb);
+	
+	ash_bat_commit(sb);
+	ash_bat_free(sb);
+	
+	if (ash_proc_root)
+		remove_proc_entry(sb->s_id, ash_proc_root);
+	
+	kfree(sb->s_fs_info);
+	sb->s_fs_info = NULL;
+}
+
+
+static struct kmem_cache *ash_inode_cachep;
+
+/*
+ * Gets an inode, with its Ash information around it, from ash_inode_cachep
+ */
+static struct inode* ash_alloc_inode (struct super_block *sb)
+{
+	struct ash_inode_info *ei;
+	
+	ei = kmem_cache_alloc(ash_inode_cachep, GFP_KERNEL);
+	if (!ei)
+		return NULL;
+	
+	// the VFS inode was set up once by ash_init_once, the rest is ours
+	memset(ei, 0, offsetof(struct ash_inode_info, vfs_inode));
+	ash_wbatch_init(&ei->wb);
+	mutex_init(&ei->alloc_lock);
+	
+	return &ei->vfs_inode;
+}
+
+
+static void ash_destroy_inode (struct inode *inode)
+{
+	kmem_cache_free(ash_inode_cachep, ASH_I(inode));
+}
+
+
+static void ash_init_once (void *data)
+{
+	struct ash_inode_info *ei = data;
+	
+	inode_init_once(&ei->vfs_inode);
+}
+
+
+// no drop_inode: unused inodes stay in the inode cache (generic_drop_inode)
 static struct super_operations ash_super_operations = {
-	.statfs		= simple_statfs,
-	.drop_inode	= generic_delete_inode,
+	.alloc_inode	= ash_alloc_inode,
+	.destroy_inode	= ash_destroy_inode,
+	.write_inode	= ash_write_inode,
+	.write_super	= ash_write_super,
+	.sync_fs	= ash_sync_fs,
+	.statfs		= ash_statfs,
+	.delete_inode	= ash_delete_inode,
+	.clear_inode	= ash_clear_inode,
+	.put_super	= ash_put_super,
 };
 
 extern struct inode * ash_get_inode (struct super_block *, int);
+
+/*
+ * Reads /proc/fs/ash/<device>: how the BAT updates of the mounted
+ * filesystem were batched so far
+ * @return number of bytes put in page
+ */
+static int ash_proc_read (char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct ash_sb_info *sbi = ASH_SB((struct super_block*) data);
+	int len;
+	
+	*eof = 1;
+	
+	// all of it fits the first read
+	if (off)
+		return 0;
+	
+	len = sprintf(page, "bat_commits %lu\nbat_blocks %lu\nbat_last_blocks %lu\n",
+		sbi->bat_stats.commits, sbi->bat_stats.blocks, sbi->bat_stats.last_blocks);
+	
+	return min(len, count);
+}
+
+
 extern struct file_operations ash_dir_operations;
 extern struct inode_operations ash_dir_inode_operations;
 
+/*
+ * Sets the kernel block size used for the device and works out how Ash blocks
+ * map onto kernel blocks. When it can, the kernel block size is the Ash block size
+ * and each Ash block is exactly one buffer_head. Otherwise the kernel block is as
+ * close as the device and the page cache allow, and the Ash block is either a
+ * few whole kernel blocks (8192 bytes) or a slice of one (hardware sector bigger
+ * than the Ash block).
+ * @return 0 on success
+ */
+static int ash_setup_blocks (struct super_block *sb, struct ash_sb_info *sbi)
+{
+	int kbsize;
+	
+	sbi->blocksize = sbi->raw.blocksize;
+	sbi->blockbits = sbi->raw.blockbits;
+	
+	kbsize = sbi->blocksize;
+	if (kbsize > PAGE_CACHE_SIZE)
+		kbsize = PAGE_CACHE_SIZE;
+	if (kbsize < bdev_hardsect_size(sb->s_bdev))
+		kbsize = bdev_hardsect_size(sb->s_bdev);
+	
+	if (!sb_set_blocksize(sb, kbsize)) {
+		printk(KERN_ERR "cannot use %d byte blocks on the device\n", kbsize);
+		return -EINVAL;
+	}
+	
+	// only one of them is not 0
+	if (sbi->blockbits >= sb->s_blocksize_bits) {
+		sbi->kper_bits = sbi->blockbits - sb->s_blocksize_bits;
+		sbi->aper_bits = 0;
+	} else {
+		sbi->kper_bits = 0;
+		sbi->aper_bits = sb->s_blocksize_bits - sbi->blockbits;
+	}
+	
+	return 0;
+}
+
+
+
 static int ash_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct inode * root;
@@ -36,12 +314,29 @@ static int ash_fill_super(struct super_block *sb, void *data, int silent)
 	struct buffer_head *bh;
 	struct ash_raw_superblock *rsb;
 	struct ash_raw_file *rfile;
-		
-	// read sector 0 -> the superblock sector
-	bh = __bread(sb->s_bdev, 0, ASH_SECTORSIZE);
+	struct ash_sb_info *sbi;
+	struct ash_bview view;
+	int err;
+	
+	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+	if (!sbi)
+		return -ENOMEM;
+	
+	sb->s_fs_info = sbi;
+	spin_lock_init(&sbi->raw_lock);
+	err = -EINVAL;
+	
+	// read sector 0 -> the superblock sector, with the smallest block the device can do
+	if (!sb_min_blocksize(sb, ASH_SECTORSIZE)) {
+		printk(KERN_ERR "cannot set the device block size\n");
+		goto out_free;
+	}
+	
+	bh = sb_bread(sb, 0);
 	if (!bh) {
-		printk(KERN_ERR "__bread from the device failed\n");
-		return -1;
+		printk(KERN_ERR "reading the superblock from the device failed\n");
+		err = -EIO;
+		goto out_free;
 	}
 	
 	rsb = (struct ash_raw_superblock*)bh->b_data;
@@ -50,53 +345,103 @@ static int ash_fill_super(struct super_block *sb, void *data, int silent)
 	if (rsb->magic != ASH_MAGIC) {
 		printk(KERN_ERR "incorrect magic number\n");
 		brelse(bh);
-		return -1;
+		goto out_free;
 	}
 	
+	// only power of 2 blocks are laid out by ashformat
+	if (rsb->blocksize < ASH_MIN_BLOCKSIZE || rsb->blocksize > ASH_MAX_BLOCKSIZE ||
+			rsb->blocksize != 1 << rsb->blockbits) {
+		printk(KERN_ERR "unsupported block size %d\n", rsb->blocksize);
+		brelse(bh);
+		goto out_free;
+	}
+	
+	// a newer layout may have things this code does not know about
+	if (rsb->vers > ASH_VERSION || (rsb->features & ~ASH_FEATURES_KNOWN)) {
+		printk(KERN_ERR "unsupported Ash version %d (features %x)\n", rsb->vers, rsb->features);
+		brelse(bh);
+		goto out_free;
+	}
+	
+	// keep our own copy, the buffer_head goes away
+	memcpy(&sbi->raw, rsb, sizeof(sbi->raw));
+	brelse(bh);
+	
+	rsb = &sbi->raw;
+	
+	err = ash_setup_blocks(sb, sbi);
+	if (err)
+		goto out_free;
+	
 	// fill in superblock fields by using the superblock read from disk
-	sb->s_blocksize = rsb->blocksize;
-	sb->s_blocksize_bits = rsb->blockbits;
 	sb->s_magic = rsb->magic;
+	sb->s_op = &ash_super_operations;
+	sb->s_maxbytes = min_t(loff_t, MAX_LFS_FILESIZE, (loff_t) rsb->maxblocks << rsb->blockbits);
 	
 	// setting time granularity at 1 second (it is in ns)
 	sb->s_time_gran = 1000000000;
 	
-	// private filesystem info
-	sb->s_fs_info = rsb;
-	
 	if (silent != 1)
 		printk("Ash vers: %d volname: '%s'\n", rsb->vers, rsb->volname);
-
-	brelse(bh);
-
+	
+	// before anything is read, it may be older than what the journal holds
+	err = ash_journal_load(sb);
+	if (err)
+		goto out_free;
+	
+	// the Used Blocks Bitmap stays in memory while mounted
+	err = ash_ubb_load(sb);
+	if (err)
+		goto out_journal;
+	
+	err = ash_bat_init(sb);
+	if (err)
+		goto out_ubb;
+	
+	err = ash_itable_init(sb);
+	if (err)
+		goto out_ubb;
+	
+	// written below, before anything else changes on the disk: until a clean
+	// umount, the free count in the superblock is not to be trusted
+	if (!(sb->s_flags & MS_RDONLY)) {
+		rsb->mnt_count++;
+		rsb->mount_time = get_seconds();
+		rsb->state = ASH_MOUNTED;
+	}
+	
 	// create the root inode
 	// read the root directory entry from the device
-	bh = __bread(sb->s_bdev, rsb->datastart << rsb->blockbits >> KERNEL_BLOCKBITS, KERNEL_BLOCKSIZE);
-	if (!bh) {
+	if (ash_bget(sb, rsb->datastart, &view)) {
 		printk(KERN_ERR "cannot read root directory entry\n");
-		return -1;
+		err = -EIO;
+		goto out_ubb;
 	}
 	
-	rfile = (struct ash_raw_file*) (bh->b_data);
+	// the root's entry is at the start of the block, it never crosses a buffer_head
+	rfile = (struct ash_raw_file*) ash_bptr(&view, 0, sizeof(*rfile), NULL);
 	
 	// making the root
-	root = ash_get_inode(sb, rfile->mode);
+	root = ash_iget_raw(sb, rfile);
 	if (! root) {
-		brelse(bh);
-		return -ENOMEM;
+		ash_bput(&view);
+		err = -ENOMEM;
+		goto out_ubb;
 	}
 
 	root->i_op = &ash_dir_inode_operations;
-	root->i_fop = &ash_dir_operations;
 	
-	// set private data
-	root->i_private = rfile;
+	// the root's entry is its record, whatever the directories hold
+	ASH_I(root)->rec_block = rsb->datastart;
+	ASH_I(root)->rec_off = 0;
+	
+	ash_bput(&view);
 
 	root_dentry = d_alloc_root(root);
 	if (! root_dentry) {
-		brelse(bh);
 		iput(root);
-		return -ENOMEM;
+		err = -ENOMEM;
+		goto out_ubb;
 	}
 	
 	// root has no parent
@@ -104,348 +449,539 @@ static int ash_fill_super(struct super_block *sb, void *data, int silent)
 
 	// final superblock init
 	sb->s_root = root_dentry;
-	sb->s_op = &ash_super_operations;
+	
+	if (!(sb->s_flags & MS_RDONLY)) {
+		ash_commit_super(sb);
+		ash_journal_commit(sb);
+		sync_blockdev(sb->s_bdev);
+	}
+	
+	// only statistics, the mount goes on without them
+	if (ash_proc_root)
+		create_proc_read_entry(sb->s_id, 0444, ash_proc_root, ash_proc_read, sb);
+	
+	return 0;
 
-	brelse(bh);
+out_ubb:
+	ash_itable_free(sb);
+	ash_bat_free(sb);
+	ash_ubb_free(sb);
+out_journal:
+	ash_journal_free(sb);
+out_free:
+	sb->s_fs_info = NULL;
+	kfree(sbi);
+	return err;
+}
 
-	return 0;
+/*
+ * Grabs (without reading) the buffer_heads the Ash block lies in and fills in the view.
+ * Uses the block mapping set up at mount by ash_setup_blocks.
+ * @return 0 on success
+ */
+static int ash_bview_map (struct super_block *sb, uint32_t block, struct ash_bview *view)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	sector_t kB;
+	int i;
+	
+	// first kernel block of the Ash block, and where the Ash block starts in it
+	kB = ((sector_t) block << sbi->kper_bits) >> sbi->aper_bits;
+	
+	view->sb = sb;
+	view->block = block;
+	view->off = (block & ((1 << sbi->aper_bits) - 1)) << sbi->blockbits;
+	view->nr = 1 << sbi->kper_bits;
+	
+	for (i = 0; i < view->nr; i++) {
+		view->bh[i] = sb_getblk(sb, kB + i);
+		
+		if (!view->bh[i]) {
+			while (--i >= 0)
+				brelse(view->bh[i]);
+			view->nr = 0;
+			return -ENOMEM;
+		}
+	}
 	
+	// the whole block can be handed out as one pointer only if it sits in a single buffer_head
+	if (view->nr == 1)
+		view->data = view->bh[0]->b_data + view->off;
+	else
+		view->data = NULL;
+	
+	return 0;
 }
 
-static int myfs_fill_super(struct super_block * sb, void * data, int silent)
+
+
+/*
+ * Pins the buffer_heads holding an Ash block, reading them if needed.
+ * The data can then be used in place, without copying it, until ash_bput.
+ * If the block lies in a single buffer_head, view->data points to it
+ * (for blocksize 4096 that is the whole page, view->bh[0]->b_page)
+ * @return 0 on success
+ */
+int ash_bget (struct super_block *sb, uint32_t block, struct ash_bview *view)
 {
-        struct inode * root_inode;
- 
-        sb->s_maxbytes = MAX_LFS_FILESIZE;
-        sb->s_blocksize = PAGE_CACHE_SIZE;
-        sb->s_blocksize_bits = PAGE_CACHE_SHIFT;
-        sb->s_magic = 234;
-        sb->s_op = &ash_super_operations;
+	int i, err;
+	
+	err = ash_bview_map(sb, block, view);
+	if (err)
+		return err;
+	
+	// send all the reads in one go, instead of waiting for each kernel block
+	// before asking for the next one. buffers already uptodate are skipped
+	ll_rw_block(READ, view->nr, view->bh);
+	
+	for (i = 0; i < view->nr; i++) {
+		wait_on_buffer(view->bh[i]);
 		
-        root_inode = ash_get_inode(sb, S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);        //mode = directory & access rights (755)
-        if (!root_inode)
-                goto out_no_root;
- 
-        sb->s_root = d_alloc_root(root_inode);
-        if (!sb->s_root) 
-                goto out_no_root;
-        return 0;
+		if (!buffer_uptodate(view->bh[i]))
+			err = -EIO;
+	}
+	
+	if (err)
+		ash_bput(view);
 		
-out_no_root:
-        printk(KERN_ERR "Get root inode failed\n");
-        iput(root_inode);
-        return -ENOMEM;
+	return err;
 }
 
 
+
 /*
- * Reads a block from the drive and returns a buffer of blocksize bytes
- * @return NULL in case of an error, or a pointer to a buffer
+ * Pins the buffer_heads of an Ash block that is going to be rewritten entirely.
+ * If the Ash block covers its kernel blocks they are not read from disk; a kernel
+ * block shared with other Ash blocks is. The block's contents are zeroed.
+ * @return 0 on success
  */
-void* block_read (struct super_block *sb, uint32_t block)
+int ash_bget_new (struct super_block *sb, uint32_t block, struct ash_bview *view)
 {
-	uint64_t bytes, kB, kO, off;
-	int i, n;
-	char *buf;
-	struct buffer_head *bh;
-	
-	bytes = block << sb->s_blocksize_bits;		// the real offset on disk
-	kB = bytes >> KERNEL_BLOCKBITS;			// kernel block of 4096 bytes
-	kO = bytes & (KERNEL_BLOCKSIZE - 1);		// offset in the kernel block
-
-	buf = kmalloc(sb->s_blocksize, GFP_ATOMIC);	// try to get a buffer to read in
+	int i, err;
 	
-	if (!buf)
-		return NULL;
+	// a slice of a kernel block, the rest of it must be read
+	if (ASH_SB(sb)->aper_bits) {
+		err = ash_bget(sb, block, view);
+		if (err)
+			return err;
 		
-	off = 0;					// offset for copying in the buf
+		ash_bview_copy(view, 0, NULL, ASH_SB(sb)->blocksize, ASH_BVIEW_ZERO);
+		return 0;
+	}
 	
-	// read start of buffer from kernel block kB
-	bh = __bread(sb->s_bdev, kB, KERNEL_BLOCKSIZE);
+	err = ash_bview_map(sb, block, view);
+	if (err)
+		return err;
 	
-	if (!bh) {
-		kfree(buf);
-		return NULL;
+	for (i = 0; i < view->nr; i++) {
+		lock_buffer(view->bh[i]);
+		memset(view->bh[i]->b_data, 0, sb->s_blocksize);
+		set_buffer_uptodate(view->bh[i]);
+		unlock_buffer(view->bh[i]);
 	}
+	
+	return 0;
+}
 
-	// test which one is the min
-	if (sb->s_blocksize <= KERNEL_BLOCKSIZE) {
-		off = sb->s_blocksize - kO;	// how many bytes we are copying
-		memcpy(buf, bh->b_data, off);
-	} else {
-		off = KERNEL_BLOCKSIZE - kO;	// how many bytes we are copying
-		memcpy(buf, bh->b_data, off);
+
+
+/*
+ * Releases the buffer_heads pinned by ash_bget/ash_bget_new
+ */
+void ash_bput (struct ash_bview *view)
+{
+	int i;
+	
+	for (i = 0; i < view->nr; i++)
+		brelse(view->bh[i]);
+	
+	view->nr = 0;
+	view->data = NULL;
+}
+
+
+
+/*
+ * Marks the buffer_heads of a block as dirty, after it was changed in place
+ */
+void ash_bdirty (struct ash_bview *view)
+{
+	int i;
+	
+	// with a journal, the block waits for the commit of the running transaction
+	if (ASH_SB(view->sb)->journal) {
+		ash_journal_dirty(view);
+		return;
 	}
 	
-	brelse(bh);
+	for (i = 0; i < view->nr; i++)
+		mark_buffer_dirty(view->bh[i]);
+}
+
+
+
+/*
+ * Copies len bytes between buf and offset off of the block.
+ * dir is ASH_BVIEW_READ (block -> buf), ASH_BVIEW_WRITE (buf -> block)
+ * or ASH_BVIEW_ZERO (clears the range, buf is not used).
+ * Doesn't mark anything dirty.
+ */
+void ash_bview_copy (struct ash_bview *view, uint32_t off, void *buf, uint32_t len, int dir)
+{
+	uint32_t pos, o, chunk;
+	struct buffer_head *bh;
+	
+	struct super_block *sb = view->sb;
+	
+	pos = view->off + off;
 	
-	// now to copy an integer number of kernel blocks
-	n = (sb->s_blocksize - off) >> KERNEL_BLOCKBITS;
-	for (i = 0; i < n; i++) {
-		bh = __bread(sb->s_bdev, kB + i, KERNEL_BLOCKSIZE);
+	while (len > 0) {
+		bh = view->bh[pos >> sb->s_blocksize_bits];
+		o = pos & (sb->s_blocksize - 1);
+		chunk = min_t(uint32_t, len, sb->s_blocksize - o);
 		
-		if (!bh) {
-			kfree(buf);
-			return NULL;
-		}
-			
-		memcpy(buf+off, bh->b_data, KERNEL_BLOCKSIZE);
-		off += KERNEL_BLOCKSIZE;
+		if (dir == ASH_BVIEW_READ)
+			memcpy(buf, bh->b_data + o, chunk);
+		else if (dir == ASH_BVIEW_WRITE)
+			memcpy(bh->b_data + o, buf, chunk);
+		else
+			memset(bh->b_data + o, 0, chunk);
 		
-		brelse(bh);
+		if (buf)
+			buf += chunk;
+		pos += chunk;
+		len -= chunk;
 	}
+}
+
+
+
+/*
+ * Returns a pointer to len bytes at offset off of the block. If they are in one
+ * buffer_head the pointer is in place, otherwise they are copied into tmp,
+ * which must hold len bytes, and tmp is returned.
+ */
+void* ash_bptr (struct ash_bview *view, uint32_t off, uint32_t len, void *tmp)
+{
+	int bits = view->sb->s_blocksize_bits;
+	uint32_t pos;
 	
-	// copy the last part of a kernel block
-	// check if there's really a need to read another kernel block
-	if (off < sb->s_blocksize) {
-		bh = __bread(sb->s_bdev, kB + n, KERNEL_BLOCKSIZE);
-		
-		if (!bh) {
-			kfree(buf);
-			return NULL;
-		}
+	if (view->data)
+		return view->data + off;
+	
+	pos = view->off + off;
+	
+	if ((pos >> bits) == ((pos + len - 1) >> bits))
+		return view->bh[pos >> bits]->b_data + (pos & (view->sb->s_blocksize - 1));
+	
+	ash_bview_copy(view, off, tmp, len, ASH_BVIEW_READ);
+	return tmp;
+}
 
-		memcpy(buf+off, bh->b_data, sb->s_blocksize - off);
-		brelse(bh);
+
+
+/*
+ * Reads a block from the drive and returns a buffer of blocksize bytes
+ * Callers that don't need their own copy should use ash_bget instead.
+ * @return NULL in case of an error, or a pointer to a buffer
+ */
+void* block_read (struct super_block *sb, uint32_t block)
+{
+	struct ash_bview view;
+	char *buf;
+	
+	buf = kmalloc(ASH_SB(sb)->blocksize, GFP_NOFS);	// try to get a buffer to read in
+	
+	if (!buf)
+		return NULL;
+	
+	if (ash_bget(sb, block, &view)) {
+		kfree(buf);
+		return NULL;
 	}
 	
+	ash_bview_copy(&view, 0, buf, ASH_SB(sb)->blocksize, ASH_BVIEW_READ);
+	ash_bput(&view);
+	
 	// all ok
 	return buf;
-
 }
 
 
 
 /*
- * Writes a block to the drive. The block's data is an array of blocksize bytes
- * @return 0 on success
+ * Completion of a bio accounted in an ash_extent_io
  */
-int block_write (struct super_block *sb, void *data, uint32_t block)
+void ash_extent_end_io (struct bio *bio, int err)
 {
-	uint64_t bytes, kB, kO, off;
-	int i, n;
-	struct buffer_head *bh;
+	struct ash_extent_io *io = bio->bi_private;
 	
-	bytes = block << sb->s_blocksize_bits;		// the real offset on disk
-	kB = bytes >> KERNEL_BLOCKBITS;			// kernel block of 4096 bytes
-	kO = bytes & (KERNEL_BLOCKSIZE - 1);		// offset in the kernel block
-
-	off = 0;					// offset for copying from data buffer
+	if (!bio_flagged(bio, BIO_UPTODATE))
+		io->error = -EIO;
 	
-	// read start of buffer from kernel block kB
-	bh = __getblk(sb->s_bdev, kB, KERNEL_BLOCKSIZE);
+	bio_put(bio);
 	
-	if (!bh)
-		return -1;
+	if (atomic_dec_and_test(&io->pending))
+		complete(&io->done);
+}
+
+
+
+/*
+ * Sets up an ash_extent_io before sending the bios it accounts for
+ */
+void ash_extent_io_init (struct ash_extent_io *io)
+{
+	atomic_set(&io->pending, 1);
+	io->error = 0;
+	init_completion(&io->done);
+}
+
+
+
+/*
+ * Waits for all the bios accounted in io, after getting them going
+ * @return 0 on success, -EIO if any of them failed
+ */
+int ash_extent_io_wait (struct super_block *sb, struct ash_extent_io *io)
+{
+	// bios are waiting in the plugged queue
+	blk_run_address_space(sb->s_bdev->bd_inode->i_mapping);
 	
-	// test which one is the min
-	if (sb->s_blocksize <= KERNEL_BLOCKSIZE) {
-		off = sb->s_blocksize - kO;		// how many bytes we are copying
-		memcpy(bh->b_data, data, off);
-	} else {
-		off = KERNEL_BLOCKSIZE - kO;		// how many bytes we are copying
-		memcpy(bh->b_data, data, off);
-	}
+	if (!atomic_dec_and_test(&io->pending))
+		wait_for_completion(&io->done);
 	
-	// make a request
-	mark_buffer_dirty(bh);
-	brelse(bh);
+	return io->error;
+}
+
+
+
+/*
+ * Sends a bio for one Ash block, between the device and a part of a page
+ * starting at off. It is accounted in io.
+ * @return 0 on success, -ENOMEM if the bio couldn't be made
+ */
+int ash_block_bio (struct super_block *sb, int rw, uint32_t block, struct page *page,
+		unsigned int off, struct ash_extent_io *io)
+{
+	struct bio *bio;
 	
-	// now to copy an integer number of kernel blocks
-	n = ((uint64_t)sb->s_blocksize - off) >> KERNEL_BLOCKBITS;
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
 	
-	for (i = 0; i < n; i++) {
-		bh = __getblk(sb->s_bdev, kB + i, KERNEL_BLOCKSIZE);
-		
-		if (!bh)
-			return -1;
-			
-		memcpy(bh->b_data, data + off, KERNEL_BLOCKSIZE);
-		off += KERNEL_BLOCKSIZE;
-		
-		mark_buffer_dirty(bh);
-		brelse(bh);
-	}
-
-	// copy the last part of a kernel block
-	// check if there's really a need to read another kernel block
-	if (off < sb->s_blocksize) {
-		bh = __getblk(sb->s_bdev, kB + n, KERNEL_BLOCKSIZE);
-		
-		if (!bh)
-			return -1;
-			
-		memcpy(bh->b_data, data + off, sb->s_blocksize - off);
-		
-		mark_buffer_dirty(bh);
-		brelse(bh);
-	}
+	bio->bi_bdev = sb->s_bdev;
+	bio->bi_sector = ash_block_sector(sb, block);
+	bio->bi_end_io = ash_extent_end_io;
+	bio->bi_private = io;
+	bio_add_page(bio, page, ASH_SB(sb)->blocksize, off);
+	
+	atomic_inc(&io->pending);
+	submit_bio(rw, bio);
 	
-	// all ok
 	return 0;
 }
 
 
 
 /*
- * Returns the first block that is available for use
- * @return block index, or -1 in case of error
+ * Drops what the buffer cache may still have of blocks that are becoming file
+ * data, which goes to the disk in bios of its own: a dirty buffer left from
+ * when a block was metadata must not be written over the data later. Blocks
+ * smaller than a kernel block keep going through the buffer cache.
  */
-int block_first_free(struct super_block *sb)
+void ash_forget_blocks (struct super_block *sb, uint32_t start, uint32_t len)
 {
-	struct ash_raw_superblock *rsb;
-	uint32_t kB, kO;
-	uint64_t off, size;
-	int done, i;
-	struct buffer_head *bh;
-	uint8_t *ubb, byte;
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	sector_t kB, n;
 	
-	// obtain a point to the ash_raw_superblock structure
-	rsb = sb->s_fs_info;
+	ash_journal_forget(sb, start, len);
 	
-	// get the kernel block and offset for UBBstart
-	off = rsb->UBBstart << sb->s_blocksize_bits;
-	kB = off >> KERNEL_BLOCKBITS;
-	kO = off & (KERNEL_BLOCKSIZE - 1);
+	if (sbi->aper_bits)
+		return;
 	
-	size = rsb->UBBblocks << sb->s_blocksize_bits;
-	off = 0;
-	done = 0;
-	byte = 0;
+	kB = (sector_t) start << sbi->kper_bits;
 	
-	// read all UBB
-	while (!done && off < size) {
-		
-		// read a new block from UBB
-		bh = __bread(sb->s_bdev, kB, sb->s_blocksize);
-		
-		if (!bh)
-			return -1;
+	for (n = 0; n < ((sector_t) len << sbi->kper_bits); n++)
+		unmap_underlying_metadata(sb->s_bdev, kB + n);
+}
+
+
+
+/*
+ * Sends reads (rw READ) or writes (rw WRITE) for bytes bytes of the device,
+ * starting at sector, from or to the pages array. Every page except the last
+ * one is used entirely.
+ * The pages are packed in as few bios as the queue allows; a page is never
+ * split between two bios, so end_io can handle pages one by one.
+ * If io is given, it accounts for each bio sent and is passed to end_io
+ * as bi_private, otherwise bi_private is left NULL.
+ * @return number of pages sent; less than asked for if a bio couldn't be allocated
+ * or the queue won't take a page even in an empty bio, in which case the
+ * remaining pages are left untouched
+ */
+int ash_rw_pages (struct super_block *sb, int rw, sector_t sector, struct page **pages,
+		unsigned long bytes, bio_end_io_t *end_io, struct ash_extent_io *io)
+{
+	struct bio *bio;
+	unsigned int len;
+	int nr_vecs, i;
+	
+	nr_vecs = bio_get_nr_vecs(sb->s_bdev);
+	bio = NULL;
+	i = 0;
+	
+	while (bytes > 0) {
+		len = min_t(unsigned long, bytes, PAGE_CACHE_SIZE);
 		
-		// get address to KERNEL_BLOCKSIZE bytes from UBB
-		ubb = (uint8_t*)bh->b_data + kO;
+		if (!bio) {
+			bio = bio_alloc(GFP_NOIO, nr_vecs);
+			
+			// every page before i went out in a bio
+			if (!bio)
+				return i;
+				
+			bio->bi_bdev = sb->s_bdev;
+			bio->bi_sector = sector;
+			bio->bi_end_io = end_io;
+			bio->bi_private = io;
+		}
 		
-		for (i=0; i < KERNEL_BLOCKSIZE && !done; i++)
-			if (ubb[i] != 0xFF) {
-				done = 1;
-				off += i;
-				byte = ubb[i];
-				break;
+		// the bio is full, send it and retry the page with a new one
+		if (bio_add_page(bio, pages[i], len, 0) < len) {
+			// not even alone: a new bio wouldn't take it either
+			if (bio->bi_vcnt == 0) {
+				bio_put(bio);
+				return i;
 			}
-			
-		if (!done) {
-			off += KERNEL_BLOCKSIZE;
-			kO = 0;		// only first kernel block doesn't have data start from byte 0
+	
+			if (io)
+				atomic_inc(&io->pending);
+			submit_bio(rw, bio);
+			bio = NULL;
+			continue;
 		}
 		
-		brelse(bh);
+		sector += len >> ASH_SECTORBITS;
+		bytes -= len;
+		i++;
 	}
-
-	if (off >= size)
-		return 0;
 	
-	// find first 0 bit from byte
-	i = 7;
-	while (byte & (1<<i))
-		i--;
-		
-	return off * 8 + (8 - i);
+	if (bio) {
+		if (io)
+			atomic_inc(&io->pending);
+		submit_bio(rw, bio);
+	}
+	
+	return i;
 }
 
 
 
 /*
- * Reads what value a block has in the Used Blocks Bitmap
- * @return 0 (unused), 1 (used) or -1 in case of error
+ * Reads count blocks, starting with block start, straight into the pages given
+ * by the caller. The blocks must be consecutive on the disk (an extent from the BAT
+ * chain, see BAT_extent), so they are sent as one contiguous request instead of
+ * one __bread per kernel block. pages must hold count * blocksize bytes.
+ *
+ * The read bypasses the buffer cache: use it for file data, not for metadata
+ * that may have dirty buffers.
+ * @return 0 on success
  */
-int UBB_read (struct super_block *sb, uint32_t block)
+int block_read_extent (struct super_block *sb, uint32_t start, uint32_t count, struct page **pages)
 {
-	struct ash_raw_superblock *rsb;
-	uint32_t lB, lO, kB, kO;
-	uint64_t off;
-	uint8_t bit, byte, rez;
-	struct buffer_head *bh;
-	uint8_t *ubb;
+	struct ash_extent_io io;
+	unsigned long bytes;
+	int nr, err;
 	
-	// obtain a point to the ash_raw_superblock structure
-	rsb = sb->s_fs_info;
+	ash_extent_io_init(&io);
 	
-	// get the logical block in which the byte containing the bit
-	// for block parameter is stored :) and logical offset
-	lB = rsb->UBBstart + (block >> (3 + sb->s_blocksize_bits));
-	lO = (block >> 3) & (sb->s_blocksize - 1);
+	bytes = (unsigned long) count << ASH_SB(sb)->blockbits;
+	nr = (bytes + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	err = 0;
 	
-	// kernel block to read in order to get the byte from lB, lO
-	off = ( lB << sb->s_blocksize_bits ) + lO;
-	kB = off >> KERNEL_BLOCKBITS;
-	kO = off & (KERNEL_BLOCKSIZE - 1);
+	if (ash_rw_pages(sb, READ, ash_block_sector(sb, start), pages, bytes, ash_extent_end_io, &io) < nr)
+		err = -ENOMEM;
 	
-	bit = 8 - (block & 7);	// the bit that needs to be read
+	// wait for the bios that did get sent, even if we failed along the way
+	if (ash_extent_io_wait(sb, &io) && !err)
+		err = -EIO;
 	
-	// read the block from disk
-	bh = __bread(sb->s_bdev, kB, KERNEL_BLOCKSIZE);
+	return err;
+}
+
+
+
+/*
+ * Writes a block to the drive. The block's data is an array of blocksize bytes
+ * @return 0 on success
+ */
+int block_write (struct super_block *sb, void *data, uint32_t block)
+{
+	struct ash_bview view;
 	
-	// error occured
-	if (!bh)
+	if (ash_bget_new(sb, block, &view))
 		return -1;
 	
-	ubb = (uint8_t*) bh->b_data;
-	byte = ubb[kO];
-	
-	rez = (byte & (1 << bit) ) >> bit;
+	ash_bview_copy(&view, 0, data, ASH_SB(sb)->blocksize, ASH_BVIEW_WRITE);
 	
-	brelse(bh);
+	// make a request
+	ash_bdirty(&view);
+	ash_bput(&view);
 	
-	return rez;
+	// all ok
+	return 0;
 }
 
 
 
 /*
- * Writes the value val for a block in Used Blocks Bitmap zone
+ * Sets up an empty write batch
+ */
+void ash_wbatch_init (struct ash_wbatch *wb)
+{
+	mutex_init(&wb->lock);
+	wb->nr = 0;
+	wb->max = 0;
+	wb->bhs = NULL;
+}
+
+
+
+/*
+ * Adds the buffer_heads of a block view to the batch. The view should have
+ * been marked dirty already; the batch keeps its own reference to them.
  * @return 0 on success
  */
-int UBB_write (struct super_block *sb, uint32_t block, uint8_t val)
+int ash_wbatch_add (struct ash_wbatch *wb, struct ash_bview *view)
 {
-	struct ash_raw_superblock *rsb;
-	uint32_t lB, lO, kB, kO;
-	uint64_t off;
-	uint8_t bit, mask;
-	struct buffer_head *bh;
-	uint8_t *ubb;
-	
-	// obtain a point to the ash_raw_superblock structure
-	rsb = sb->s_fs_info;
-	
-	// get the logical block in which the byte containing the bit
-	// for block parameter is stored :) and logical offset
-	lB = rsb->UBBstart + (block >> (3 + sb->s_blocksize_bits));
-	lO = (block >> 3) & (sb->s_blocksize - 1);
-	
-	// kernel block to read in order to get the byte from lB, lO
-	off = ( lB << sb->s_blocksize_bits ) + lO;
-	kB = off >> KERNEL_BLOCKBITS;
-	kO = off & (KERNEL_BLOCKSIZE - 1);
-	
-	bit = 8 - (block & 7);	// the bit that needs to be modified
+	struct buffer_head **bhs;
+	int i;
 	
-	// get the buffer_head from disk
-	bh = __getblk(sb->s_bdev, kB, KERNEL_BLOCKSIZE);
+	mutex_lock(&wb->lock);
 	
-	// error occured
-	if (!bh)
-		return -1;
+	if (wb->nr + view->nr > wb->max) {
+		bhs = krealloc(wb->bhs, (wb->max + ASH_WBATCH_GROW) * sizeof(*bhs), GFP_NOFS);
+		
+		if (!bhs) {
+			mutex_unlock(&wb->lock);
+			return -ENOMEM;
+		}
+		
+		wb->bhs = bhs;
+		wb->max += ASH_WBATCH_GROW;
+	}
 	
-	ubb = (uint8_t*) bh->b_data;
-	mask = 1 << bit;
+	for (i = 0; i < view->nr; i++) {
+		// the same block written again right after, it is in already
+		if (wb->nr && wb->bhs[wb->nr - 1] == view->bh[i])
+			continue;
 	
-	if (val == 0)	
-		ubb[kO] = ubb[kO] & (~mask);
-	else
-		ubb[kO] = ubb[kO] | mask;
+		get_bh(view->bh[i]);
+		wb->bhs[wb->nr++] = view->bh[i];
+	}
 	
-	mark_buffer_dirty(bh);
-	brelse(bh);
+	mutex_unlock(&wb->lock);
 	
 	return 0;
 }
@@ -453,86 +989,222 @@ int UBB_write (struct super_block *sb, uint32_t block, uint8_t val)
 
 
 /*
- * Get the number of the next block of data following block from the Block Allocation Table
- * @return uint32_t number of block or -1 on error
+ * Drops all the buffer_heads of a batch without writing them
  */
-int BAT_read (struct super_block *sb, uint32_t block)
+void ash_wbatch_release (struct ash_wbatch *wb)
 {
-	struct ash_raw_superblock *rsb;
-	uint32_t lB, lO, kB, kO;
-	uint64_t off;
-	struct buffer_head *bh;
-	uint32_t *bat;
+	int i;
 	
-	// obtain a point to the ash_raw_superblock structure
-	rsb = sb->s_fs_info;
+	mutex_lock(&wb->lock);
 	
-	// get the logical block which holds the entry in the BAT
-	// got the block parameter
-	lB = rsb->BATstart + (block >> (sb->s_blocksize - 2));
-	lO = (block << 2) & (sb->s_blocksize - 1);
+	for (i = 0; i < wb->nr; i++)
+		brelse(wb->bhs[i]);
 	
-	// kernel block to read in order to get the byte from lB, lO
-	off = ( lB << sb->s_blocksize_bits ) + lO;
-	kB = off >> KERNEL_BLOCKBITS;
-	kO = off & (KERNEL_BLOCKSIZE - 1);
+	kfree(wb->bhs);
+	wb->bhs = NULL;
+	wb->nr = 0;
+	wb->max = 0;
 	
-	// read the block from disk
-	bh = __bread(sb->s_bdev, kB, KERNEL_BLOCKSIZE);
+	mutex_unlock(&wb->lock);
+}
+
+
+
+/*
+ * Orders buffer_heads by their position on the device
+ */
+static int ash_bh_cmp (const void *a, const void *b)
+{
+	const struct buffer_head *x = *(const struct buffer_head **) a;
+	const struct buffer_head *y = *(const struct buffer_head **) b;
 	
-	// error occured
-	if (!bh)
+	if (x->b_blocknr < y->b_blocknr)
 		return -1;
 	
-	bat = (uint32_t*)( (uint8_t*) bh->b_data + kO);
+	return x->b_blocknr > y->b_blocknr;
+}
+
+
+
+/*
+ * The buffer_heads a bio of a batch carries. Buffers of the same page share
+ * a bvec when the kernel blocks are smaller than a page, so they are counted
+ * here, not by the bio.
+ */
+struct ash_wbatch_bio {
+	int			nr;
+	int			max;
+	struct buffer_head	*bhs[0];
+};
+
+
+
+/*
+ * Completion for a bio made of several buffer_heads of a batch
+ */
+static void ash_wbatch_end_io (struct bio *bio, int err)
+{
+	struct ash_wbatch_bio *wbio = bio->bi_private;
+	int uptodate = bio_flagged(bio, BIO_UPTODATE);
+	int i;
 	
-	brelse(bh);
+	// same as if each buffer_head had been sent on its own by submit_bh
+	for (i = 0; i < wbio->nr; i++)
+		end_buffer_write_sync(wbio->bhs[i], uptodate);
 	
-	return bat[0];
+	kfree(wbio);
+	bio_put(bio);
 }
 
 
 
 /*
- * Write the number of the entry for the block in the BAT
- * @return 0 on success
+ * Sends a bio built from the locked buffer_heads in wbio
  */
-int BAT_write (struct super_block *sb, uint32_t block, uint32_t entry)
+static void ash_wbatch_submit (struct bio *bio, struct ash_wbatch_bio *wbio)
 {
+	bio->bi_private = wbio;
+	bio->bi_end_io = ash_wbatch_end_io;
+	submit_bio(WRITE, bio);
+}
 
-	struct ash_raw_superblock *rsb;
-	uint32_t lB, lO, kB, kO;
-	uint64_t off;
-	struct buffer_head *bh;
-	uint32_t *bat;
+
+
+/*
+ * Writes out the blocks gathered in the batch. The buffer_heads are sorted by
+ * their place on the device and runs of neighbouring ones go out in one bio,
+ * so the disk sees a few large writes instead of many small scattered ones.
+ * Everything is queued before the queue gets unplugged, once.
+ * Buffers that were already cleaned by the generic writeback are skipped.
+ * @return 0 on success, -EIO if waiting and a write failed
+ */
+int ash_wbatch_flush (struct super_block *sb, struct ash_wbatch *wb, int wait)
+{
+	struct buffer_head *bh, *prev;
+	struct ash_wbatch_bio *wbio;
+	struct bio *bio;
+	int i, max, nr_vecs, err;
 	
-	// obtain a point to the ash_raw_superblock structure
-	rsb = sb->s_fs_info;
+	mutex_lock(&wb->lock);
 	
-	// get the logical block which holds the entry in the BAT
-	// got the block parameter
-	lB = rsb->BATstart + (block >> (sb->s_blocksize - 2));
-	lO = (block << 2) & (sb->s_blocksize - 1);
+	if (wb->nr == 0) {
+		mutex_unlock(&wb->lock);
+		return 0;
+	}
 	
-	// kernel block to read in order to get the byte from lB, lO
-	off = ( lB << sb->s_blocksize_bits ) + lO;
-	kB = off >> KERNEL_BLOCKBITS;
-	kO = off & (KERNEL_BLOCKSIZE - 1);
+	sort(wb->bhs, wb->nr, sizeof(*wb->bhs), ash_bh_cmp, NULL);
 	
-	// read the block from disk
-	bh = __getblk(sb->s_bdev, kB, KERNEL_BLOCKSIZE);
+	nr_vecs = bio_get_nr_vecs(sb->s_bdev);
+	bio = NULL;
+	wbio = NULL;
+	prev = NULL;
 	
-	// error occured
-	if (!bh)
-		return -1;
+	for (i = 0; i < wb->nr; i++) {
+		bh = wb->bhs[i];
+		
+		// the same block may have been added more than once
+		if (bh == prev)
+			continue;
+		
+		lock_buffer(bh);
+		
+		if (!test_clear_buffer_dirty(bh)) {
+			unlock_buffer(bh);
+			continue;
+		}
+		
+		// the reference is dropped by end_buffer_write_sync
+		get_bh(bh);
+		
+		// end the current bio if this block doesn't follow the previous one
+		if (bio && (!prev || bh->b_blocknr != prev->b_blocknr + 1 || wbio->nr == wbio->max ||
+				bio_add_page(bio, bh->b_page, bh->b_size, bh_offset(bh)) < bh->b_size)) {
+			ash_wbatch_submit(bio, wbio);
+			bio = NULL;
+		}
+		
+		if (!bio) {
+			// as many buffers as the bvecs can hold, a page's worth each
+			max = min_t(int, wb->nr - i, nr_vecs * (PAGE_CACHE_SIZE / bh->b_size));
+	
+			bio = bio_alloc(GFP_NOFS, nr_vecs);
+			wbio = kmalloc(sizeof(*wbio) + max * sizeof(wbio->bhs[0]), GFP_NOFS);
+	
+			if (!bio || !wbio) {
+				if (bio)
+					bio_put(bio);
+				kfree(wbio);
+				bio = NULL;
+				
+				// no memory for merging, let this one go on its own
+				bh->b_end_io = end_buffer_write_sync;
+				submit_bh(WRITE, bh);
+				prev = NULL;
+				continue;
+			}
+			
+			bio->bi_bdev = bh->b_bdev;
+			bio->bi_sector = bh->b_blocknr * (bh->b_size >> ASH_SECTORBITS);
+			bio_add_page(bio, bh->b_page, bh->b_size, bh_offset(bh));
+			wbio->nr = 0;
+			wbio->max = max;
+		}
 	
-	bat = (uint32_t*)( (uint8_t*) bh->b_data + kO);
-	bat[0] = entry;
+		wbio->bhs[wbio->nr++] = bh;
+		prev = bh;
+	}
 	
-	mark_buffer_dirty(bh);
-	brelse(bh);
+	if (bio)
+		ash_wbatch_submit(bio, wbio);
 	
-	return 0;
+	// everything is queued, let the disk have it
+	blk_run_address_space(sb->s_bdev->bd_inode->i_mapping);
+	
+	err = 0;
+	
+	for (i = 0; i < wb->nr; i++) {
+		if (wait) {
+			wait_on_buffer(wb->bhs[i]);
+			
+			if (!buffer_uptodate(wb->bhs[i]))
+				err = -EIO;
+		}
+		
+		brelse(wb->bhs[i]);
+	}
+	
+	wb->nr = 0;
+	
+	mutex_unlock(&wb->lock);
+	
+	return err;
+}
+
+
+
+/*
+ * Writes a block that belongs to an inode (its data or one of its dir entries).
+ * The block is dirtied in the buffer cache and gathered in the inode's batch,
+ * which ash_wbatch_flush sends out together on fsync.
+ * @return 0 on success
+ */
+int block_write_inode (struct inode *inode, void *data, uint32_t block)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ash_bview view;
+	int err;
+	
+	err = ash_bget_new(sb, block, &view);
+	if (err)
+		return err;
+	
+	ash_bview_copy(&view, 0, data, ASH_SB(sb)->blocksize, ASH_BVIEW_WRITE);
+	ash_bdirty(&view);
+	
+	err = ash_wbatch_add(&ASH_I(inode)->wb, &view);
+	ash_bput(&view);
+	
+	return err;
 }
 
 
@@ -541,7 +1213,7 @@ static int ash_get_sb(struct file_system_type *fs,
 		int flags, const char *dev_name,
 		void *data, struct vfsmount *mnt)
 {
-	return get_sb_nodev(fs, flags, data, myfs_fill_super, mnt);
+	return get_sb_bdev(fs, flags, dev_name, data, ash_fill_super, mnt);
 }
 
 
@@ -555,7 +1227,8 @@ static struct file_system_type ash_fs_type = {
 	.owner		= THIS_MODULE,
 	.name 		= "ash",
 	.get_sb 	= ash_get_sb,
-	.kill_sb	= kill_litter_super,
+	.kill_sb	= ash_kill_sb,
+	.fs_flags	= FS_REQUIRES_DEV,
 };
 
 
@@ -563,7 +1236,7 @@ static int __init init_ash_fs(void)
 {
 	uint8_t *key = (uint8_t*) kmalloc (16, GFP_KERNEL);
 	uint8_t *src = (uint8_t*) kmalloc (16, GFP_KERNEL);
-	int i;
+	int i, err;
 	
 	key[0] = 0x00;
 	key[1] = 0x01;
@@ -620,12 +1293,41 @@ static int __init init_ash_fs(void)
 	kfree(key);
 	kfree(src);
 	
-	return register_filesystem(&ash_fs_type);
+	ash_inode_cachep = kmem_cache_create("ash_inode_cache", sizeof(struct ash_inode_info), 0,
+			SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD, ash_init_once);
+	if (!ash_inode_cachep)
+		return -ENOMEM;
+	
+	// the VM counts and writes back the dirty pages of Ash files
+	err = bdi_init(&ash_backing_dev_info);
+	if (err)
+		goto out_cache;
+	
+	err = register_filesystem(&ash_fs_type);
+	if (err)
+		goto out_bdi;
+	
+	ash_proc_root = proc_mkdir("fs/ash", NULL);
+	
+	return 0;
+	
+out_bdi:
+	bdi_destroy(&ash_backing_dev_info);
+out_cache:
+	kmem_cache_destroy(ash_inode_cachep);
+	
+	return err;
 }
 
 static void __exit exit_ash_fs(void)
 {
 	unregister_filesystem(&ash_fs_type);
+	
+	if (ash_proc_root)
+		remove_proc_entry("fs/ash", NULL);
+	
+	bdi_destroy(&ash_backing_dev_info);
+	kmem_cache_destroy(ash_inode_cachep);
 }
 
 module_init(init_ash_fs);
@@ -0,0 +1,935 @@
+/*
+ * Ash File System
+ *
+ * Used Blocks Bitmap. It is read once at mount and kept in memory as a
+ * regular kernel bitmap, so free blocks are searched a word at a time.
+ * Changes are written back to the disk on sync, for the range of
+ * blocks that changed since the last one.
+ *
+ * On the disk, byte b of the UBB holds blocks 8b..8b+7, the first one in the
+ * most significant bit. In memory, block n is bit n of the bitmap.
+ *
+ * The free blocks are also indexed as runs (free extents) in two rbtrees:
+ * one by start, to merge and split runs, and one by length, to find the run
+ * that fits an allocation best. Only the bitmap goes to the disk, the index
+ * is rebuilt from it at mount, and again while mounted if a run could not
+ * get a node of its own.
+ *
+ * With a journal, blocks freed in the running transaction are free in the
+ * bitmap at once, but only go into the index once it is committed: until
+ * then the metadata on the disk may still point to them, and they must not
+ * be written as the data of another file.
+ *
+ * For licensing information, see the file 'LICENSE'
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/bitops.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/backing-dev.h>
+#include "ash.h"
+
+
+/*
+ * A run of free blocks, linked in both trees of the free extent index
+ */
+struct ash_fext {
+	struct rb_node		by_start;
+	struct rb_node		by_len;
+	uint32_t		start;
+	uint32_t		len;
+};
+
+
+/*
+ * A run of blocks freed in the running transaction
+ */
+struct ash_frun {
+	uint32_t		start;
+	uint32_t		len;
+};
+
+
+/*
+ * Reverses the bits of a byte, to go between the disk and the memory bit order
+ */
+static inline uint8_t ash_bitrev8 (uint8_t b)
+{
+	b = (b >> 4) | (b << 4);
+	b = ((b & 0xCC) >> 2) | ((b & 0x33) << 2);
+	b = ((b & 0xAA) >> 1) | ((b & 0x55) << 1);
+	
+	return b;
+}
+
+
+
+/*
+ * Byte of the in memory bitmap holding blocks 8i..8i+7, in the disk bit order
+ */
+static inline uint8_t ash_ubb_get_byte (unsigned long *ubb, uint32_t i)
+{
+	int shift = (i % sizeof(long)) << 3;
+	
+	return ash_bitrev8(ubb[i / sizeof(long)] >> shift);
+}
+
+
+
+/*
+ * Puts a byte read from the disk into the in memory bitmap
+ */
+static inline void ash_ubb_set_byte (unsigned long *ubb, uint32_t i, uint8_t byte)
+{
+	int shift = (i % sizeof(long)) << 3;
+	
+	ubb[i / sizeof(long)] &= ~(0xFFUL << shift);
+	ubb[i / sizeof(long)] |= (unsigned long) ash_bitrev8(byte) << shift;
+}
+
+
+
+/*
+ * Links a free extent into both trees
+ */
+static void ash_fext_link (struct ash_sb_info *sbi, struct ash_fext *fe)
+{
+	struct rb_node **p, *parent;
+	struct ash_fext *x;
+	
+	p = &sbi->fext_start.rb_node;
+	parent = NULL;
+	
+	while (*p) {
+		parent = *p;
+		x = rb_entry(parent, struct ash_fext, by_start);
+		
+		if (fe->start < x->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	
+	rb_link_node(&fe->by_start, parent, p);
+	rb_insert_color(&fe->by_start, &sbi->fext_start);
+	
+	// by length, then by start so runs of the same length keep an order
+	p = &sbi->fext_len.rb_node;
+	parent = NULL;
+	
+	while (*p) {
+		parent = *p;
+		x = rb_entry(parent, struct ash_fext, by_len);
+		
+		if (fe->len < x->len || (fe->len == x->len && fe->start < x->start))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	
+	rb_link_node(&fe->by_len, parent, p);
+	rb_insert_color(&fe->by_len, &sbi->fext_len);
+}
+
+
+
+/*
+ * Takes a free extent out of both trees
+ */
+static void ash_fext_unlink (struct ash_sb_info *sbi, struct ash_fext *fe)
+{
+	rb_erase(&fe->by_start, &sbi->fext_start);
+	rb_erase(&fe->by_len, &sbi->fext_len);
+}
+
+
+
+/*
+ * Finds the last free extent starting at or before block
+ * @return the extent, or NULL if there is none
+ */
+static struct ash_fext* ash_fext_before (struct ash_sb_info *sbi, uint32_t block)
+{
+	struct rb_node *n = sbi->fext_start.rb_node;
+	struct ash_fext *fe, *best = NULL;
+	
+	while (n) {
+		fe = rb_entry(n, struct ash_fext, by_start);
+		
+		if (fe->start <= block) {
+			best = fe;
+			n = n->rb_right;
+		} else
+			n = n->rb_left;
+	}
+	
+	return best;
+}
+
+
+
+/*
+ * Finds the shortest free extent that has at least len blocks
+ * @return the extent, or NULL if all of them are shorter
+ */
+static struct ash_fext* ash_fext_fit (struct ash_sb_info *sbi, uint32_t len)
+{
+	struct rb_node *n = sbi->fext_len.rb_node;
+	struct ash_fext *fe, *best = NULL;
+	
+	while (n) {
+		fe = rb_entry(n, struct ash_fext, by_len);
+		
+		if (fe->len >= len) {
+			best = fe;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+	
+	return best;
+}
+
+
+
+/*
+ * Adds the free run [start, start + len) to the index, merging it with the
+ * runs that end right before it and start right after it.
+ * A new node is taken from *spare if there is one there.
+ */
+static void ash_fext_add (struct ash_sb_info *sbi, uint32_t start, uint32_t len, struct ash_fext **spare)
+{
+	struct ash_fext *fe, *next;
+	
+	fe = ash_fext_before(sbi, start);
+	
+	if (fe && fe->start + fe->len == start) {
+		ash_fext_unlink(sbi, fe);
+		fe->len += len;
+	} else {
+		if (spare && *spare) {
+			fe = *spare;
+			*spare = NULL;
+		} else
+			fe = kmalloc(sizeof(*fe), GFP_ATOMIC);
+	
+		// the blocks stay free in the bitmap, the index gets them back
+		// when it is rebuilt
+		if (!fe) {
+			sbi->fext_stale = 1;
+			return;
+		}
+	
+		fe->start = start;
+		fe->len = len;
+	}
+	
+	next = ash_fext_before(sbi, fe->start + fe->len);
+	
+	if (next && next != fe && next->start == fe->start + fe->len) {
+		ash_fext_unlink(sbi, next);
+		fe->len += next->len;
+		kfree(next);
+	}
+	
+	ash_fext_link(sbi, fe);
+}
+
+
+
+/*
+ * Takes [start, start + len) out of the free extent fe, which must hold it
+ */
+static void ash_fext_take (struct ash_sb_info *sbi, struct ash_fext *fe, uint32_t start, uint32_t len)
+{
+	struct ash_fext *right;
+	uint32_t end;
+	
+	end = fe->start + fe->len;
+	ash_fext_unlink(sbi, fe);
+	
+	// what is left after the taken blocks
+	if (start + len < end) {
+		right = kmalloc(sizeof(*right), GFP_ATOMIC);
+		
+		if (right) {
+			right->start = start + len;
+			right->len = end - right->start;
+			ash_fext_link(sbi, right);
+		} else
+			sbi->fext_stale = 1;
+	}
+	
+	// what is left before them
+	if (start > fe->start) {
+		fe->len = start - fe->start;
+		ash_fext_link(sbi, fe);
+	} else
+		kfree(fe);
+}
+
+
+
+/*
+ * Builds the free extent index from the in memory bitmap
+ */
+static void ash_fext_build (struct ash_sb_info *sbi)
+{
+	uint32_t max, start, end;
+	
+	sbi->fext_start = RB_ROOT;
+	sbi->fext_len = RB_ROOT;
+	sbi->fext_stale = 0;
+	
+	max = sbi->raw.maxblocks;
+	start = find_next_zero_bit(sbi->ubb, max, 0);
+	
+	while (start < max) {
+		end = find_next_bit(sbi->ubb, max, start);
+	
+		ash_fext_add(sbi, start, end - start, NULL);
+	
+		start = find_next_zero_bit(sbi->ubb, max, end);
+	}
+}
+
+
+
+/*
+ * Counts the free blocks of the in memory bitmap, a word at a time.
+ * Only needed when the superblock's count can't be trusted.
+ * @return the number of free blocks
+ */
+static uint32_t ash_ubb_count (struct ash_sb_info *sbi)
+{
+	uint32_t max = sbi->raw.maxblocks;
+	uint32_t i, used = 0;
+	
+	for (i = 0; i < max / BITS_PER_LONG; i++)
+		used += hweight_long(sbi->ubb[i]);
+	
+	// the bits past the last block don't count
+	if (max % BITS_PER_LONG)
+		used += hweight_long(sbi->ubb[i] & ((1UL << (max % BITS_PER_LONG)) - 1));
+	
+	return max - used;
+}
+
+
+
+/*
+ * Drops the whole free extent index
+ */
+static void ash_fext_destroy (struct ash_sb_info *sbi)
+{
+	struct rb_node *n;
+	struct ash_fext *fe;
+	
+	while ((n = rb_first(&sbi->fext_start))) {
+		fe = rb_entry(n, struct ash_fext, by_start);
+		ash_fext_unlink(sbi, fe);
+		kfree(fe);
+	}
+}
+
+
+
+/*
+ * Builds the free extent index again while mounted, without the runs
+ * waiting for the running transaction to commit
+ */
+static void ash_fext_rebuild (struct ash_sb_info *sbi)
+{
+	struct ash_fext *fe;
+	struct ash_frun *run;
+	uint32_t i;
+	
+	ash_fext_destroy(sbi);
+	ash_fext_build(sbi);
+	
+	for (i = 0; i < sbi->fext_pend_nr; i++) {
+		run = &sbi->fext_pend[i];
+		fe = ash_fext_before(sbi, run->start);
+	
+		if (fe && run->start + run->len <= fe->start + fe->len)
+			ash_fext_take(sbi, fe, run->start, run->len);
+	}
+}
+
+
+
+/*
+ * Remembers that the bits of blocks [lo, hi] changed since the last sync,
+ * by the UBB blocks holding them. Called with ubb_lock held.
+ */
+static inline void ash_ubb_touch (struct ash_sb_info *sbi, uint32_t lo, uint32_t hi)
+{
+	uint32_t b;
+	
+	for (b = lo >> (sbi->blockbits + 3); b <= hi >> (sbi->blockbits + 3); b++)
+		__set_bit(b, sbi->ubb_dirty);
+}
+
+
+
+/*
+ * Reads the whole UBB from the disk into memory
+ * @return 0 on success
+ */
+int ash_ubb_load (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_bview view;
+	uint32_t i, j, byte, bytes, len;
+	uint8_t *buf;
+	
+	sbi->ubb = vmalloc(BITS_TO_LONGS(sbi->raw.maxblocks) * sizeof(long));
+	if (!sbi->ubb)
+		return -ENOMEM;
+	
+	memset(sbi->ubb, 0, BITS_TO_LONGS(sbi->raw.maxblocks) * sizeof(long));
+	
+	sbi->ubb_dirty = kzalloc(BITS_TO_LONGS(sbi->raw.UBBblocks) * sizeof(long), GFP_KERNEL);
+	buf = kmalloc(sbi->blocksize, GFP_KERNEL);
+	if (!sbi->ubb_dirty || !buf) {
+		kfree(buf);
+		ash_ubb_free(sb);
+		return -ENOMEM;
+	}
+	
+	spin_lock_init(&sbi->ubb_lock);
+	sbi->ubb_cursor = sbi->raw.datastart;
+	
+	// bytes of UBB that hold bits for existing blocks
+	bytes = (sbi->raw.maxblocks + 7) >> 3;
+	byte = 0;
+	
+	for (i = 0; i < sbi->raw.UBBblocks && byte < bytes; i++) {
+		
+		if (ash_bget(sb, sbi->raw.UBBstart + i, &view)) {
+			printk(KERN_ERR "cannot read the UBB\n");
+			kfree(buf);
+			ash_ubb_free(sb);
+			return -EIO;
+		}
+		
+		len = min_t(uint32_t, sbi->blocksize, bytes - byte);
+		ash_bview_copy(&view, 0, buf, len, ASH_BVIEW_READ);
+		ash_bput(&view);
+		
+		for (j = 0; j < len; j++, byte++)
+			ash_ubb_set_byte(sbi->ubb, byte, buf[j]);
+	}
+	
+	kfree(buf);
+	
+	ash_fext_build(sbi);
+	sbi->resv_blocks = 0;
+	
+	// the allocator keeps the count from here on; a clean umount left it
+	// in the superblock, after a crash it has to be counted again
+	if (sbi->raw.vers >= 13 && sbi->raw.state == ASH_UMOUNT && sbi->raw.free_blocks <= sbi->raw.maxblocks)
+		sbi->free_blocks = sbi->raw.free_blocks;
+	else
+		sbi->free_blocks = ash_ubb_count(sbi);
+	
+	return 0;
+}
+
+
+
+/*
+ * Writes back to the disk the UBB blocks changed since the last sync
+ * @return 0 on success
+ */
+int ash_ubb_sync (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_bview view;
+	uint32_t i, byte, end, bytes, lO;
+	uint8_t *p;
+	int dirty;
+	
+	bytes = (sbi->raw.maxblocks + 7) >> 3;
+	
+	for (i = 0; i < sbi->raw.UBBblocks; i++) {
+		spin_lock(&sbi->ubb_lock);
+		dirty = __test_and_clear_bit(i, sbi->ubb_dirty);
+		spin_unlock(&sbi->ubb_lock);
+	
+		if (!dirty)
+			continue;
+	
+		if (ash_bget(sb, sbi->raw.UBBstart + i, &view)) {
+			// try again next time
+			spin_lock(&sbi->ubb_lock);
+			__set_bit(i, sbi->ubb_dirty);
+			spin_unlock(&sbi->ubb_lock);
+			return -EIO;
+		}
+	
+		byte = i << sbi->blockbits;
+		end = min_t(uint32_t, bytes, byte + sbi->blocksize);
+	
+		spin_lock(&sbi->ubb_lock);
+	
+		for (lO = 0; byte < end; lO++, byte++) {
+			p = ash_bptr(&view, lO, 1, NULL);
+			*p = ash_ubb_get_byte(sbi->ubb, byte);
+		}
+		
+		spin_unlock(&sbi->ubb_lock);
+		
+		ash_bdirty(&view);
+		ash_bput(&view);
+	}
+	
+	return 0;
+}
+
+
+
+/*
+ * Counts the UBB blocks changed since the last sync, which the next one writes
+ */
+uint32_t ash_ubb_dirty_blocks (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	uint32_t n;
+	
+	if (!sbi->ubb_dirty)
+		return 0;
+	
+	spin_lock(&sbi->ubb_lock);
+	n = bitmap_weight(sbi->ubb_dirty, sbi->raw.UBBblocks);
+	spin_unlock(&sbi->ubb_lock);
+	
+	return n;
+}
+
+
+
+/*
+ * Frees the in memory UBB
+ */
+void ash_ubb_free (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	
+	if (sbi->ubb)
+		ash_fext_destroy(sbi);
+	
+	vfree(sbi->ubb);
+	sbi->ubb = NULL;
+	kfree(sbi->ubb_dirty);
+	sbi->ubb_dirty = NULL;
+	vfree(sbi->fext_pend);
+	sbi->fext_pend = NULL;
+	sbi->fext_pend_nr = sbi->fext_pend_max = 0;
+}
+
+
+
+/*
+ * Returns the first block that is available for use, looking from where the
+ * last search stopped and wrapping around to the start of the bitmap.
+ * The block is not marked as used, UBB_write does that.
+ * @return block index, or 0 if the disk is full
+ */
+int block_first_free(struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	uint32_t max, block;
+	
+	max = sbi->raw.maxblocks;
+	
+	spin_lock(&sbi->ubb_lock);
+	
+	block = find_next_zero_bit(sbi->ubb, max, sbi->ubb_cursor);
+	
+	if (block >= max) {
+		block = find_next_zero_bit(sbi->ubb, sbi->ubb_cursor, 0);
+		
+		// nothing free (block 0 is the superblock, never free)
+		if (block >= sbi->ubb_cursor)
+			block = 0;
+	}
+	
+	if (block)
+		sbi->ubb_cursor = block;
+	
+	spin_unlock(&sbi->ubb_lock);
+	
+	return block;
+}
+
+
+
+/*
+ * Reads what value a block has in the Used Blocks Bitmap
+ * @return 0 (unused), 1 (used) or -1 in case of error
+ */
+int UBB_read (struct super_block *sb, uint32_t block)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	
+	if (block >= sbi->raw.maxblocks)
+		return -1;
+	
+	return test_bit(block, sbi->ubb) ? 1 : 0;
+}
+
+
+
+/*
+ * Writes the value val for a block in Used Blocks Bitmap zone.
+ * Only the memory bitmap (and the free extent index) is changed,
+ * ash_ubb_sync writes it to the disk.
+ * @return 0 on success
+ */
+int UBB_write (struct super_block *sb, uint32_t block, uint8_t val)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_fext *fe;
+	
+	if (block >= sbi->raw.maxblocks)
+		return -1;
+	
+	// with a journal, it waits for the commit
+	if (val == 0) {
+		ash_free_run(sb, block, 1);
+		return 0;
+	}
+	
+	spin_lock(&sbi->ubb_lock);
+	
+	// only a change of value touches the index
+	if (!__test_and_set_bit(block, sbi->ubb)) {
+		fe = ash_fext_before(sbi, block);
+		if (fe && block < fe->start + fe->len)
+			ash_fext_take(sbi, fe, block, 1);
+		sbi->free_blocks--;
+	}
+	
+	ash_ubb_touch(sbi, block, block);
+	
+	spin_unlock(&sbi->ubb_lock);
+	
+	return 0;
+}
+
+
+
+/*
+ * Allocates up to want blocks that follow each other on the disk.
+ * If goal is free, the run starts there, so a file keeps growing in place.
+ * Otherwise it is the start of the shortest run that holds want blocks, or of
+ * the longest run there is if none does: the caller asks again for the rest.
+ * Called with ubb_lock held.
+ * @return number of blocks allocated from *start, or -ENOSPC
+ */
+static int __ash_alloc_run (struct ash_sb_info *sbi, uint32_t goal, uint32_t want, uint32_t *start)
+{
+	struct ash_fext *fe;
+	struct rb_node *n;
+	uint32_t b, len;
+	
+	// some free runs are only in the bitmap
+	if (sbi->fext_stale)
+		ash_fext_rebuild(sbi);
+	
+	fe = goal ? ash_fext_before(sbi, goal) : NULL;
+	
+	if (fe && goal < fe->start + fe->len) {
+		*start = goal;
+		len = min(want, fe->start + fe->len - goal);
+	} else {
+		fe = ash_fext_fit(sbi, want);
+		
+		if (!fe) {
+			n = rb_last(&sbi->fext_len);
+	
+			if (!n)
+				return -ENOSPC;
+	
+			fe = rb_entry(n, struct ash_fext, by_len);
+		}
+		
+		*start = fe->start;
+		len = min(want, fe->len);
+	}
+	
+	ash_fext_take(sbi, fe, *start, len);
+	
+	for (b = *start; b < *start + len; b++)
+		__set_bit(b, sbi->ubb);
+	
+	sbi->free_blocks -= len;
+	sbi->ubb_cursor = *start + len;
+	ash_ubb_touch(sbi, *start, *start + len - 1);
+	
+	return len;
+}
+
+
+
+/*
+ * Allocates up to want blocks that follow each other on the disk (see
+ * __ash_alloc_run), out of those not promised to delayed writes
+ * @return number of blocks allocated from *start, or -ENOSPC
+ */
+int ash_alloc_run (struct super_block *sb, uint32_t goal, uint32_t want, uint32_t *start)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	int len = -ENOSPC;
+	
+	if (want == 0)
+		return 0;
+	
+	spin_lock(&sbi->ubb_lock);
+	
+	want = min(want, ash_avail_blocks(sbi));
+	if (want)
+		len = __ash_alloc_run(sbi, goal, want, start);
+	
+	spin_unlock(&sbi->ubb_lock);
+	
+	return len;
+}
+
+
+
+/*
+ * Allocates up to want blocks that follow each other on the disk (see
+ * __ash_alloc_run), out of those ash_reserve_blocks promised before.
+ * The blocks allocated are no longer reserved.
+ * @return number of blocks allocated from *start, or -ENOSPC
+ */
+int ash_alloc_reserved (struct super_block *sb, uint32_t goal, uint32_t want, uint32_t *start)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	int len;
+	
+	if (want == 0)
+		return 0;
+	
+	spin_lock(&sbi->ubb_lock);
+	
+	len = __ash_alloc_run(sbi, goal, want, start);
+	if (len > 0)
+		sbi->resv_blocks -= min_t(uint32_t, len, sbi->resv_blocks);
+	
+	spin_unlock(&sbi->ubb_lock);
+	
+	return len;
+}
+
+
+
+/*
+ * Makes room in fext_pend for the runs of used blocks in [start, end), which
+ * are about to be freed; waits for the memory if it has to.
+ * Called with ubb_lock held, which is dropped meanwhile.
+ */
+static void ash_pend_room (struct ash_sb_info *sbi, uint32_t start, uint32_t end)
+{
+	struct ash_frun *runs, *old;
+	uint32_t b, n, max;
+	
+	for (;;) {
+		n = 0;
+		for (b = find_next_bit(sbi->ubb, end, start); b < end;
+				b = find_next_bit(sbi->ubb, end, find_next_zero_bit(sbi->ubb, end, b)))
+			n++;
+	
+		if (sbi->fext_pend_nr + n <= sbi->fext_pend_max)
+			return;
+	
+		max = max(sbi->fext_pend_max << 1, sbi->fext_pend_nr + n);
+		max = max(max, 64U);
+		spin_unlock(&sbi->ubb_lock);
+	
+		while (!(runs = vmalloc(max * sizeof(*runs))))
+			congestion_wait(WRITE, HZ / 50);
+	
+		spin_lock(&sbi->ubb_lock);
+	
+		// somebody else made room meanwhile
+		if (max <= sbi->fext_pend_max) {
+			vfree(runs);
+			continue;
+		}
+	
+		memcpy(runs, sbi->fext_pend, sbi->fext_pend_nr * sizeof(*runs));
+		old = sbi->fext_pend;
+		sbi->fext_pend = runs;
+		sbi->fext_pend_max = max;
+		vfree(old);
+	}
+}
+
+
+
+/*
+ * Keeps a freed run out of the index until the running transaction commits.
+ * ash_pend_room made room for it. Called with ubb_lock held.
+ */
+static void ash_pend_add (struct ash_sb_info *sbi, uint32_t start, uint32_t len)
+{
+	struct ash_frun *last = sbi->fext_pend_nr ? &sbi->fext_pend[sbi->fext_pend_nr - 1] : NULL;
+	
+	if (last && last->start + last->len == start)
+		last->len += len;
+	else {
+		sbi->fext_pend[sbi->fext_pend_nr].start = start;
+		sbi->fext_pend[sbi->fext_pend_nr].len = len;
+		sbi->fext_pend_nr++;
+	}
+	
+	sbi->pend_blocks += len;
+}
+
+
+
+/*
+ * Gives the allocator the blocks freed in the transaction that was just
+ * committed: nothing on the disk points to them any more
+ */
+void ash_ubb_committed (struct super_block *sb)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	uint32_t i;
+	
+	spin_lock(&sbi->ubb_lock);
+	
+	for (i = 0; i < sbi->fext_pend_nr; i++)
+		ash_fext_add(sbi, sbi->fext_pend[i].start, sbi->fext_pend[i].len, NULL);
+	
+	sbi->fext_pend_nr = 0;
+	sbi->pend_blocks = 0;
+	
+	spin_unlock(&sbi->ubb_lock);
+}
+
+
+
+/*
+ * Marks len blocks starting with start as free again.
+ * Each run of them that was used goes into the index at once, or with a
+ * journal once the running transaction commits.
+ * @param reserve	also reserve again the blocks freed, for an
+ *			allocation from ash_alloc_reserved that is undone;
+ *			nothing points to these, they go into the index at once
+ */
+static void __ash_free_run (struct super_block *sb, uint32_t start, uint32_t len, int reserve)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	struct ash_fext *spare;
+	uint32_t b, e, end;
+	int pend;
+	
+	if (len == 0 || start + len > sbi->raw.maxblocks || start + len < start)
+		return;
+	
+	pend = sbi->journal && !reserve;
+	
+	// the node the run will most likely need, while sleeping is allowed
+	spare = pend ? NULL : kmalloc(sizeof(*spare), GFP_NOFS);
+	end = start + len;
+	
+	spin_lock(&sbi->ubb_lock);
+	
+	if (pend)
+		ash_pend_room(sbi, start, end);
+	
+	// blocks free already are in the index, skip them
+	b = find_next_bit(sbi->ubb, end, start);
+	
+	while (b < end) {
+		e = find_next_zero_bit(sbi->ubb, end, b);
+	
+		if (pend)
+			ash_pend_add(sbi, b, e - b);
+		else
+			ash_fext_add(sbi, b, e - b, &spare);
+		sbi->free_blocks += e - b;
+	
+		if (reserve)
+			sbi->resv_blocks += e - b;
+	
+		for (; b < e; b++)
+			__clear_bit(b, sbi->ubb);
+	
+		b = find_next_bit(sbi->ubb, end, e);
+	}
+	
+	ash_ubb_touch(sbi, start, end - 1);
+	
+	spin_unlock(&sbi->ubb_lock);
+	
+	kfree(spare);
+}
+
+
+
+/*
+ * Marks len blocks starting with start as free again
+ */
+void ash_free_run (struct super_block *sb, uint32_t start, uint32_t len)
+{
+	__ash_free_run(sb, start, len, 0);
+}
+
+
+
+/*
+ * Gives back blocks from ash_alloc_reserved that could not be used,
+ * reserved again for the write they were promised to
+ */
+void ash_free_reserved (struct super_block *sb, uint32_t start, uint32_t len)
+{
+	__ash_free_run(sb, start, len, 1);
+}
+
+
+
+/*
+ * Promises count free blocks to a write whose blocks are only chosen at
+ * writeback (see ash_alloc_delayed). Nothing changes in the bitmap.
+ * @return 0 on success, -ENOSPC if the free blocks are all promised
+ */
+int ash_reserve_blocks (struct super_block *sb, uint32_t count)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	int err = 0;
+	
+	spin_lock(&sbi->ubb_lock);
+	
+	if (ash_avail_blocks(sbi) < count)
+		err = -ENOSPC;
+	else
+		sbi->resv_blocks += count;
+	
+	spin_unlock(&sbi->ubb_lock);
+	
+	return err;
+}
+
+
+
+/*
+ * Gives back count reserved blocks, once they are allocated or
+ * when the data they were for is dropped
+ */
+void ash_release_blocks (struct super_block *sb, uint32_t count)
+{
+	struct ash_sb_info *sbi = ASH_SB(sb);
+	
+	spin_lock(&sbi->ubb_lock);
+	sbi->resv_blocks -= min(count, sbi->resv_blocks);
+	spin_unlock(&sbi->ubb_lock);
+}
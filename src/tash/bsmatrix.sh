@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Runs the tash speed tests on the device formatted with each Ash block size
+# and leaves a result file per block size: resultash_<bsize>.txt
+#
+# usage: ./bsmatrix.sh <dev> <inputfile>
+# (the first line of inputfile must point inside /mnt, see testusb.txt)
+#
+
+if [ $# -ne 2 ]; then
+	echo "usage: $0 <dev> <inputfile>"
+	exit 1
+fi
+
+DEV=$1
+INPUT=$2
+
+insmod ../ash/ash.ko || exit 1
+
+for BSIZE in 512 1024 2048 4096 8192; do
+	echo "block size $BSIZE"
+	
+	../tools/ashformat $DEV -b $BSIZE > /dev/null || break
+	mount -t ash $DEV /mnt || break
+	
+	./tash $INPUT resultash_$BSIZE.txt
+	
+	umount /mnt
+done
+
+rmmod ash
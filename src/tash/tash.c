@@ -13,6 +13,9 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 
 /*
@@ -180,15 +183,161 @@ struct timeresult SpeedTest (char *filename, size_t size, int times) {
 }
 
 
+/*
+ * Runs a readdir test on a directory with entries files:
+ * - creates the directory and the empty files in it
+ *
+ * - opens the directory				<--- timestamp
+ * - reads all of it, as ls would
+ * - closes the directory				<--- timestamp
+ *
+ * - erases the files and the directory
+ *
+ * The listing is done times times, and its average time is returned in microseconds.
+ * A negative value means the test failed.
+ */
+double ReaddirTest (char *dirname, int entries, int times) {
+	struct timeval start, stop, time;
+	struct dirent *de;
+	char *path;
+	double avg;
+	DIR *d;
+	int f, i, n;
+	
+	path = malloc(strlen(dirname) + 32);
+	if (!path)
+		return -1;
+	
+	if (mkdir(dirname, 0755) < 0) {
+		printf("mkdir error for '%s'\n", dirname);
+		free(path);
+		return -1;
+	}
+	
+	for (i = 0; i < entries; i++) {
+		sprintf(path, "%s/tash%07d", dirname, i);
+		
+		f = open(path, O_CREAT | O_RDWR, 0644);
+		if (f < 0) {
+			printf("open error for '%s'\n", path);
+			entries = i;
+			avg = -1;
+			goto out;
+		}
+		
+		close(f);
+	}
+	
+	// need to divide each test's time by times to get average
+	avg = 0;
+	
+	for (i = 0; i < times; i++) {
+		
+		// timestamp of start test
+		gettimeofday(&start, NULL);
+		
+		d = opendir(dirname);
+		if (!d) {
+			printf("opendir error for '%s'\n", dirname);
+			avg = -1;
+			goto out;
+		}
+		
+		// the C library asks for the entries in big getdents batches
+		n = 0;
+		while ((de = readdir(d)) != NULL)
+			n++;
+		
+		closedir(d);
+		
+		// timestamp of end test
+		gettimeofday(&stop, NULL);
+		
+		// . and .. are listed too
+		if (n != entries + 2) {
+			printf("listed %d entries out of %d\n", n, entries + 2);
+			avg = -1;
+			goto out;
+		}
+		
+		ElapsedTime(&time, &start, &stop);
+		
+		avg += time.tv_sec * 1000000.0 / times;
+		avg += time.tv_usec / (double) times;
+		
+		printf(".");
+		fflush(stdout);
+	}
+	
+out:
+	for (i = 0; i < entries; i++) {
+		sprintf(path, "%s/tash%07d", dirname, i);
+		unlink(path);
+	}
+	
+	rmdir(dirname);
+	free(path);
+	
+	return avg;
+}
+
+
+
+/*
+ * Runs the readdir test for directories of 1k, 10k and 100k entries and writes
+ * a line with the number of entries and the average time for each one
+ */
+int ReaddirTests (char *dirname, FILE *fout) {
+	static int entries[] = { 1000, 10000, 100000 };
+	double avg;
+	int i;
+	
+	for (i = 0; i < sizeof(entries) / sizeof(entries[0]); i++) {
+		printf("readdir test #%d entries: %d", i+1, entries[i]);
+		fflush(stdout);
+		
+		avg = ReaddirTest(dirname, entries[i], 10);
+		
+		if (avg < 0)
+			return 1;
+		
+		// write to console
+		printf("\nreaddir= %.0f\n\n", avg);
+		
+		// write to output file
+		fprintf(fout, "%d %.0f\n", entries[i], avg);
+	}
+	
+	return 0;
+}
+
+
 int main(int argc, char **argv) {
 	
 	// testing arguments
-	if (argc != 3) {
+	if (argc != 3 && !(argc == 4 && strcmp(argv[1], "-d") == 0)) {
 		printf("\n\tTASH - AshFS Testing utility\n\n");
-		printf("\t./tash <inputfile> <outputfile>\n\n");
+		printf("\t./tash <inputfile> <outputfile>\n");
+		printf("\t./tash -d <dir> <outputfile>\t(readdir test, <dir> is made and removed)\n\n");
 	
 		return 1;
 	}
+	
+	// readdir test
+	if (argc == 4) {
+		FILE* fout = fopen(argv[3], "w");
+		int sw;
+		
+		if (!fout) {
+			printf("bad filename arguments\n");
+			return 1;
+		}
+		
+		sw = ReaddirTests(argv[2], fout);
+		fclose(fout);
+		
+		return sw;
+	}
 
 	// open the input file and output file
 	FILE* fin = fopen(argv[1], "r");
@@ -12,15 +12,17 @@
 #define __ASH_H__
 
 #include <stdint.h>  
+#include <sys/ioctl.h>
  
 #define ASH_MAGIC		0x451
-#define ASH_VERSION		10
+#define ASH_VERSION		15
 #define ASH_SECTORSIZE 		512
 #define ASH_SECTORBITS		9
 
 // these are just default values and can be changed at format
 #define ASH_BLOCKSIZE		4096
 #define ASH_BLOCKBITS		12
+#define ASH_JOURNAL_BLOCKS	256		// most blocks a transaction holds, the journal has one more for its head
 
 // states for the filesystem
 #define ASH_UMOUNT		1
@@ -63,8 +65,19 @@ struct ash_raw_superblock {
 	uint16_t	BATstart;		// block where BAT starts
 	uint16_t	datastart;		// block where data starts
 	uint64_t	fnogen;			// number of generated files. used to get a unique number for new files
+	uint32_t	features;		// ASH_FEATURE_* chosen at format (since version 11)
+	uint32_t	itable;			// first block of the inode table, with ASH_FEATURE_DIRENT2 (since version 12)
+	uint32_t	free_blocks;		// free blocks as of the last sync, right if state is ASH_UMOUNT (since version 13)
+	uint32_t	journal;		// first block of the journal, with ASH_FEATURE_JOURNAL (since version 14)
+	uint32_t	journalblocks;		// size of the journal in blocks, its head included
 };
 
+// values for ash_raw_superblock.features
+#define ASH_FEATURE_EXTENTS	0x0001		// new regular files are extent mapped
+#define ASH_FEATURE_DIRENT2	0x0002		// directories hold ash_raw_dirent entries, records are in the inode table
+#define ASH_FEATURE_JOURNAL	0x0004		// metadata changes go through the journal
+#define ASH_FEATURE_INLINE	0x0008		// small regular files keep their data in their entry
+
 
 
 // values defined for ash_raw_file.ashtype field
@@ -83,6 +96,7 @@ struct ash_raw_superblock {
 struct ash_raw_file {
 	uint16_t	mode;			// Linux file type and access rights
 	uint8_t		ashtype;		// special Ash type
+	uint8_t		flags;			// ASH_FL_* (was padding before version 11)
 	uint32_t	uid;			// owner ID
 	uint32_t	gid;			// group ID
 	uint64_t	size;			// file length in bytes
@@ -94,4 +108,62 @@ struct ash_raw_file {
 	char		name[256];		// filename
 };
 
+// values for ash_raw_file.flags
+#define ASH_FL_EXTENTS		0x01		// startblock is the root of an extent tree, not a BAT chain
+#define ASH_FL_INLINE		0x02		// the data is in the entry, after the end of the name
+#define ASH_FL_UNWRITTEN	0x04		// the last 4 bytes of the name field count the blocks holding data,
+						// the others were preallocated and read as zeroes
+
+
+/*
+ * Compact directory entry, with ASH_FEATURE_DIRENT2: the name and the file
+ * number. The rest of the file's information is its record in the inode table.
+ *
+ */
+struct ash_raw_dirent {
+	uint64_t	fno;			// file number, 0 for a deleted entry
+	uint16_t	rec_len;		// bytes from this entry to the next one
+	uint8_t		name_len;		// the name is not 0 terminated
+	uint8_t		type;			// DT_* of the file
+	char		name[];
+};
+
+
+/*
+ * Record of a file in the inode table, with ASH_FEATURE_DIRENT2: an ash_raw_file
+ * without the name. Record n is the file with fno n.
+ *
+ */
+struct ash_raw_inode {
+	uint16_t	mode;
+	uint8_t		ashtype;
+	uint8_t		flags;
+	uint32_t	uid;
+	uint32_t	gid;
+	uint64_t	size;
+	uint32_t	atime;
+	uint32_t	wtime;
+	uint32_t	ctime;
+	uint32_t	startblock;
+	uint64_t	fno;			// same as the index, 0 for a free record
+	uint32_t	valid;			// blocks holding data, with ASH_FL_UNWRITTEN (since version 15)
+	uint8_t		pad[12];		// 0, keeps records at 64 bytes
+};
+
+
+// lseek origins for the holes of sparse files
+#ifndef SEEK_DATA
+#define SEEK_DATA		3
+#define SEEK_HOLE		4
+#endif
+
+// argument of ASH_IOC_SEEK: SEEK_DATA and SEEK_HOLE through an ioctl, as lseek refuses them
+struct ash_seek {
+	int64_t		offset;			// where to look from, then where the data or the hole is
+	uint32_t	origin;			// SEEK_DATA or SEEK_HOLE
+	uint32_t	pad;
+};
+
+#define ASH_IOC_SEEK		_IOWR('a', 1, struct ash_seek)
+
 #endif /* ash.h */
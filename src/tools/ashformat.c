@@ -75,9 +75,10 @@ unsigned long long getsize(char *device)
  * @bsize block size in bytes for Ash
  * @size device capacity in sectors
  * @name volume name
+ * @features ASH_FEATURE_* flags for the new filesystem
  * @return 0 on ok.
  */
-int format(char *device, uint16_t bsize, unsigned long long size, char *volname)
+int format(char *device, uint16_t bsize, unsigned long long size, char *volname, uint32_t features)
 {
 	// fill in a superblock structure
 	struct ash_raw_superblock s;
@@ -106,6 +107,16 @@ int format(char *device, uint16_t bsize, unsigned long long size, char *volname)
 	
 	s.datastart = s.BATstart + s.BATblocks;
 	
+	// the journal goes between the BAT and the data: a head block, then as many
+	// blocks as the head has room to list
+	if (features & ASH_FEATURE_JOURNAL) {
+		s.journal = s.datastart;
+		s.journalblocks = 1 + ASH_JOURNAL_BLOCKS;
+		if (s.journalblocks > 1 + (s.blocksize - 16U) / 4)
+			s.journalblocks = 1 + (s.blocksize - 16U) / 4;
+		s.datastart += s.journalblocks;
+	}
+	
 	s.mnt_count = 0;
 	s.max_mnt_count = ASH_MAX_MOUNTS;
 	
@@ -120,6 +131,7 @@ int format(char *device, uint16_t bsize, unsigned long long size, char *volname)
 	s.magic = ASH_MAGIC;
 	s.vers = ASH_VERSION;
 	s.fnogen = 1;	// root will have fno = 1. the next inode we build will use fnogen+1 as value
+	s.features = features;
 	
 	strcpy(s.volname, volname);
 	
@@ -138,6 +150,10 @@ int format(char *device, uint16_t bsize, unsigned long long size, char *volname)
 	rentry.startblock = s.datastart + 1;
 	rentry.fno = 1;
 	
+	// the inode table starts with one block, right after the root's first block
+	if (features & ASH_FEATURE_DIRENT2)
+		s.itable = rentry.startblock + 1;
+	
 	// trying to open the device file
 	FILE *fd = fopen(device, "w");
 	if (!fd) {
@@ -150,6 +166,10 @@ int format(char *device, uint16_t bsize, unsigned long long size, char *volname)
 	unsigned char buf[512];
 	memset(buf, 0, 512);	// clear it
 
+	// free after the format: all but up to the first block of the root directory,
+	// and the first block of the inode table
+	s.free_blocks = s.maxblocks - (s.itable ? s.itable + 1 : rentry.startblock + 1);
+	
 	// copy superblock into buffer
 	memcpy(buf, &s, sizeof(s));
 	
@@ -175,8 +195,12 @@ int format(char *device, uint16_t bsize, unsigned long long size, char *volname)
 	}
 	
 	// write the block bitmap
-	int bytes = rentry.startblock / 8;		// how many bytes in UBB we need for the used blocks
-	int bits = 8 - rentry.startblock % 8;		// number of unused bits in last byte
+	int used = rentry.startblock + 1;		// up to the first block of the root directory
+	
+	if (s.itable)
+		used = s.itable + 1;			// and the first block of the inode table
+	int bytes = used / 8;				// how many bytes in UBB we need for the used blocks
+	int bits = 8 - used % 8;			// number of unused bits in last byte
 	uint8_t last = (0xFF >> bits) << bits;	// padding last byte with 0 bits
 
 	// used blocks just by 1 + UBB + BAT cannot be > 512*8 (4096), unless
@@ -219,6 +243,17 @@ int format(char *device, uint16_t bsize, unsigned long long size, char *volname)
 		}
 	}
 	
+	// an empty journal, no transaction to replay
+	nr = s.journalblocks * sectors;
+	
+	for (i = 0; i < nr; i++) {
+		sw = fwrite(buf, 512, 1, fd);
+		if (sw != 1) {
+			printf("error while writing the journal\n");
+			return 1;
+		}
+	}
+	
 	// writing the root directory entry structure
 	sw = fwrite(&rentry, sizeof(rentry), 1, fd);
 	if (sw != 1) {
@@ -226,6 +261,26 @@ int format(char *device, uint16_t bsize, unsigned long long size, char *volname)
 		return 1;
 	}
 	
+	// the inode table must start out with no records in use
+	if (s.itable) {
+		long skip = (long) s.itable * s.blocksize - (long) s.datastart * s.blocksize - sizeof(rentry);
+		
+		memset(buf, 0, 512);
+		
+		if (fseek(fd, skip, SEEK_CUR) != 0) {
+			printf("error while seeking to the inode table\n");
+			return 1;
+		}
+		
+		for (i = 0; i < sectors; i++) {
+			sw = fwrite(buf, 512, 1, fd);
+			if (sw != 1) {
+				printf("error while writing the inode table\n");
+				return 1;
+			}
+		}
+	}
+	
 	// closing device
 	fclose(fd);
 	
@@ -240,7 +295,18 @@ int format(char *device, uint16_t bsize, unsigned long long size, char *volname)
 	printf("max blocks: %d\n", s.maxblocks);
 	printf("UBBblocks: %d\n", s.UBBblocks);
 	printf("BATblocks: %d\n", s.BATblocks);
-	printf("datastart: %d\n\n", s.datastart);
+	printf("datastart: %d\n", s.datastart);
+	printf("file mapping: %s\n", (s.features & ASH_FEATURE_EXTENTS) ? "extents" : "BAT chains");
+	printf("directories: %s\n", (s.features & ASH_FEATURE_DIRENT2) ? "compact entries" : "full entries");
+	if (s.features & ASH_FEATURE_INLINE)
+		printf("small files: in their entries\n");
+	
+	if (s.itable)
+		printf("inode table: %d\n", s.itable);
+	if (s.journal)
+		printf("journal: %d blocks at %d\n", s.journalblocks, s.journal);
+	
+	printf("\n");
 	
 	return 0;
 }
@@ -256,10 +322,14 @@ void instructions()
 {
 	printf("\n\tAshFS Disk Format Utility\n\n");
 	printf("usage:\t");
-	printf("./ashformat <dev> [-b <bsize>] [-n <volname>]\n");
+	printf("./ashformat <dev> [-b <bsize>] [-n <volname>] [-e] [-c] [-j] [-i]\n");
 	printf("<dev>: name of the device to format (ex: /dev/sdb1)\n\n");
-	printf("<bsize>: size of logical block. Must be a multiple of 512. Default 4096\n");
-	printf("<volname>: 15 alfanum for name. Default 'usbstick'\n\n");
+	printf("<bsize>: size of logical block. Must be a power of 2, 512 to 8192. Default 4096\n");
+	printf("<volname>: 15 alfanum for name. Default 'usbstick'\n");
+	printf("-e: map regular files with extents instead of BAT chains\n");
+	printf("-c: compact directory entries, with file records in an inode table\n");
+	printf("-j: journal the metadata, so it is consistent after a crash\n");
+	printf("-i: keep the data of small files in their entries, not with -c\n\n");
 }
 
 
@@ -281,11 +351,13 @@ int main(int argc, char **argv)
 	uint64_t sectors;
 	int bsize;
 	int devicearg;
+	uint32_t features;
 
 	// do some inits
 	devicearg = -1;
 	strcpy(volname, "usbstick");
 	bsize = ASH_BLOCKSIZE;
+	features = 0;
 
 	// start parsing the parameters
 	int p = 1;
@@ -325,6 +397,26 @@ int main(int argc, char **argv)
 			}
 			
 		} else
+			if (strcmp(argv[p],"-e") == 0) {
+				features |= ASH_FEATURE_EXTENTS;
+				p++;
+		
+			} else
+			if (strcmp(argv[p],"-c") == 0) {
+				features |= ASH_FEATURE_DIRENT2;
+				p++;
+		
+			} else
+			if (strcmp(argv[p],"-j") == 0) {
+				features |= ASH_FEATURE_JOURNAL;
+				p++;
+	
+			} else
+			if (strcmp(argv[p],"-i") == 0) {
+				features |= ASH_FEATURE_INLINE;
+				p++;
+	
+			} else
 			if (strcmp(argv[p],"-b") == 0) {
 				if (p+1 >= argc) {
 					printf("you are missing the blocksize parameter\n");
@@ -333,13 +425,14 @@ int main(int argc, char **argv)
 			
 				int r = sscanf(argv[p+1], "%d", &bsize);
 				
-				if (bsize < 512 || bsize > 8096) {
-					printf("blocksize must be between 512 and 8096.\n");
+				if (bsize < 512 || bsize > 8192) {
+					printf("blocksize must be between 512 and 8192.\n");
 					return 1;
 				}
 				
-				if (r == 0 || (bsize != bsize >> 9 << 9)) {
-					printf("blocksize is not a valid multiple of 512.\n");
+				// the kernel module maps blocks onto the device with shifts
+				if (r == 0 || (bsize & (bsize - 1)) != 0) {
+					printf("blocksize must be a power of 2.\n");
 					return 1;
 				}
 				
@@ -355,6 +448,12 @@ int main(int argc, char **argv)
 		return 1;
 	}
 	
+	// the data goes in the name field of full entries, compact ones have no room for it
+	if ((features & ASH_FEATURE_INLINE) && (features & ASH_FEATURE_DIRENT2)) {
+		printf("-i cannot be used with -c\n");
+		return 1;
+	}
+	
 	
 	// get device info
 	sectors = getsize(argv[devicearg]);
@@ -364,7 +463,7 @@ int main(int argc, char **argv)
 	}
 	
 	// format the device media
-	int sw = format(argv[devicearg], bsize, sectors, volname);
+	int sw = format(argv[devicearg], bsize, sectors, volname, features);
 	if (sw == 0) {
 		printf("Formatting OK.\n");
 	} else